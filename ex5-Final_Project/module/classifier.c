@@ -0,0 +1,544 @@
+/*
+In this module the rule table is compiled into a decision tree.
+Each rule is seen as a box in a 7-dimensional space. Every inner node cuts its box along one dimension into
+equal parts, until a node holds few enough rules to be checked one by one.
+*/
+#include "classifier.h"
+#include "fw.h"
+#include "ruler.h"
+
+#include <linux/vmalloc.h>
+
+// The dimensions of the rule space
+typedef enum
+{
+    DIM_DIRECTION,
+    DIM_PROTOCOL,
+    DIM_SRC_IP,
+    DIM_DST_IP,
+    DIM_SRC_PORT,
+    DIM_DST_PORT,
+    DIM_ACK,
+    DIMS,
+    DIM_LEAF = DIMS,
+} dim_t;
+
+// Every dimension spans [0, 2^bits - 1]
+static const __u8 dim_bits[DIMS] = {2, 2, 32, 32, 11, 11, 2};
+
+// Protocol dimension values
+#define PROTO_CLASS_ICMP (0)
+#define PROTO_CLASS_TCP (1)
+#define PROTO_CLASS_UDP (2)
+#define PROTO_CLASS_OTHER (3)
+
+// Port dimension values: a port up to 1023 stands for itself, PORT_ABOVE_1023 for any port above
+#define PORT_CLASS_MAX ((1U << 11) - 1)
+
+// Build parameters
+#define LEAF_RULES (4)     // A node with at most LEAF_RULES rules becomes a leaf
+#define MAX_DEPTH (16)     // Leaves are created unconditionally at this depth
+#define MAX_CUTS (256)     // Maximal amount of children for a node
+#define SPACE_FACTOR (4)   // A node's children may hold at most SPACE_FACTOR times its rules
+#define MAX_NODES (1 << 22)
+#define MAX_REFS (1 << 24)
+
+// An axis-aligned box in the rule space. Node boxes are aligned to their (power of 2) width.
+typedef struct
+{
+    __u32 lo[DIMS];
+    __u32 hi[DIMS];
+    __u8 bits[DIMS]; // node boxes only: hi = lo + 2^bits - 1
+} box_t;
+
+typedef struct
+{
+    const box_t *ranges; // the box of each rule
+    dtree_t *tree;
+    __u32 nodes_capacity;
+    __u32 refs_capacity;
+} builder_t;
+
+static inline __u8 proto_class(__u8 protocol)
+{
+    switch (protocol)
+    {
+    case PROT_ICMP:
+        return PROTO_CLASS_ICMP;
+    case PROT_TCP:
+        return PROTO_CLASS_TCP;
+    case PROT_UDP:
+        return PROTO_CLASS_UDP;
+    default:
+        return PROTO_CLASS_OTHER;
+    }
+}
+
+static inline __u32 port_class(__be16 port)
+{
+    return (port > 1023) ? PORT_ABOVE_1023 : port;
+}
+
+/**
+ * Fill the keys of a packet, one per dimension
+ */
+static inline void packet2keys(const packet_t *packet, __u32 *keys)
+{
+    keys[DIM_DIRECTION] = packet->direction;
+    keys[DIM_PROTOCOL] = proto_class(packet->protocol);
+    keys[DIM_SRC_IP] = packet->src_ip;
+    keys[DIM_DST_IP] = packet->dst_ip;
+    keys[DIM_SRC_PORT] = port_class(packet->src_port);
+    keys[DIM_DST_PORT] = port_class(packet->dst_port);
+    keys[DIM_ACK] = packet->ack;
+}
+
+static void ip2range(__be32 ip, __u8 prefix_size, __u32 *lo, __u32 *hi)
+{
+    __u32 mask;
+
+    if (prefix_size == PREFIX_IP_ANY)
+    {
+        *lo = 0;
+        *hi = ~0U;
+        return;
+    }
+    mask = ~0U << (32 - prefix_size);
+    *lo = ip & mask;
+    *hi = *lo | ~mask;
+}
+
+static void port2range(__be16 port, __u32 *lo, __u32 *hi)
+{
+    switch (port)
+    {
+    case PORT_ANY:
+        *lo = 0;
+        *hi = PORT_CLASS_MAX;
+        break;
+    case PORT_ABOVE_1023:
+        *lo = PORT_ABOVE_1023;
+        *hi = PORT_CLASS_MAX;
+        break;
+    default:
+        *lo = *hi = port;
+    }
+}
+
+/**
+ * Translate a rule to its box. "Any" values span the whole dimension, so they cover every node.
+ */
+static void rule2range(const rule_t *rule, box_t *range)
+{
+    range->lo[DIM_DIRECTION] = (rule->direction == DIRECTION_ANY) ? 0 : rule->direction;
+    range->hi[DIM_DIRECTION] = (rule->direction == DIRECTION_ANY) ? 3 : rule->direction;
+
+    range->lo[DIM_PROTOCOL] = (rule->protocol == PROT_ANY) ? 0 : proto_class(rule->protocol);
+    range->hi[DIM_PROTOCOL] = (rule->protocol == PROT_ANY) ? 3 : proto_class(rule->protocol);
+
+    ip2range(rule->src_ip, rule->src_prefix_size, &range->lo[DIM_SRC_IP], &range->hi[DIM_SRC_IP]);
+    ip2range(rule->dst_ip, rule->dst_prefix_size, &range->lo[DIM_DST_IP], &range->hi[DIM_DST_IP]);
+
+    port2range(rule->src_port, &range->lo[DIM_SRC_PORT], &range->hi[DIM_SRC_PORT]);
+    port2range(rule->dst_port, &range->lo[DIM_DST_PORT], &range->hi[DIM_DST_PORT]);
+
+    range->lo[DIM_ACK] = (rule->ack == ACK_ANY) ? 0 : rule->ack;
+    range->hi[DIM_ACK] = (rule->ack == ACK_ANY) ? 3 : rule->ack;
+}
+
+static inline int is_intersecting(const box_t *range, const box_t *box, dim_t dim)
+{
+    return range->lo[dim] <= box->hi[dim] && box->lo[dim] <= range->hi[dim];
+}
+
+static inline int is_covering(const box_t *range, const box_t *box, dim_t dim)
+{
+    return range->lo[dim] <= box->lo[dim] && box->hi[dim] <= range->hi[dim];
+}
+
+static inline int has_proto(const box_t *box, __u32 proto)
+{
+    return box->lo[DIM_PROTOCOL] <= proto && proto <= box->hi[DIM_PROTOCOL];
+}
+
+/**
+ * Tells whether a rule may match some packet in the box.
+ * Mirrors is_rule_match(): ICMP packets ignore the ports, and only TCP packets check the ack.
+ */
+static int is_rule_in_box(const box_t *range, const box_t *box)
+{
+    if (!is_intersecting(range, box, DIM_DIRECTION) || !is_intersecting(range, box, DIM_PROTOCOL) ||
+        !is_intersecting(range, box, DIM_SRC_IP) || !is_intersecting(range, box, DIM_DST_IP))
+    {
+        return 0;
+    }
+
+    if (has_proto(range, PROTO_CLASS_ICMP) && has_proto(box, PROTO_CLASS_ICMP))
+    {
+        return 1;
+    }
+    if (!is_intersecting(range, box, DIM_SRC_PORT) || !is_intersecting(range, box, DIM_DST_PORT))
+    {
+        return 0;
+    }
+
+    if (has_proto(range, PROTO_CLASS_UDP) && has_proto(box, PROTO_CLASS_UDP))
+    {
+        return 1;
+    }
+    return is_intersecting(range, box, DIM_ACK);
+}
+
+/**
+ * Tells whether a rule matches every packet in the box. Then the rules after it are never reached.
+ */
+static int is_rule_covering_box(const box_t *range, const box_t *box)
+{
+    if (!is_covering(range, box, DIM_DIRECTION) || !is_covering(range, box, DIM_PROTOCOL) ||
+        !is_covering(range, box, DIM_SRC_IP) || !is_covering(range, box, DIM_DST_IP))
+    {
+        return 0;
+    }
+
+    if (box->hi[DIM_PROTOCOL] != PROTO_CLASS_ICMP &&
+        (!is_covering(range, box, DIM_SRC_PORT) || !is_covering(range, box, DIM_DST_PORT)))
+    {
+        return 0;
+    }
+
+    if ((has_proto(box, PROTO_CLASS_TCP) || has_proto(box, PROTO_CLASS_OTHER)) && !is_covering(range, box, DIM_ACK))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Tells whether a node may cut along a dimension.
+ * Ports may be cut only when the box has no ICMP packets, and the ack only when it has no ICMP nor UDP packets.
+ */
+static int is_cuttable(const box_t *box, dim_t dim)
+{
+    if (box->bits[dim] == 0)
+    {
+        return 0;
+    }
+    switch (dim)
+    {
+    case DIM_SRC_PORT:
+    case DIM_DST_PORT:
+        return !has_proto(box, PROTO_CLASS_ICMP);
+    case DIM_ACK:
+        return !has_proto(box, PROTO_CLASS_ICMP) && !has_proto(box, PROTO_CLASS_UDP);
+    default:
+        return 1;
+    }
+}
+
+/**
+ * Sum of the rules in all the children, when cutting the box along dim into 2^cut_bits parts
+ */
+static __u64 children_refs(const builder_t *b, const __u32 *rules, __u32 amount, const box_t *box, dim_t dim,
+                           __u8 cut_bits)
+{
+    __u8 shift = box->bits[dim] - cut_bits;
+    const box_t *range;
+    __u32 i, first, last;
+    __u64 sum = 0;
+
+    for (i = 0; i < amount; i++)
+    {
+        range = b->ranges + rules[i];
+        first = (max(range->lo[dim], box->lo[dim]) - box->lo[dim]) >> shift;
+        last = (min(range->hi[dim], box->hi[dim]) - box->lo[dim]) >> shift;
+        sum += last - first + 1;
+    }
+    return sum;
+}
+
+/**
+ * Grow an array (allocated with kvmalloc) to hold at least needed elements
+ */
+static void *grow_array(void *array, __u32 *capacity, __u32 needed, size_t size)
+{
+    void *grown;
+    __u32 new_capacity = max(*capacity, 64U);
+
+    if (array != NULL && needed <= *capacity)
+    {
+        return array;
+    }
+    while (new_capacity < needed)
+    {
+        new_capacity *= 2;
+    }
+
+    grown = kvmalloc(new_capacity * size, GFP_KERNEL);
+    if (grown == NULL)
+    {
+        return NULL;
+    }
+    memcpy(grown, array, *capacity * size);
+    kvfree(array);
+    *capacity = new_capacity;
+    return grown;
+}
+
+/**
+ * Reserve amount consecutive nodes, returns the index of the first one (or -1)
+ */
+static long alloc_nodes(builder_t *b, __u32 amount)
+{
+    dtree_t *tree = b->tree;
+    __u32 first = tree->stats.nodes;
+    dtree_node_t *nodes;
+
+    if (first + amount > MAX_NODES)
+    {
+        return -1;
+    }
+    nodes = grow_array(tree->nodes, &b->nodes_capacity, first + amount, sizeof(dtree_node_t));
+    if (nodes == NULL)
+    {
+        return -1;
+    }
+    tree->nodes = nodes;
+    tree->stats.nodes += amount;
+    return first;
+}
+
+static int make_leaf(builder_t *b, __u32 node_index, const __u32 *rules, __u32 amount, __u32 depth)
+{
+    dtree_t *tree = b->tree;
+    dtree_node_t *leaf = tree->nodes + node_index;
+    __u32 first = tree->stats.refs;
+    __u32 *refs;
+
+    if (first + amount > MAX_REFS)
+    {
+        return -ENOMEM;
+    }
+    refs = grow_array(tree->refs, &b->refs_capacity, first + amount, sizeof(__u32));
+    if (refs == NULL)
+    {
+        return -ENOMEM;
+    }
+    tree->refs = refs;
+    memcpy(refs + first, rules, amount * sizeof(__u32));
+
+    leaf->dim = DIM_LEAF;
+    leaf->shift = 0;
+    leaf->mask = 0;
+    leaf->first = first;
+    leaf->amount = amount;
+
+    tree->stats.refs += amount;
+    tree->stats.leaves++;
+    tree->stats.depth = max(tree->stats.depth, depth);
+    tree->stats.max_leaf_rules = max(tree->stats.max_leaf_rules, amount);
+    return 0;
+}
+
+/**
+ * Keep only the rules of the box, and drop the rules which are shadowed by a covering rule
+ */
+static __u32 filter_rules(const builder_t *b, const __u32 *rules, __u32 amount, const box_t *box, __u32 *filtered)
+{
+    __u32 i, count = 0;
+    const box_t *range;
+
+    for (i = 0; i < amount; i++)
+    {
+        range = b->ranges + rules[i];
+        if (is_rule_in_box(range, box))
+        {
+            filtered[count++] = rules[i];
+            if (is_rule_covering_box(range, box))
+            {
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * Picks the cut of a node: for each dimension, cut into as many parts as the space allows,
+ * and take the dimension whose children hold the fewest rules on average.
+ * Returns 0 if no dimension separates the rules (every rule would reach every child).
+ */
+static int choose_cut(const builder_t *b, const __u32 *rules, __u32 amount, const box_t *box, dim_t *dim,
+                      __u8 *cut_bits)
+{
+    __u64 refs, best_refs = 0;
+    __u8 bits, best_bits = 0;
+    int d;
+
+    for (d = 0; d < DIMS; d++)
+    {
+        if (!is_cuttable(box, d))
+        {
+            continue;
+        }
+
+        bits = 1;
+        while ((1U << (bits + 1)) <= MAX_CUTS && bits + 1 <= box->bits[d] &&
+               children_refs(b, rules, amount, box, d, bits + 1) + (1U << (bits + 1)) <=
+                   (__u64)SPACE_FACTOR * amount)
+        {
+            bits++;
+        }
+
+        refs = children_refs(b, rules, amount, box, d, bits);
+        if (refs == ((__u64)amount << bits))
+        {
+            continue; // No separation at all
+        }
+
+        // Compare the averages: refs / 2^bits < best_refs / 2^best_bits
+        if (best_bits == 0 || (refs << best_bits) < (best_refs << bits))
+        {
+            best_refs = refs;
+            best_bits = bits;
+            *dim = d;
+        }
+    }
+
+    *cut_bits = best_bits;
+    return best_bits != 0;
+}
+
+static int build_node(builder_t *b, __u32 node_index, const __u32 *rules, __u32 amount, const box_t *box,
+                      __u32 depth)
+{
+    dtree_node_t *node;
+    box_t child_box;
+    __u32 *child_rules;
+    __u32 i, children, child_amount;
+    long first;
+    dim_t dim = DIM_LEAF;
+    __u8 cut_bits = 0;
+    int ret = 0;
+
+    if (amount <= LEAF_RULES || depth == MAX_DEPTH || !choose_cut(b, rules, amount, box, &dim, &cut_bits))
+    {
+        return make_leaf(b, node_index, rules, amount, depth);
+    }
+
+    children = 1U << cut_bits;
+    first = alloc_nodes(b, children);
+    child_rules = kvmalloc(amount * sizeof(__u32), GFP_KERNEL);
+    if (first < 0 || child_rules == NULL)
+    {
+        kvfree(child_rules);
+        return -ENOMEM;
+    }
+
+    node = b->tree->nodes + node_index;
+    node->dim = dim;
+    node->shift = box->bits[dim] - cut_bits;
+    node->mask = children - 1;
+    node->first = first;
+    node->amount = 0;
+
+    child_box = *box;
+    child_box.bits[dim] = node->shift;
+    for (i = 0; i < children && ret == 0; i++)
+    {
+        child_box.lo[dim] = box->lo[dim] + (i << child_box.bits[dim]);
+        child_box.hi[dim] = child_box.lo[dim] + (__u32)((1ULL << child_box.bits[dim]) - 1);
+
+        child_amount = filter_rules(b, rules, amount, &child_box, child_rules);
+        ret = build_node(b, first + i, child_rules, child_amount, &child_box, depth + 1);
+    }
+
+    kvfree(child_rules);
+    return ret;
+}
+
+/**
+ * Compile a (valid) rule table into a decision tree.
+ * Returns NULL on failure, in which case the rules should be scanned linearly.
+ */
+dtree_t *build_dtree(const rule_t *rules, __u32 amount)
+{
+    builder_t b = {0};
+    box_t root_box;
+    box_t *ranges;
+    __u32 *root_rules;
+    __u32 i, root_amount;
+    int d, ret = -ENOMEM;
+
+    b.tree = kzalloc(sizeof(dtree_t), GFP_KERNEL);
+    ranges = kvmalloc((amount + 1) * sizeof(box_t), GFP_KERNEL);
+    root_rules = kvmalloc((amount + 1) * sizeof(__u32), GFP_KERNEL);
+    if (b.tree == NULL || ranges == NULL || root_rules == NULL)
+    {
+        goto out;
+    }
+
+    for (i = 0; i < amount; i++)
+    {
+        rule2range(rules + i, ranges + i);
+        root_rules[i] = i;
+    }
+    b.ranges = ranges;
+
+    for (d = 0; d < DIMS; d++)
+    {
+        root_box.bits[d] = dim_bits[d];
+        root_box.lo[d] = 0;
+        root_box.hi[d] = (__u32)((1ULL << dim_bits[d]) - 1);
+    }
+
+    if (alloc_nodes(&b, 1) == 0)
+    {
+        root_amount = filter_rules(&b, root_rules, amount, &root_box, root_rules);
+        ret = build_node(&b, 0, root_rules, root_amount, &root_box, 0);
+    }
+
+out:
+    kvfree(root_rules);
+    kvfree(ranges);
+    if (ret != 0)
+    {
+        free_dtree(b.tree);
+        return NULL;
+    }
+
+    b.tree->stats.rules = amount;
+    b.tree->stats.memory =
+        sizeof(dtree_t) + b.nodes_capacity * sizeof(dtree_node_t) + b.refs_capacity * sizeof(__u32);
+    DINFO("Decision tree: depth = %u, nodes = %u, refs = %u", b.tree->stats.depth, b.tree->stats.nodes,
+          b.tree->stats.refs)
+    return b.tree;
+}
+
+void free_dtree(dtree_t *tree)
+{
+    if (tree == NULL)
+    {
+        return;
+    }
+    kvfree(tree->nodes);
+    kvfree(tree->refs);
+    kfree(tree);
+}
+
+/**
+ * Returns the candidate rule indices for a packet (in ascending order)
+ */
+const __u32 *dtree_lookup(const dtree_t *tree, const packet_t *packet, __u32 *amount)
+{
+    const dtree_node_t *node = tree->nodes;
+    __u32 keys[DIMS];
+
+    packet2keys(packet, keys);
+    while (node->dim != DIM_LEAF)
+    {
+        node = tree->nodes + node->first + ((keys[node->dim] >> node->shift) & node->mask);
+    }
+
+    *amount = node->amount;
+    return tree->refs + node->first;
+}
@@ -0,0 +1,47 @@
+/*
+In this module we compile the rule table into a decision tree (in the HiCuts style).
+Looking up a packet in the tree yields a short list of candidate rules, which preserves first-match semantics.
+*/
+#ifndef _CLASSIFIER_H_
+#define _CLASSIFIER_H_
+
+#include "fw.h"
+#include "parser.h"
+
+// Decision tree node: an inner node cuts one dimension into (mask + 1) equal parts, a leaf holds candidate rules
+typedef struct
+{
+    __u8 dim;     // cut dimension, or DIM_LEAF
+    __u8 shift;   // child index = (key >> shift) & mask
+    __u16 mask;   // amount of children - 1
+    __u32 first;  // inner node: index of the first child, leaf: index of the first candidate in refs
+    __u32 amount; // leaf: amount of candidates
+} dtree_node_t;
+
+// Decision tree statistics
+typedef struct
+{
+    __u32 rules;
+    __u32 depth;
+    __u32 nodes;
+    __u32 leaves;
+    __u32 refs;           // total candidates stored in the leaves
+    __u32 max_leaf_rules; // worst-case amount of rules checked per packet
+    __u32 memory;         // bytes
+} dtree_stats_t;
+
+typedef struct
+{
+    dtree_node_t *nodes; // nodes[0] is the root
+    __u32 *refs;         // rule indices (ascending in each leaf)
+    dtree_stats_t stats;
+} dtree_t;
+
+// Compile a (valid) rule table. Returns NULL on failure, in which case the rules should be scanned linearly.
+dtree_t *build_dtree(const rule_t *rules, __u32 amount);
+void free_dtree(dtree_t *tree);
+
+// Returns the candidate rule indices for a packet (in ascending order)
+const __u32 *dtree_lookup(const dtree_t *tree, const packet_t *packet, __u32 *amount);
+
+#endif
@@ -0,0 +1,558 @@
+/*
+In this module we benchmark the packet path in userspace: the ns per packet of fw_inspect(),
+by the amount of rules, connections and log rows. Every run checks the verdicts of its packets first.
+    make && ./bench [iterations] [rules,...] [connections,...] [log rows,...]
+e.g. ./bench 100000 1,100 1000,10000 1000 (an argument that is left out, or is -, keeps its default)
+*/
+#include "compat.h"
+#include "filter.h"
+#include "fw.h"
+#include "logger.h"
+#include "proxy.h"
+#include "ruler.h"
+#include "tracker.h"
+#include "zone.h"
+
+#define INT_IFINDEX (3)
+#define EXT_IFINDEX (4)
+
+// The packets of a run are taken round robin from a set of this many flows
+#define FLOWS_SAMPLE (256)
+
+// The packets timed in each run (by default)
+#define ITERATIONS (1 << 20)
+
+// The most amounts a sweep may have
+#define MAX_SWEEP (16)
+
+// The log rows read from the log device at a time
+#define LOG_READ_ROWS (256)
+
+// Internal hosts (10.10.0.0/16) talk to an external server (198.51.100.1)
+#define CLIENT_IP(i) (0x0A0A0000 + (i))
+#define SERVER_IP (0xC6336401)
+#define CLIENT_PORT (40000)
+#define SERVER_PORT (443)
+
+#define TCP_FLAG_FIN (0x01)
+#define TCP_FLAG_SYN (0x02)
+#define TCP_FLAG_ACK (0x10)
+
+// A packet in its own buffer, as it comes to the hook
+typedef struct
+{
+    unsigned char data[sizeof(struct iphdr) + sizeof(struct tcphdr)];
+    struct sk_buff skb;
+    struct nf_hook_state state;
+} bench_packet_t;
+
+// The amounts a table (or the log) is benchmarked with, growing (each run adds to the state of the previous one)
+typedef struct
+{
+    __u32 amounts[MAX_SWEEP];
+    __u32 length;
+} sweep_t;
+
+static struct net_device *int_dev, *ext_dev;
+static bench_packet_t sample[FLOWS_SAMPLE];
+
+static __u32 iterations = ITERATIONS;
+static sweep_t rule_sweep = {{1, 10, 100, 1000, 10000}, 5};
+static sweep_t connection_sweep = {{1000, 10000, 100000, 500000}, 4};
+static sweep_t log_sweep = {{1000, 10000, 100000, 500000}, 4};
+
+/**
+ * Build a packet of a flow (the addresses are in host order), which came from the given interface
+ */
+static void build_packet(bench_packet_t *packet, __u8 protocol, __u32 src_ip, __u32 dst_ip, __u16 src_port,
+                         __u16 dst_port, __u8 tcp_flags, struct net_device *in)
+{
+    struct iphdr *iph = (struct iphdr *)packet->data;
+    struct tcphdr *tcph = (struct tcphdr *)(packet->data + sizeof(struct iphdr));
+    struct udphdr *udph = (struct udphdr *)tcph;
+
+    memset(packet, 0, sizeof(*packet));
+    iph->version = 4;
+    iph->ihl = sizeof(struct iphdr) / 4;
+    iph->ttl = 64;
+    iph->protocol = protocol;
+    iph->saddr = htonl(src_ip);
+    iph->daddr = htonl(dst_ip);
+
+    if (protocol == PROT_TCP)
+    {
+        tcph->source = htons(src_port);
+        tcph->dest = htons(dst_port);
+        tcph->doff = sizeof(struct tcphdr) / 4;
+        tcph->fin = !!(tcp_flags & TCP_FLAG_FIN);
+        tcph->syn = !!(tcp_flags & TCP_FLAG_SYN);
+        tcph->ack = !!(tcp_flags & TCP_FLAG_ACK);
+        iph->tot_len = htons(sizeof(struct iphdr) + sizeof(struct tcphdr));
+    }
+    else
+    {
+        udph->source = htons(src_port);
+        udph->dest = htons(dst_port);
+        udph->len = htons(sizeof(struct udphdr));
+        iph->tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr));
+    }
+
+    packet->skb.head = packet->data;
+    packet->skb.data = packet->data;
+    packet->skb.len = ntohs(iph->tot_len);
+    packet->skb.network_header = 0;
+    packet->skb.transport_header = sizeof(struct iphdr);
+
+    packet->state.hook = NF_INET_PRE_ROUTING;
+    packet->state.pf = PF_INET;
+    packet->state.in = in;
+    packet->state.net = &init_net;
+}
+
+static unsigned int inspect(bench_packet_t *packet)
+{
+    return fw_inspect(NULL, &packet->skb, &packet->state);
+}
+
+/**
+ * Pass a TCP flow through its handshake. Returns 0 if it was established.
+ */
+static int establish_flow(__u32 client)
+{
+    bench_packet_t packet;
+
+    build_packet(&packet, PROT_TCP, CLIENT_IP(client), SERVER_IP, CLIENT_PORT, SERVER_PORT, TCP_FLAG_SYN, int_dev);
+    if (inspect(&packet) != NF_ACCEPT)
+    {
+        return -1;
+    }
+    build_packet(&packet, PROT_TCP, SERVER_IP, CLIENT_IP(client), SERVER_PORT, CLIENT_PORT,
+                 TCP_FLAG_SYN | TCP_FLAG_ACK, ext_dev);
+    if (inspect(&packet) != NF_ACCEPT)
+    {
+        return -1;
+    }
+    build_packet(&packet, PROT_TCP, CLIENT_IP(client), SERVER_IP, CLIENT_PORT, SERVER_PORT, TCP_FLAG_ACK, int_dev);
+    return (inspect(&packet) == NF_ACCEPT) ? 0 : -1;
+}
+
+/**
+ * Upload a rule table of amount rules: UDP rules that drop other hosts, and if match_all is set, a last rule that
+ * accepts all instead (otherwise no packet of the benchmark matches a rule)
+ */
+static int load_rules(__u32 amount, int match_all)
+{
+    struct file filp;
+    loff_t off = 0;
+    rule_t rule;
+    size_t size = sizeof(amount) + (size_t)amount * RULE_SIZE;
+    char *buf = (char *)malloc(size), *p;
+    __u32 i;
+    int err;
+
+    if (buf == NULL)
+    {
+        return -ENOMEM;
+    }
+    memcpy(buf, &amount, sizeof(amount));
+    p = buf + sizeof(amount);
+
+    for (i = 0; i < amount; i++)
+    {
+        memset(&rule, 0, sizeof(rule));
+        snprintf(rule.rule_name, sizeof(rule.rule_name), "rule%u", i);
+        rule.direction = DIRECTION_ANY;
+        rule.protocol = PROT_ANY;
+        rule.ack = ACK_ANY;
+        rule.action = NF_ACCEPT;
+        if (i + 1 < amount || !match_all)
+        {
+            // 172.16.0.0/12 hosts, to a spread of ports
+            rule.src_ip = 0xAC100000 + i;
+            rule.src_prefix_size = 32;
+            rule.dst_port = 1 + i % 1023;
+            rule.protocol = PROT_UDP;
+            rule.action = NF_DROP;
+        }
+        rule2buf(&rule, p);
+        p += RULE_SIZE;
+    }
+
+    memset(&filp, 0, sizeof(filp));
+    filp.f_mode = FMODE_WRITE;
+    err = open_rules(NULL, &filp);
+    if (err == 0)
+    {
+        err = (write_rules(&filp, buf, size, &off) == (ssize_t)size) ? flush_rules(&filp, NULL) : -EINVAL;
+        release_rules(NULL, &filp);
+    }
+    free(buf);
+    return err;
+}
+
+/**
+ * Empty the log (the warm up of the next run adds the rows of its flows)
+ */
+static int reset_log_rows(void)
+{
+    free_log();
+    return init_log();
+}
+
+/**
+ * Read the log through its device: the amount of rows, and the count of the row of the flow from src_ip (the rows
+ * keep the addresses in host order), or 0 if it has none. Returns 0 on success.
+ */
+static int read_log_count(__u32 src_ip, __u32 *rows, unsigned int *count)
+{
+    struct file filp;
+    loff_t off = 0;
+    char *data = (char *)malloc(sizeof(__u32) + LOG_READ_ROWS * LOG_ROW_BUF_SIZE);
+    const char *buf;
+    log_row_t row;
+    ssize_t length;
+    int err;
+
+    if (data == NULL)
+    {
+        return -ENOMEM;
+    }
+    memset(&filp, 0, sizeof(filp));
+    err = open_log(NULL, &filp);
+    if (err != 0)
+    {
+        free(data);
+        return err;
+    }
+
+    *count = 0;
+    length = read_log(&filp, data, sizeof(__u32) + LOG_READ_ROWS * LOG_ROW_BUF_SIZE, &off);
+    if (length < (ssize_t)sizeof(__u32))
+    {
+        release_log(NULL, &filp);
+        free(data);
+        return -EINVAL;
+    }
+    memcpy(rows, data, sizeof(__u32));
+    buf = data + sizeof(__u32);
+    length -= sizeof(__u32);
+
+    while (length >= LOG_ROW_BUF_SIZE)
+    {
+        for (; length >= LOG_ROW_BUF_SIZE; length -= LOG_ROW_BUF_SIZE)
+        {
+            BUF2VAR(row.timestamp);
+            BUF2VAR(row.protocol);
+            BUF2VAR(row.action);
+            BUF2VAR(row.src_ip);
+            BUF2VAR(row.dst_ip);
+            BUF2VAR(row.src_port);
+            BUF2VAR(row.dst_port);
+            BUF2VAR(row.reason);
+            BUF2VAR(row.count);
+            if (row.src_ip == src_ip)
+            {
+                *count = row.count;
+            }
+        }
+        length = read_log(&filp, data, LOG_READ_ROWS * LOG_ROW_BUF_SIZE, &off);
+        buf = data;
+    }
+    release_log(NULL, &filp);
+    free(data);
+    return (length < 0) ? (int)length : 0;
+}
+
+/**
+ * Pass the sample packets once (which warms the caches up), and check they get the verdict.
+ * Returns 0 if they all did.
+ */
+static int check_sample(__u32 sample_size, unsigned int verdict, const char *scenario)
+{
+    unsigned int result;
+    __u32 i;
+
+    for (i = 0; i < sample_size; i++)
+    {
+        result = inspect(sample + i);
+        if (result != verdict)
+        {
+            fprintf(stderr, "bench: %s: packet %u got %s\n", scenario, i, (result == NF_ACCEPT) ? "accept" : "drop");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Time iterations of the sample packets. Returns the ns per packet.
+ */
+static double time_sample(__u32 sample_size)
+{
+    struct timespec begin, end;
+    __u32 i;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < iterations; i++)
+    {
+        inspect(sample + (i % sample_size));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / iterations;
+}
+
+/**
+ * UDP packets, accepted by the last rule of tables of growing size, then dropped by them for matching no rule
+ */
+static int bench_rules(void)
+{
+    __u32 i;
+    int match_all;
+
+    for (i = 0; i < FLOWS_SAMPLE; i++)
+    {
+        build_packet(sample + i, PROT_UDP, CLIENT_IP(i), SERVER_IP, CLIENT_PORT, 53, 0, int_dev);
+    }
+
+    for (i = 0; i < rule_sweep.length; i++)
+    {
+        for (match_all = 1; match_all >= 0; match_all--)
+        {
+            if (load_rules(rule_sweep.amounts[i], match_all) != 0 || reset_log_rows() != 0)
+            {
+                fprintf(stderr, "bench: failed to load %u rules\n", rule_sweep.amounts[i]);
+                return -1;
+            }
+            if (check_sample(FLOWS_SAMPLE, match_all ? NF_ACCEPT : NF_DROP, match_all ? "last rule" : "no match") != 0)
+            {
+                return -1;
+            }
+            printf("udp, %6u rules%s %8.1f ns/packet\n", rule_sweep.amounts[i], match_all ? "         " : ", no match",
+                   time_sample(FLOWS_SAMPLE));
+        }
+    }
+    return 0;
+}
+
+/**
+ * Established TCP packets, in connection tables of growing size
+ */
+static int bench_connections(void)
+{
+    __u32 established = 0, amount, sample_size, i;
+
+    if (load_rules(1, 1) != 0)
+    {
+        fprintf(stderr, "bench: failed to load the rules\n");
+        return -1;
+    }
+
+    for (i = 0; i < connection_sweep.length; i++)
+    {
+        amount = connection_sweep.amounts[i];
+        for (; established < amount; established++)
+        {
+            if (establish_flow(established) != 0)
+            {
+                fprintf(stderr, "bench: the handshake of connection %u was dropped\n", established);
+                return -1;
+            }
+
+            // Let the garbage collector grow the table, as it would in the background
+            if (established % 1024 == 0)
+            {
+                compat_quiesce();
+            }
+        }
+        compat_quiesce();
+
+        // Spread the sample over the table
+        sample_size = min(amount, (__u32)FLOWS_SAMPLE);
+        for (established = 0; established < sample_size; established++)
+        {
+            build_packet(sample + established, PROT_TCP, CLIENT_IP(established * (amount / sample_size)), SERVER_IP,
+                         CLIENT_PORT, SERVER_PORT, TCP_FLAG_ACK, int_dev);
+        }
+        established = amount;
+
+        if (reset_log_rows() != 0 || check_sample(sample_size, NF_ACCEPT, "established") != 0)
+        {
+            return -1;
+        }
+        printf("tcp, %6u connections    %8.1f ns/packet\n", amount, time_sample(sample_size));
+    }
+    return 0;
+}
+
+/**
+ * UDP packets that update rows of logs of growing size. Each run checks that its packets were aggregated: they add
+ * no row, and count in the rows of their flows.
+ */
+static int bench_log(void)
+{
+    bench_packet_t packet;
+    __u32 rows = 0, amount, sample_size, logged_rows = 0, i;
+    unsigned int count = 0, expected = 0; // the count of the row of the first flow (which is in every sample)
+    double ns;
+
+    if (load_rules(1, 1) != 0 || reset_log_rows() != 0)
+    {
+        fprintf(stderr, "bench: failed to load the rules\n");
+        return -1;
+    }
+
+    for (i = 0; i < log_sweep.length; i++)
+    {
+        amount = log_sweep.amounts[i];
+        expected += (rows == 0);
+
+        // A row per flow
+        for (; rows < amount; rows++)
+        {
+            build_packet(&packet, PROT_UDP, CLIENT_IP(rows), SERVER_IP, CLIENT_PORT, 53, 0, int_dev);
+            inspect(&packet);
+
+            // Let the resize worker grow the index, as it would in the background
+            if (rows % 1024 == 0)
+            {
+                compat_quiesce();
+            }
+        }
+        compat_quiesce();
+
+        sample_size = min(amount, (__u32)FLOWS_SAMPLE);
+        for (rows = 0; rows < sample_size; rows++)
+        {
+            build_packet(sample + rows, PROT_UDP, CLIENT_IP(rows * (amount / sample_size)), SERVER_IP, CLIENT_PORT,
+                         53, 0, int_dev);
+        }
+        rows = amount;
+
+        if (check_sample(sample_size, NF_ACCEPT, "log rows") != 0)
+        {
+            return -1;
+        }
+        ns = time_sample(sample_size);
+        expected += 1 + (iterations + sample_size - 1) / sample_size;
+
+        if (read_log_count(CLIENT_IP(0), &logged_rows, &count) != 0 || logged_rows != amount || count != expected)
+        {
+            fprintf(stderr, "bench: %u log rows: read %u rows, and a count of %u (expected %u)\n", amount, logged_rows,
+                    count, expected);
+            return -1;
+        }
+        printf("udp, %6u log rows       %8.1f ns/packet\n", amount, ns);
+    }
+    return 0;
+}
+
+/**
+ * Parse a list of growing amounts, separated by commas, into sweep ("-" keeps it as is). Returns 0 if it's valid.
+ */
+static int parse_sweep(const char *arg, sweep_t *sweep)
+{
+    unsigned long amount;
+    char *end;
+
+    if (strcmp(arg, "-") == 0)
+    {
+        return 0;
+    }
+
+    sweep->length = 0;
+    do
+    {
+        amount = strtoul(arg, &end, 10);
+        if (end == arg || amount == 0 || amount > UINT32_MAX || sweep->length == MAX_SWEEP ||
+            (sweep->length > 0 && amount <= sweep->amounts[sweep->length - 1]))
+        {
+            return -EINVAL;
+        }
+        sweep->amounts[sweep->length++] = amount;
+        arg = end + 1;
+    } while (*end == ',');
+
+    return (*end == '\0') ? 0 : -EINVAL;
+}
+
+/**
+ * Parse the arguments (see the usage above). Returns 0 if they are valid.
+ */
+static int parse_args(int argc, char *argv[])
+{
+    unsigned long amount;
+    char *end;
+
+    if (argc > 5)
+    {
+        return -EINVAL;
+    }
+    if (argc > 1 && strcmp(argv[1], "-") != 0)
+    {
+        amount = strtoul(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || amount == 0 || amount > UINT32_MAX)
+        {
+            return -EINVAL;
+        }
+        iterations = amount;
+    }
+    if ((argc > 2 && parse_sweep(argv[2], &rule_sweep) != 0) ||
+        (argc > 3 && parse_sweep(argv[3], &connection_sweep) != 0) || (argc > 4 && parse_sweep(argv[4], &log_sweep) != 0))
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int err = 1;
+
+    if (parse_args(argc, argv) != 0)
+    {
+        fprintf(stderr, "usage: %s [iterations] [rules,...] [connections,...] [log rows,...]\n", argv[0]);
+        return 2;
+    }
+
+    int_dev = compat_add_netdev(INT_NET_DEVICE_NAME, INT_IFINDEX);
+    ext_dev = compat_add_netdev(EXT_NET_DEVICE_NAME, EXT_IFINDEX);
+    if (int_dev == NULL || ext_dev == NULL)
+    {
+        goto failed_netdevs;
+    }
+    if (init_zones() != 0)
+    {
+        goto failed_netdevs;
+    }
+    if (init_log() != 0)
+    {
+        goto failed_log;
+    }
+    if (init_proxy() != 0)
+    {
+        goto failed_proxy;
+    }
+    if (init_connections() != 0)
+    {
+        goto failed_connections;
+    }
+
+    if (bench_rules() == 0 && bench_connections() == 0 && bench_log() == 0)
+    {
+        err = 0;
+    }
+
+    free_connections();
+failed_connections:
+    free_proxy();
+failed_proxy:
+    free_rules();
+    free_log();
+failed_log:
+    free_zones();
+failed_netdevs:
+    compat_quiesce();
+    compat_free_netdevs();
+    return err;
+}
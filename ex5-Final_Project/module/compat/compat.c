@@ -0,0 +1,336 @@
+/*
+In this module we implement the kernel services of compat.h.
+*/
+#include "compat.h"
+
+unsigned long jiffies = 0;
+struct net init_net;
+struct workqueue_struct *system_wq = NULL;
+
+/*
+ * Memory
+ */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, unsigned long flags,
+                                     void (*ctor)(void *))
+{
+    struct kmem_cache *cache = (struct kmem_cache *)malloc(sizeof(struct kmem_cache));
+    if (cache != NULL)
+    {
+        cache->size = size;
+    }
+    return cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    free(cache);
+}
+
+mempool_t *mempool_create_slab_pool(int min_nr, struct kmem_cache *cache)
+{
+    mempool_t *pool = (mempool_t *)malloc(sizeof(mempool_t));
+    if (pool != NULL)
+    {
+        pool->cache = cache;
+    }
+    return pool;
+}
+
+void mempool_destroy(mempool_t *pool)
+{
+    free(pool);
+}
+
+ssize_t simple_read_from_buffer(void *to, size_t count, loff_t *ppos, const void *from, size_t available)
+{
+    loff_t pos = *ppos;
+
+    if (pos < 0)
+    {
+        return -EINVAL;
+    }
+    if ((size_t)pos >= available || count == 0)
+    {
+        return 0;
+    }
+    count = min(count, available - (size_t)pos);
+    memcpy(to, (const char *)from + pos, count);
+    *ppos = pos + count;
+    return count;
+}
+
+ssize_t strscpy(char *dest, const char *src, size_t count)
+{
+    size_t length;
+
+    if (count == 0)
+    {
+        return -E2BIG;
+    }
+    length = strnlen(src, count);
+    if (length == count)
+    {
+        memcpy(dest, src, count - 1);
+        dest[count - 1] = '\0';
+        return -E2BIG;
+    }
+    memcpy(dest, src, length + 1);
+    return length;
+}
+
+// The seeds don't need to be secret here, only to vary
+void get_random_bytes(void *buf, int nbytes)
+{
+    unsigned char *bytes = (unsigned char *)buf;
+    int i;
+
+    for (i = 0; i < nbytes; i++)
+    {
+        bytes[i] = (unsigned char)rand();
+    }
+}
+
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+    return -ENODEV;
+}
+
+/*
+ * RCU and deferred work
+ */
+
+static struct rcu_head *rcu_pending = NULL;
+static struct delayed_work *work_pending = NULL;
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    head->func = func;
+    head->next = rcu_pending;
+    rcu_pending = head;
+}
+
+/**
+ * Run the callbacks queued so far (they may queue more, which wait for the next grace period)
+ */
+static void run_rcu_callbacks(void)
+{
+    struct rcu_head *head = rcu_pending, *next;
+    unsigned long offset;
+
+    rcu_pending = NULL;
+    for (; head != NULL; head = next)
+    {
+        next = head->next;
+        offset = (unsigned long)head->func;
+
+        // kfree_rcu() passes an offset (which is smaller than a page) instead of a callback
+        if (offset < PAGE_SIZE)
+        {
+            free((char *)head - offset);
+        }
+        else
+        {
+            head->func(head);
+        }
+    }
+}
+
+void synchronize_rcu(void)
+{
+    run_rcu_callbacks();
+}
+
+void rcu_barrier(void)
+{
+    while (rcu_pending != NULL)
+    {
+        run_rcu_callbacks();
+    }
+}
+
+static void dequeue_work(struct delayed_work *dwork)
+{
+    struct delayed_work **link;
+
+    for (link = &work_pending; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == dwork)
+        {
+            *link = dwork->next;
+            break;
+        }
+    }
+    dwork->work.pending = 0;
+}
+
+int schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
+{
+    if (dwork->work.pending)
+    {
+        return 0;
+    }
+    dwork->expires = jiffies + delay;
+    dwork->work.pending = 1;
+    dwork->next = work_pending;
+    work_pending = dwork;
+    return 1;
+}
+
+int mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay)
+{
+    int was_pending = dwork->work.pending;
+
+    dequeue_work(dwork);
+    schedule_delayed_work(dwork, delay);
+    return was_pending;
+}
+
+int cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+    int was_pending = dwork->work.pending;
+
+    dequeue_work(dwork);
+    return was_pending;
+}
+
+/**
+ * Run one due work item. Returns 0 if none is due.
+ */
+static int run_due_work(void)
+{
+    struct delayed_work *dwork;
+
+    for (dwork = work_pending; dwork != NULL; dwork = dwork->next)
+    {
+        if (!time_before(jiffies, dwork->expires))
+        {
+            // The work may schedule itself again
+            dequeue_work(dwork);
+            dwork->func(&dwork->work);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void compat_quiesce(void)
+{
+    while (run_due_work())
+    {
+    }
+    rcu_barrier();
+}
+
+void compat_advance(unsigned long ticks)
+{
+    jiffies += ticks;
+}
+
+/*
+ * Checksums (incremental update, RFC 1624)
+ */
+
+static __sum16 csum_update(__sum16 check, const void *from, const void *to, size_t length)
+{
+    const __u16 *old_words = (const __u16 *)from, *new_words = (const __u16 *)to;
+    u32 sum = (u16)~check;
+    size_t i;
+
+    for (i = 0; i < length / 2; i++)
+    {
+        sum += (u16)~old_words[i];
+        sum += new_words[i];
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (__sum16)~sum;
+}
+
+void csum_replace4(__sum16 *sum, __be32 from, __be32 to)
+{
+    *sum = csum_update(*sum, &from, &to, sizeof(from));
+}
+
+// The packets are built whole, so the pseudo header is part of the checksum just like the rest
+void inet_proto_csum_replace4(__sum16 *sum, struct sk_buff *skb, __be32 from, __be32 to, bool pseudohdr)
+{
+    *sum = csum_update(*sum, &from, &to, sizeof(from));
+}
+
+void inet_proto_csum_replace2(__sum16 *sum, struct sk_buff *skb, __be16 from, __be16 to, bool pseudohdr)
+{
+    *sum = csum_update(*sum, &from, &to, sizeof(from));
+}
+
+/*
+ * Network devices
+ */
+
+#define MAX_NETDEVS (16)
+
+static struct net_device *netdevs[MAX_NETDEVS];
+static int netdevs_amount = 0;
+
+struct net_device *compat_add_netdev(const char *name, int ifindex)
+{
+    struct net_device *dev;
+
+    if (netdevs_amount == MAX_NETDEVS)
+    {
+        return NULL;
+    }
+    dev = (struct net_device *)calloc(1, sizeof(struct net_device));
+    if (dev == NULL)
+    {
+        return NULL;
+    }
+    strscpy(dev->name, name, IFNAMSIZ);
+    dev->ifindex = ifindex;
+    dev->net = &init_net;
+    netdevs[netdevs_amount++] = dev;
+    return dev;
+}
+
+void compat_free_netdevs(void)
+{
+    while (netdevs_amount > 0)
+    {
+        free(netdevs[--netdevs_amount]);
+    }
+}
+
+struct net_device *__dev_get_by_name(struct net *net, const char *name)
+{
+    int i;
+
+    for (i = 0; i < netdevs_amount; i++)
+    {
+        if (netdevs[i]->net == net && strncmp(netdevs[i]->name, name, IFNAMSIZ) == 0)
+        {
+            return netdevs[i];
+        }
+    }
+    return NULL;
+}
+
+// The devices are registered before the core starts, so nothing is ever notified
+int register_netdevice_notifier(struct notifier_block *nb)
+{
+    return 0;
+}
+
+int unregister_netdevice_notifier(struct notifier_block *nb)
+{
+    return 0;
+}
+
+void rtnl_lock(void)
+{
+}
+
+void rtnl_unlock(void)
+{
+}
@@ -0,0 +1,882 @@
+/*
+In this module we provide the kernel API the filtering core uses, on top of the C library.
+It lets the same sources build into a userspace library (libfwcore), for unit tests and microbenchmarks.
+
+The userspace "kernel" has a single CPU and a single thread:
+ - locks are no-ops, and so are the RCU read sections
+ - call_rcu() callbacks and delayed work wait for compat_quiesce() (or synchronize_rcu() / rcu_barrier())
+ - jiffies only move by compat_advance()
+*/
+#ifndef _COMPAT_H_
+#define _COMPAT_H_
+
+// The C library has an id_t of its own, while the firewall defines one
+#define id_t __libc_id_t
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#undef id_t
+
+/*
+ * Types and compiler helpers
+ */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef u8 __u8;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef s32 __s32;
+typedef s64 __s64;
+typedef u16 __be16;
+typedef u32 __be32;
+typedef u16 __sum16;
+typedef u32 __wsum;
+typedef unsigned int gfp_t;
+typedef _Bool bool;
+
+#define true 1
+#define false 0
+
+#define __init
+#define __exit
+#define __user
+#define __rcu
+#define __percpu
+#define __read_mostly
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define container_of(ptr, type, member) ((type *)((char *)(ptr)-offsetof(type, member)))
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+#define IS_ERR(p) ((unsigned long)(p) >= (unsigned long)-4095)
+#define PTR_ERR(p) ((long)(p))
+
+static inline int fls(unsigned int x)
+{
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline int ilog2(unsigned long x)
+{
+    return 63 - __builtin_clzl(x);
+}
+
+/*
+ * Messages go to stderr, so they don't mix with the results of a benchmark
+ */
+
+#define KERN_INFO ""
+#define KERN_ERR ""
+#define printk(message, ...) fprintf(stderr, message, ##__VA_ARGS__)
+
+/*
+ * Modules
+ */
+
+struct module;
+#define THIS_MODULE ((struct module *)0)
+#define MODULE_LICENSE(license)
+#define MODULE_AUTHOR(author)
+#define module_init(function)
+#define module_exit(function)
+
+/*
+ * Memory
+ */
+
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define GFP_KERNEL 0u
+#define GFP_ATOMIC 1u
+#define __GFP_NOWARN 2u
+#define __GFP_ZERO 4u
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+    return (flags & __GFP_ZERO) ? calloc(1, size) : malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+    return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+    return calloc(n, size);
+}
+
+static inline void kfree(const void *p)
+{
+    free((void *)p);
+}
+
+#define kmalloc_array(n, size, flags) kcalloc(n, size, flags)
+#define kvmalloc(size, flags) kmalloc(size, flags)
+#define kvzalloc(size, flags) kzalloc(size, flags)
+#define kvfree(p) kfree(p)
+#define vmalloc(size) malloc(size)
+#define vzalloc(size) calloc(1, size)
+#define vmalloc_user(size) calloc(1, size)
+#define vfree(p) kfree(p)
+#define vzalloc_node(size, node) vzalloc(size)
+
+// Slab caches and mempools are plain allocations (the reserve of a mempool is ignored)
+#define SLAB_HWCACHE_ALIGN 0x2000UL
+
+struct kmem_cache
+{
+    size_t size;
+};
+
+typedef struct
+{
+    struct kmem_cache *cache;
+} mempool_t;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, unsigned long flags,
+                                     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cache);
+mempool_t *mempool_create_slab_pool(int min_nr, struct kmem_cache *cache);
+void mempool_destroy(mempool_t *pool);
+
+static inline void *mempool_alloc(mempool_t *pool, gfp_t flags)
+{
+    return malloc(pool->cache->size);
+}
+
+static inline void mempool_free(void *element, mempool_t *pool)
+{
+    free(element);
+}
+
+// The "user" memory is ours as well
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+ssize_t simple_read_from_buffer(void *to, size_t count, loff_t *ppos, const void *from, size_t available);
+ssize_t strscpy(char *dest, const char *src, size_t count);
+
+void get_random_bytes(void *buf, int nbytes);
+
+static inline void sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *),
+                        void (*swap)(void *, void *, int))
+{
+    qsort(base, num, size, cmp);
+}
+
+/*
+ * Lists (the RCU variants are the plain ones, there are no concurrent readers)
+ */
+
+struct list_head
+{
+    struct list_head *next, *prev;
+};
+
+struct hlist_head
+{
+    struct hlist_node *first;
+};
+
+struct hlist_node
+{
+    struct hlist_node *next, **pprev;
+};
+
+#define LIST_HEAD_INIT(name) {&(name), &(name)}
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev, struct list_head *next)
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+static inline int list_is_last(const struct list_head *list, const struct list_head *head)
+{
+    return list->next == head;
+}
+
+static inline void list_splice_init(struct list_head *list, struct list_head *head)
+{
+    struct list_head *first = list->next, *last = list->prev, *at = head->next;
+
+    if (list_empty(list))
+    {
+        return;
+    }
+    first->prev = head;
+    head->next = first;
+    last->next = at;
+    at->prev = last;
+    INIT_LIST_HEAD(list);
+}
+
+#define list_add_tail_rcu list_add_tail
+#define list_del_rcu list_del
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, __typeof__(*(pos)), member)
+
+#define list_for_each(pos, head) for (pos = (head)->next; pos != (head); pos = pos->next)
+
+#define list_for_each_entry(pos, head, member)                                                                         \
+    for (pos = list_first_entry(head, __typeof__(*pos), member); &pos->member != (head);                              \
+         pos = list_next_entry(pos, member))
+
+#define list_for_each_entry_continue(pos, head, member)                                                                \
+    for (pos = list_next_entry(pos, member); &pos->member != (head); pos = list_next_entry(pos, member))
+
+#define list_for_each_entry_safe(pos, n, head, member)                                                                 \
+    for (pos = list_first_entry(head, __typeof__(*pos), member), n = list_next_entry(pos, member);                    \
+         &pos->member != (head); pos = n, n = list_next_entry(n, member))
+
+#define list_for_each_entry_rcu list_for_each_entry
+#define list_for_each_entry_continue_rcu list_for_each_entry_continue
+
+static inline void INIT_HLIST_HEAD(struct hlist_head *head)
+{
+    head->first = NULL;
+}
+
+static inline void INIT_HLIST_NODE(struct hlist_node *node)
+{
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+static inline int hlist_unhashed(const struct hlist_node *node)
+{
+    return node->pprev == NULL;
+}
+
+static inline int hlist_empty(const struct hlist_head *head)
+{
+    return head->first == NULL;
+}
+
+static inline void __hlist_del(struct hlist_node *node)
+{
+    struct hlist_node *next = node->next, **pprev = node->pprev;
+
+    *pprev = next;
+    if (next != NULL)
+    {
+        next->pprev = pprev;
+    }
+}
+
+static inline void hlist_del(struct hlist_node *node)
+{
+    __hlist_del(node);
+    INIT_HLIST_NODE(node);
+}
+
+static inline void hlist_del_init(struct hlist_node *node)
+{
+    if (!hlist_unhashed(node))
+    {
+        hlist_del(node);
+    }
+}
+
+static inline void hlist_add_head(struct hlist_node *node, struct hlist_head *head)
+{
+    struct hlist_node *first = head->first;
+
+    node->next = first;
+    if (first != NULL)
+    {
+        first->pprev = &node->next;
+    }
+    head->first = node;
+    node->pprev = &head->first;
+}
+
+#define hlist_del_rcu __hlist_del
+#define hlist_del_init_rcu hlist_del_init
+#define hlist_add_head_rcu hlist_add_head
+
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+#define hlist_entry_safe(ptr, type, member)                                                                            \
+    ({                                                                                                                 \
+        __typeof__(ptr) ____ptr = (ptr);                                                                               \
+        ____ptr ? hlist_entry(____ptr, type, member) : NULL;                                                           \
+    })
+
+#define hlist_for_each_entry(pos, head, member)                                                                        \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos;                                      \
+         pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+
+#define hlist_for_each_entry_safe(pos, n, head, member)                                                                \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); pos && ({                               \
+             n = pos->member.next;                                                                                     \
+             1;                                                                                                        \
+         });                                                                                                           \
+         pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+#define hlist_for_each_entry_rcu hlist_for_each_entry
+
+/*
+ * Hashing (the kernel's jhash)
+ */
+
+static inline u32 rol32(u32 word, unsigned int shift)
+{
+    return (word << shift) | (word >> ((-shift) & 31));
+}
+
+#define JHASH_INITVAL 0xdeadbeef
+
+static inline u32 __jhash_nwords(u32 a, u32 b, u32 c, u32 initval)
+{
+    a += initval;
+    b += initval;
+    c += initval;
+
+    c ^= b;
+    c -= rol32(b, 14);
+    a ^= c;
+    a -= rol32(c, 11);
+    b ^= a;
+    b -= rol32(a, 25);
+    c ^= b;
+    c -= rol32(b, 16);
+    a ^= c;
+    a -= rol32(c, 4);
+    b ^= a;
+    b -= rol32(a, 14);
+    c ^= b;
+    c -= rol32(b, 24);
+    return c;
+}
+
+static inline u32 jhash_3words(u32 a, u32 b, u32 c, u32 initval)
+{
+    return __jhash_nwords(a, b, c, initval + JHASH_INITVAL + (3 << 2));
+}
+
+static inline u32 jhash_2words(u32 a, u32 b, u32 initval)
+{
+    return __jhash_nwords(a, b, 0, initval + JHASH_INITVAL + (2 << 2));
+}
+
+static inline u32 jhash_1word(u32 a, u32 initval)
+{
+    return __jhash_nwords(a, 0, 0, initval + JHASH_INITVAL + (1 << 2));
+}
+
+/*
+ * Atomics and barriers
+ */
+
+typedef struct
+{
+    int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i) {(i)}
+#define atomic_read(a) ((a)->counter)
+#define atomic_set(a, i) ((a)->counter = (i))
+#define atomic_inc(a) ((void)__atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(a) ((void)__atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_inc_return(a) __atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Locking (single thread: nothing to exclude)
+ */
+
+typedef struct
+{
+    int locked;
+} spinlock_t;
+
+struct mutex
+{
+    int locked;
+};
+
+#define __SPIN_LOCK_UNLOCKED(name) {0}
+#define DEFINE_SPINLOCK(name) spinlock_t name = __SPIN_LOCK_UNLOCKED(name)
+#define DEFINE_MUTEX(name) struct mutex name = {0}
+
+#define spin_lock_init(lock) ((lock)->locked = 0)
+#define spin_lock(lock) ((lock)->locked = 1)
+#define spin_unlock(lock) ((lock)->locked = 0)
+#define spin_lock_bh(lock) spin_lock(lock)
+#define spin_unlock_bh(lock) spin_unlock(lock)
+#define mutex_init(lock) ((lock)->locked = 0)
+#define mutex_lock(lock) ((lock)->locked = 1)
+#define mutex_unlock(lock) ((lock)->locked = 0)
+#define lockdep_is_held(lock) ((void)(lock), 1)
+
+static inline void local_bh_disable(void)
+{
+}
+
+static inline void local_bh_enable(void)
+{
+}
+
+static inline void preempt_disable(void)
+{
+}
+
+static inline void preempt_enable(void)
+{
+}
+
+static inline void cond_resched(void)
+{
+}
+
+typedef struct
+{
+    unsigned int sequence;
+} seqcount_t;
+
+#define seqcount_init(s) ((s)->sequence = 0)
+#define read_seqcount_begin(s) ((s)->sequence)
+#define read_seqcount_retry(s, start) ((s)->sequence != (start))
+#define write_seqcount_begin(s) ((s)->sequence++)
+#define write_seqcount_end(s) ((s)->sequence++)
+
+/*
+ * RCU: readers never run concurrently, the callbacks wait for a quiescent state
+ */
+
+struct rcu_head
+{
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+#define rcu_read_lock()
+#define rcu_read_unlock()
+#define rcu_dereference(p) (p)
+#define rcu_dereference_protected(p, c) ((void)(c), (p))
+#define rcu_access_pointer(p) (p)
+#define rcu_assign_pointer(p, v) ((p) = (v))
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+void rcu_barrier(void);
+
+// Like the kernel, the offset of the rcu_head is passed instead of a callback
+#define kfree_rcu(p, field) call_rcu(&(p)->field, (void (*)(struct rcu_head *))offsetof(__typeof__(*(p)), field))
+
+/*
+ * Per-CPU data (a single CPU)
+ */
+
+#define nr_cpu_ids 1
+#define smp_processor_id() 0
+#define cpu_to_node(cpu) 0
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++)
+
+#define DEFINE_PER_CPU(type, name) type name
+#define DECLARE_PER_CPU(type, name) extern type name
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) ((void)(cpu), (p))
+#define this_cpu_ptr(p) (p)
+#define this_cpu_inc(var) ((var)++)
+#define this_cpu_add(var, n) ((var) += (n))
+
+/*
+ * Static keys (a plain flag)
+ */
+
+struct static_key_false
+{
+    int enabled;
+};
+
+#define DEFINE_STATIC_KEY_FALSE(name) struct static_key_false name = {0}
+#define DECLARE_STATIC_KEY_FALSE(name) extern struct static_key_false name
+#define static_branch_unlikely(key) unlikely((key)->enabled)
+#define static_branch_enable(key) ((key)->enabled = 1)
+#define static_branch_disable(key) ((key)->enabled = 0)
+#define static_key_enabled(key) ((key)->enabled)
+
+/*
+ * Time and deferred work
+ */
+
+#define HZ 100
+
+extern unsigned long jiffies;
+
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+
+static inline void getnstimeofday(struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+}
+
+static inline u64 local_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct work_struct
+{
+    int pending;
+};
+
+struct delayed_work
+{
+    struct work_struct work;
+    void (*func)(struct work_struct *work);
+    unsigned long expires;
+    struct delayed_work *next; // in the pending list
+};
+
+struct workqueue_struct;
+extern struct workqueue_struct *system_wq;
+
+#define DECLARE_DELAYED_WORK(name, function) struct delayed_work name = {{0}, function, 0, NULL}
+
+int schedule_delayed_work(struct delayed_work *dwork, unsigned long delay);
+int mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay);
+int cancel_delayed_work_sync(struct delayed_work *dwork);
+
+/*
+ * Networking
+ */
+
+#define NF_DROP 0
+#define NF_ACCEPT 1
+
+enum nf_inet_hooks
+{
+    NF_INET_PRE_ROUTING,
+    NF_INET_LOCAL_IN,
+    NF_INET_FORWARD,
+    NF_INET_LOCAL_OUT,
+    NF_INET_POST_ROUTING,
+    NF_INET_NUMHOOKS
+};
+
+#define PF_INET 2
+#define NF_IP_PRI_FIRST (-2147483647 - 1)
+#define IFNAMSIZ 16
+
+struct net
+{
+    int dummy;
+};
+
+extern struct net init_net;
+
+struct net_device
+{
+    char name[IFNAMSIZ];
+    int ifindex;
+    struct net *net;
+};
+
+static inline struct net *dev_net(const struct net_device *dev)
+{
+    return dev->net;
+}
+
+static inline int net_eq(const struct net *net1, const struct net *net2)
+{
+    return net1 == net2;
+}
+
+struct sk_buff;
+
+struct nf_hook_state
+{
+    unsigned int hook;
+    u8 pf;
+    struct net_device *in;
+    struct net_device *out;
+    struct net *net;
+};
+
+typedef unsigned int nf_hookfn(void *priv, struct sk_buff *skb, const struct nf_hook_state *state);
+
+struct nf_hook_ops
+{
+    nf_hookfn *hook;
+    unsigned int hooknum;
+    u8 pf;
+    int priority;
+};
+
+// A packet in a linear buffer: the headers are at offsets from head
+struct sk_buff
+{
+    unsigned char *head;
+    unsigned char *data;
+    unsigned int len;
+    u16 network_header;
+    u16 transport_header;
+};
+
+struct iphdr
+{
+    u8 ihl : 4, version : 4;
+    u8 tos;
+    __be16 tot_len;
+    __be16 id;
+    __be16 frag_off;
+    u8 ttl;
+    u8 protocol;
+    __sum16 check;
+    __be32 saddr;
+    __be32 daddr;
+};
+
+struct tcphdr
+{
+    __be16 source;
+    __be16 dest;
+    __be32 seq;
+    __be32 ack_seq;
+    u16 res1 : 4, doff : 4, fin : 1, syn : 1, rst : 1, psh : 1, ack : 1, urg : 1, ece : 1, cwr : 1;
+    __be16 window;
+    __sum16 check;
+    __be16 urg_ptr;
+};
+
+struct udphdr
+{
+    __be16 source;
+    __be16 dest;
+    __be16 len;
+    __sum16 check;
+};
+
+static inline unsigned char *skb_network_header(const struct sk_buff *skb)
+{
+    return skb->head + skb->network_header;
+}
+
+static inline unsigned char *skb_transport_header(const struct sk_buff *skb)
+{
+    return skb->head + skb->transport_header;
+}
+
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb)
+{
+    return (struct iphdr *)skb_network_header(skb);
+}
+
+static inline unsigned int ip_hdrlen(const struct sk_buff *skb)
+{
+    return ip_hdr(skb)->ihl * 4;
+}
+
+static inline struct tcphdr *tcp_hdr(const struct sk_buff *skb)
+{
+    return (struct tcphdr *)skb_transport_header(skb);
+}
+
+static inline struct udphdr *udp_hdr(const struct sk_buff *skb)
+{
+    return (struct udphdr *)skb_transport_header(skb);
+}
+
+// The buffers are never shared
+static inline int skb_ensure_writable(struct sk_buff *skb, int write_len)
+{
+    return (write_len <= (int)skb->len) ? 0 : -ENOMEM;
+}
+
+void csum_replace4(__sum16 *sum, __be32 from, __be32 to);
+void inet_proto_csum_replace4(__sum16 *sum, struct sk_buff *skb, __be32 from, __be32 to, bool pseudohdr);
+void inet_proto_csum_replace2(__sum16 *sum, struct sk_buff *skb, __be16 from, __be16 to, bool pseudohdr);
+
+// Network devices: the ones of init_net are registered by the user of the library
+#define NOTIFY_DONE 0
+#define NETDEV_REGISTER 5
+#define NETDEV_UNREGISTER 6
+#define NETDEV_CHANGENAME 10
+
+struct notifier_block
+{
+    int (*notifier_call)(struct notifier_block *nb, unsigned long event, void *ptr);
+    struct notifier_block *next;
+};
+
+#define netdev_notifier_info_to_dev(ptr) ((struct net_device *)(ptr))
+#define rtnl_dereference(p) (p)
+
+struct net_device *__dev_get_by_name(struct net *net, const char *name);
+int register_netdevice_notifier(struct notifier_block *nb);
+int unregister_netdevice_notifier(struct notifier_block *nb);
+void rtnl_lock(void);
+void rtnl_unlock(void);
+
+/*
+ * Devices: the core only implements their operations, which are called directly
+ */
+
+struct inode;
+struct kobject;
+struct class;
+struct device;
+typedef void *fl_owner_t;
+
+#define FMODE_READ 1
+#define FMODE_WRITE 2
+
+struct file
+{
+    void *private_data;
+    unsigned int f_flags;
+    unsigned int f_mode;
+    loff_t f_pos;
+};
+
+struct vm_area_struct
+{
+    unsigned long vm_start, vm_end, vm_pgoff, vm_flags;
+};
+
+struct file_operations
+{
+    struct module *owner;
+    int (*open)(struct inode *inode, struct file *filp);
+    ssize_t (*read)(struct file *filp, char *buf, size_t length, loff_t *offp);
+    ssize_t (*write)(struct file *filp, const char *buf, size_t length, loff_t *offp);
+    int (*flush)(struct file *filp, fl_owner_t id);
+    int (*release)(struct inode *inode, struct file *filp);
+    int (*mmap)(struct file *filp, struct vm_area_struct *vma);
+    long (*unlocked_ioctl)(struct file *filp, unsigned int cmd, unsigned long arg);
+};
+
+struct attribute
+{
+    const char *name;
+    unsigned short mode;
+};
+
+struct device_attribute
+{
+    struct attribute attr;
+    ssize_t (*show)(struct device *dev, struct device_attribute *attr, char *buf);
+    ssize_t (*store)(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+};
+
+struct bin_attribute
+{
+    struct attribute attr;
+    size_t size;
+    ssize_t (*read)(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off,
+                    size_t count);
+};
+
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff);
+
+// ioctl numbers
+#define _IOC(dir, type, nr, size) (((dir) << 30) | ((size) << 16) | ((type) << 8) | (nr))
+#define _IOW(type, nr, arg) _IOC(1U, (type), (nr), sizeof(arg))
+#define _IOR(type, nr, arg) _IOC(2U, (type), (nr), sizeof(arg))
+#define _IOWR(type, nr, arg) _IOC(3U, (type), (nr), sizeof(arg))
+
+/*
+ * Trace events are compiled out (as if they were never enabled)
+ */
+
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)                                                        \
+    static inline void trace_##name(proto)                                                                             \
+    {                                                                                                                  \
+    }
+#define TP_PROTO(args...) args
+
+/*
+ * The userspace "kernel"
+ */
+
+// A quiescent state: run the due RCU callbacks and delayed work
+void compat_quiesce(void);
+
+// Move the time forward (in jiffies)
+void compat_advance(unsigned long ticks);
+
+// Register a network device of init_net (for the zone table). Returns the device, or NULL.
+struct net_device *compat_add_netdev(const char *name, int ifindex);
+void compat_free_netdevs(void);
+
+#endif
@@ -0,0 +1 @@
+#include "../../compat.h"
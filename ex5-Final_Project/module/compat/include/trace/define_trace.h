@@ -0,0 +1 @@
+// The trace events are compiled out, see TRACE_EVENT in compat.h
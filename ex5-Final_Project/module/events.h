@@ -0,0 +1,182 @@
+/*
+In this module we define the trace events of the packet path.
+The events are off by default (a patched-out branch), and are switched at runtime through tracefs:
+    echo 1 > /sys/kernel/debug/tracing/events/firewall/enable
+    cat /sys/kernel/debug/tracing/trace_pipe
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM firewall
+
+#if !defined(_EVENTS_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _EVENTS_H_
+
+#include "fw.h"
+#include "parser.h"
+#include "proxy.h"
+#include "tracker.h"
+
+#include <linux/tracepoint.h>
+
+#define show_hooknum(hooknum)                                                                                          \
+    __print_symbolic(hooknum, {NF_INET_PRE_ROUTING, "pre_routing"}, {NF_INET_LOCAL_OUT, "local_out"})
+
+#define show_direction(direction)                                                                                      \
+    __print_symbolic(direction, {DIRECTION_NONE, "none"}, {DIRECTION_IN, "in"}, {DIRECTION_OUT, "out"})
+
+#define show_verdict(verdict) __print_symbolic(verdict, {NF_ACCEPT, "accept"}, {NF_DROP, "drop"})
+
+#define show_packet_type(type)                                                                                         \
+    __print_symbolic(type, {PACKET_TYPE_ICMP, "icmp"}, {PACKET_TYPE_UDP, "udp"}, {PACKET_TYPE_TCP, "tcp"},             \
+                     {PACKET_TYPE_FW, "fw"}, {PACKET_TYPE_LOOPBACK, "loopback"},                                       \
+                     {PACKET_TYPE_OTHER_PROTOCOL, "other"})
+
+#define show_tcp_status(status)                                                                                        \
+    __print_symbolic(status, {PRESYN, "PRESYN"}, {SYN, "SYN"}, {SYN_ACK, "SYN_ACK"}, {ESTABLISHED, "ESTABLISHED"},    \
+                     {FIN1, "FIN1"}, {A_ACK, "A_ACK"}, {A_FIN2, "A_FIN2"}, {B_FIN2, "B_FIN2"}, {B_ACK, "B_ACK"})
+
+#define show_proxy_route(route)                                                                                        \
+    __print_symbolic(route, {ROUTE_C2P, "c2p"}, {ROUTE_S2P, "s2p"}, {ROUTE_P2S, "p2s"}, {ROUTE_P2C, "p2c"})
+
+/**
+ * A parsed packet (every packet the hooks see)
+ */
+TRACE_EVENT(fw_packet,
+    TP_PROTO(const packet_t *packet),
+    TP_ARGS(packet),
+
+    TP_STRUCT__entry(
+        __field(__u32, src_ip)
+        __field(__u32, dst_ip)
+        __field(__u16, src_port)
+        __field(__u16, dst_port)
+        __field(__u8, protocol)
+        __field(__u8, type)
+        __field(__u8, direction)
+        __field(__u8, hooknum)
+    ),
+
+    TP_fast_assign(
+        __entry->src_ip = packet->src_ip;
+        __entry->dst_ip = packet->dst_ip;
+        __entry->src_port = packet->src_port;
+        __entry->dst_port = packet->dst_port;
+        __entry->protocol = packet->protocol;
+        __entry->type = packet->type;
+        __entry->direction = packet->direction;
+        __entry->hooknum = packet->hooknum;
+    ),
+
+    TP_printk("hook=%s type=%s direction=%s protocol=%u src=%u.%u.%u.%u:%u dst=%u.%u.%u.%u:%u",
+              show_hooknum(__entry->hooknum), show_packet_type(__entry->type), show_direction(__entry->direction),
+              __entry->protocol, IP_PARTS(__entry->src_ip), __entry->src_port, IP_PARTS(__entry->dst_ip),
+              __entry->dst_port)
+);
+
+/**
+ * The verdict of the rule table: reason is the index of the matching rule, or a negative reason_t
+ */
+TRACE_EVENT(fw_rule_verdict,
+    TP_PROTO(const packet_t *packet, int reason, __u8 verdict),
+    TP_ARGS(packet, reason, verdict),
+
+    TP_STRUCT__entry(
+        __field(__u32, src_ip)
+        __field(__u32, dst_ip)
+        __field(__u16, src_port)
+        __field(__u16, dst_port)
+        __field(int, reason)
+        __field(__u8, protocol)
+        __field(__u8, verdict)
+    ),
+
+    TP_fast_assign(
+        __entry->src_ip = packet->src_ip;
+        __entry->dst_ip = packet->dst_ip;
+        __entry->src_port = packet->src_port;
+        __entry->dst_port = packet->dst_port;
+        __entry->reason = reason;
+        __entry->protocol = packet->protocol;
+        __entry->verdict = verdict;
+    ),
+
+    TP_printk("protocol=%u src=%u.%u.%u.%u:%u dst=%u.%u.%u.%u:%u reason=%d verdict=%s", __entry->protocol,
+              IP_PARTS(__entry->src_ip), __entry->src_port, IP_PARTS(__entry->dst_ip), __entry->dst_port,
+              __entry->reason, show_verdict(__entry->verdict))
+);
+
+/**
+ * A TCP packet enforced on its connection: the status before and after, and the answer of enforce_state()
+ */
+TRACE_EVENT(fw_conntrack,
+    TP_PROTO(const packet_t *packet, const struct tcphdr *tcph, tcp_status_t before, tcp_status_t after, int ret),
+    TP_ARGS(packet, tcph, before, after, ret),
+
+    TP_STRUCT__entry(
+        __field(__u32, src_ip)
+        __field(__u32, dst_ip)
+        __field(__u16, src_port)
+        __field(__u16, dst_port)
+        __field(int, ret)
+        __field(__u8, direction)
+        __field(__u8, syn)
+        __field(__u8, ack)
+        __field(__u8, fin)
+        __field(__u8, before)
+        __field(__u8, after)
+    ),
+
+    TP_fast_assign(
+        __entry->src_ip = packet->src_ip;
+        __entry->dst_ip = packet->dst_ip;
+        __entry->src_port = packet->src_port;
+        __entry->dst_port = packet->dst_port;
+        __entry->ret = ret;
+        __entry->direction = packet->direction;
+        __entry->syn = tcph->syn;
+        __entry->ack = tcph->ack;
+        __entry->fin = tcph->fin;
+        __entry->before = before;
+        __entry->after = after;
+    ),
+
+    TP_printk("direction=%s src=%u.%u.%u.%u:%u dst=%u.%u.%u.%u:%u syn=%u ack=%u fin=%u %s -> %s ret=%d",
+              show_direction(__entry->direction), IP_PARTS(__entry->src_ip), __entry->src_port,
+              IP_PARTS(__entry->dst_ip), __entry->dst_port, __entry->syn, __entry->ack, __entry->fin,
+              show_tcp_status(__entry->before), show_tcp_status(__entry->after), __entry->ret)
+);
+
+/**
+ * A packet redirected through a proxy, with its addresses after the rewrite
+ */
+TRACE_EVENT(fw_proxy_redirect,
+    TP_PROTO(const packet_t *packet, proxy_route_t route),
+    TP_ARGS(packet, route),
+
+    TP_STRUCT__entry(
+        __field(__u32, src_ip)
+        __field(__u32, dst_ip)
+        __field(__u16, src_port)
+        __field(__u16, dst_port)
+        __field(__u8, route)
+    ),
+
+    TP_fast_assign(
+        __entry->src_ip = ntohl(ip_hdr(packet->skb)->saddr);
+        __entry->dst_ip = ntohl(ip_hdr(packet->skb)->daddr);
+        __entry->src_port = ntohs(tcp_hdr(packet->skb)->source);
+        __entry->dst_port = ntohs(tcp_hdr(packet->skb)->dest);
+        __entry->route = route;
+    ),
+
+    TP_printk("%s src=%u.%u.%u.%u:%u dst=%u.%u.%u.%u:%u", show_proxy_route(__entry->route),
+              IP_PARTS(__entry->src_ip), __entry->src_port, IP_PARTS(__entry->dst_ip), __entry->dst_port)
+);
+
+#endif
+
+// The events are defined in fw.c (where CREATE_TRACE_POINTS is defined)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE events
+#include <trace/define_trace.h>
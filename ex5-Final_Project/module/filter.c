@@ -2,11 +2,14 @@
 In this module the packet filtering is preformed.
 */
 #include "filter.h"
+#include "events.h"
 #include "fw.h"
+#include "latency.h"
 #include "logger.h"
 #include "parser.h"
 #include "proxy.h"
 #include "ruler.h"
+#include "stats.h"
 #include "tracker.h"
 
 #include <linux/time.h>
@@ -152,46 +155,83 @@ void get_log_row(const packet_t *packet, log_row_t *log_row)
     // action, reason fields will be filled according to the match
 }
 
-unsigned int stateless_filter(packet_t *packet, log_row_t *log_row)
+/**
+ * Find the verdict of the rule table for a packet, without logging it.
+ * reason is set to the index of the matching rule, or to a reason_t.
+ */
+static __u8 rule_verdict(packet_t *packet, int *reason)
 {
-
-    // Get the head of the rule table, and iterate over the rules
+    // Get the active rule table, and iterate over the candidate rules
     // Note that we aren't supposed to change the rules here, hence the const keyword
-    const rule_t *const rules = get_rules();
-    const rule_t *rule;
-    __u8 rule_index;
-
-    // If the rule table is inactive, then accept automatically (and log the action).
-    if (is_active_table() == INACTIVE)
+    const rule_table_t *table;
+    const __u32 *candidates = NULL;
+    __u32 amount, i, rule_index;
+    __u8 verdict;
+    __u64 start = stage_start();
+
+    // A reload publishes a new table, the one we got stays valid until rcu_read_unlock()
+    rcu_read_lock();
+    table = get_rule_table();
+
+    // If no rule table was loaded yet, then accept automatically (and log the action).
+    if (table == NULL)
     {
-        DINFO("Rule table inactive")
+        rcu_read_unlock();
+        stage_end(STAGE_STATELESS_FILTER, start);
+        trace_fw_rule_verdict(packet, REASON_FW_INACTIVE, NF_ACCEPT);
 
-        log_action(log_row, NF_ACCEPT, REASON_FW_INACTIVE);
+        *reason = REASON_FW_INACTIVE;
         return NF_ACCEPT;
     }
 
-    for (rule_index = 0; rule_index < get_rules_amount(); rule_index++)
+    // The decision tree narrows the rules down to a few candidates (in the rule table order).
+    // Without a tree, every rule is a candidate.
+    if (table->tree != NULL)
+    {
+        candidates = dtree_lookup(table->tree, packet, &amount);
+    }
+    else
+    {
+        amount = table->amount;
+    }
+
+    for (i = 0; i < amount; i++)
     {
-        rule = rules + rule_index;
+        rule_index = (candidates != NULL) ? candidates[i] : i;
 
-        if (is_rule_match(packet, rules + rule_index))
+        if (is_rule_match(packet, table->rules + rule_index))
         {
-            // There is a match! Let's log the action
-            __u8 verdict = rule->action;
-            DINFO("static filter: rule_index = %d, verdict = %d", rule_index, verdict)
-
-            log_action(log_row, verdict, rule_index);
+            // There is a match!
+            verdict = table->rules[rule_index].action;
+            count_rule_hit(table, rule_index, packet->skb->len);
+            rcu_read_unlock();
+            stage_end(STAGE_STATELESS_FILTER, start);
+            trace_fw_rule_verdict(packet, rule_index, verdict);
+
+            *reason = rule_index;
             return verdict;
         }
     }
+    count_rule_hit(table, HITS_DEFAULT_DROP(table), packet->skb->len);
+    rcu_read_unlock();
+    stage_end(STAGE_STATELESS_FILTER, start);
 
     // In case no rule matched, we drop the packet
-    DINFO("static filter: no match")
+    trace_fw_rule_verdict(packet, REASON_NO_MATCHING_RULE, NF_DROP);
 
-    log_action(log_row, NF_DROP, REASON_NO_MATCHING_RULE);
+    *reason = REASON_NO_MATCHING_RULE;
     return NF_DROP;
 }
 
+unsigned int stateless_filter(packet_t *packet, log_row_t *log_row)
+{
+    int reason;
+    __u8 verdict = rule_verdict(packet, &reason);
+
+    log_action(log_row, verdict, reason);
+    return verdict;
+}
+
 /**
  * We perform here the packet inspecting (including filtering)
  */
@@ -204,20 +244,29 @@ unsigned int fw_inspect(void *priv, struct sk_buff *skb, const struct nf_hook_st
 
     // Alocate auxiliary variables
     const struct tcphdr *tcph;
-    int ret;
+    tcp_status_t status;
+    int ret, is_ftp_data, reason;
+    __u8 verdict;
+    __u64 start;
     
     if (debug_time) {
         return NF_ACCEPT;
     }
 
     // Get the required packet fields. The fields should not be changed throughout the filtering.
+    start = stage_start();
     parse_packet(&packet, skb, state);
-    
-    // Get connection entry
-    conn = find_connection(&packet);
+    stage_end(STAGE_PARSE_PACKET, start);
+    trace_fw_packet(&packet);
+
+    COUNT_STAT(packets);
+    ADD_STAT(bytes, skb->len);
+    COUNT_STAT(types[packet.type]);
 
     // Get the log_row fields from the packet
+    start = stage_start();
     get_log_row(&packet, &log_row);
+    stage_end(STAGE_GET_LOG_ROW, start);
 
     // Special actions: (depending on the packet's type)
     switch (packet.type)
@@ -239,14 +288,23 @@ unsigned int fw_inspect(void *priv, struct sk_buff *skb, const struct nf_hook_st
     if (packet.direction == DIRECTION_NONE) {
         return NF_ACCEPT;
     }
-    
-    print_packet(&packet); // Debug
 
     // Routing intended TCP packets for proxy connections
-    if (packet.type == PACKET_TYPE_TCP && proxy_route(&packet))
+    if (packet.type == PACKET_TYPE_TCP)
     {
-        log_action(&log_row, NF_ACCEPT, REASON_TCP_PROXY);        
-        return NF_ACCEPT;
+        start = stage_start();
+        rcu_read_lock();
+        ret = proxy_route(&packet);
+        rcu_read_unlock();
+        stage_end(STAGE_PROXY_ROUTE, start);
+
+        // A packet we couldn't rewrite can't reach the proxy, drop it
+        if (ret)
+        {
+            verdict = (ret > 0) ? NF_ACCEPT : NF_DROP;
+            log_action(&log_row, verdict, REASON_TCP_PROXY);
+            return verdict;
+        }
     }
 
     // Local-out hook is non-relevant anymore - accept by default
@@ -271,33 +329,52 @@ unsigned int fw_inspect(void *priv, struct sk_buff *skb, const struct nf_hook_st
         return NF_DROP;
     }
 
-    // Check if the connection exists
+    // Get connection entry (locked), and check if it exists.
+    // The connection may be removed by others once we unlock, so we don't log under the lock.
+    rcu_read_lock();
+    start = stage_start();
+    conn = find_locked_connection(&packet);
+    stage_end(STAGE_FIND_CONNECTION, start);
     if (conn == NULL)
     {
         // Check if it's a desired syn packet
         if (is_syn_packet(skb))
         {
-            // Statless filtering
-            __u8 verdict = stateless_filter(&packet, &log_row);
+            // Statless filtering (the verdict is logged once we know we can track the connection)
+            verdict = rule_verdict(&packet, &reason);
 
             if (verdict == NF_DROP)
             {
+                rcu_read_unlock();
+                log_action(&log_row, NF_DROP, reason);
                 return NF_DROP;
             }
 
-            // Add the connection
+            // Add the connection (or get the one a retransmitted SYN has added meanwhile)
             DINFO("Creates a connection")
             conn = add_connection(&packet);
+            if (conn == NULL)
+            {
+                // The connections pool and its reserve are exhausted, so the rule's accept doesn't hold
+                rcu_read_unlock();
+                log_action(&log_row, NF_DROP, REASON_CONN_ALLOC_FAILED);
+                return NF_DROP;
+            }
+            log_action(&log_row, NF_ACCEPT, reason);
 
             // If proxy then setup proxy connection
-            if (proxy_setup(&packet, conn))
+            ret = proxy_setup(&packet, conn);
+            if (ret)
             {
-                return NF_ACCEPT;
+                unlock_connection(conn);
+                rcu_read_unlock();
+                return (ret > 0) ? NF_ACCEPT : NF_DROP;
             }
         }
 
         else
         {
+            rcu_read_unlock();
             DINFO("Verdict: connection dosen't exist")
             log_action(&log_row, NF_DROP, REASON_TCP_STREAM_ENFORCE);
             return NF_DROP;
@@ -307,37 +384,37 @@ unsigned int fw_inspect(void *priv, struct sk_buff *skb, const struct nf_hook_st
     // Let's perform statefull inspection
     
     tcph = tcp_hdr(skb);
+    status = conn->state.status;
 
-    DINFO("Before enforcing: %s, Expect %s", conn_status_str(conn->state.status),
-          direction_str(conn->state.expected_direction));
-
-    DINFO("tcp filter: direction=%s, src_ip=%d.%d.%d.%d, src_port=%d, dst_ip=%d.%d.%d.%d, dst_port=%d, syn=%d, "
-          "ack=%d, fin=%d",
-          direction_str(packet.direction), IP_PARTS(packet.src_ip), packet.src_port, IP_PARTS(packet.dst_ip),
-          packet.dst_port, tcph->syn, tcph->ack, tcph->fin)
-
+    start = stage_start();
     ret = enforce_state(tcph, packet.direction, &conn->state);
-
-    DINFO("Enforce answer: %d", ret)
+    stage_end(STAGE_ENFORCE_STATE, start);
+    trace_fw_conntrack(&packet, tcph, status, conn->state.status, ret);
 
     switch (ret)
     {
-    case 2:
-        remove_connection(conn);
     case 0:
-        if (escape_ftp_data(&packet, conn))
-        {
-            log_action(&log_row, NF_ACCEPT, REASON_FTP_DATA_SESSION);
-        }
-        else
+        refresh_connection(conn);
+        // Fall through
+    case 2:
+        is_ftp_data = escape_ftp_data(&packet, conn);
+        if (ret == 2)
         {
-            log_action(&log_row, NF_ACCEPT, REASON_TCP_STREAM_ENFORCE);
+            remove_connection(conn);
         }
+        unlock_connection(conn);
+        rcu_read_unlock();
+
+        log_action(&log_row, NF_ACCEPT, is_ftp_data ? REASON_FTP_DATA_SESSION : REASON_TCP_STREAM_ENFORCE);
         return NF_ACCEPT;
     case 1:
+        unlock_connection(conn);
+        rcu_read_unlock();
         log_action(&log_row, NF_DROP, REASON_TCP_STREAM_ENFORCE);
         return NF_DROP;
     }
 
+    unlock_connection(conn);
+    rcu_read_unlock();
     return NF_DROP; // Done !
 }
\ No newline at end of file
@@ -1,12 +1,14 @@
 #include "fw.h"
 
+// Define the trace events (once, here)
+#define CREATE_TRACE_POINTS
+#include "events.h"
 
-
-static unsigned int info_counter = 0;
+static atomic_t info_counter = ATOMIC_INIT(0);
 
 unsigned int get_info_counter(void)
 {
-    return ++info_counter;
+    return atomic_inc_return(&info_counter);
 }
 
 /**
@@ -24,7 +24,7 @@ unsigned int get_info_counter(void);
 /*
  * Print debug messages to the user (in case DEBUG is defined)
  */
-#define DEBUG
+// #define DEBUG
 
 #ifdef DEBUG
 #define DCOM(command) command // Debug command
@@ -103,7 +103,8 @@ typedef enum
     REASON_XMAS_PACKET = -4,
     REASON_TCP_STREAM_ENFORCE = -8,
     REASON_FTP_DATA_SESSION = -16,
-    REASON_TCP_PROXY = -32
+    REASON_TCP_PROXY = -32,
+    REASON_CONN_ALLOC_FAILED = -64 // a connection couldn't be tracked (no memory)
 } reason_t;
 
 // logging
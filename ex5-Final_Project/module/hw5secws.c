@@ -1,9 +1,12 @@
 #include "filter.h"
 #include "fw.h"
+#include "latency.h"
 #include "logger.h"
 #include "proxy.h"
 #include "ruler.h"
+#include "stats.h"
 #include "tracker.h"
+#include "zone.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Ori Petel");
@@ -13,20 +16,28 @@ MODULE_AUTHOR("Ori Petel");
 #define MAJOR_NAME_LOG "fw-chardev2"
 #define MAJOR_NAME_CONN "fw-chardev3"
 #define MAJOR_NAME_PROXY "fw-chardev4"
+#define MAJOR_NAME_LATENCY "fw-chardev5"
+#define MAJOR_NAME_STATS "fw-chardev6"
 #define DEVICE_NAME_RULE "rules"
 #define DEVICE_NAME_LOG "fw_log"
 #define DEVICE_NAME_CONN "conns"
 #define DEVICE_NAME_PROXY "proxy"
+#define DEVICE_NAME_LATENCY "latency"
+#define DEVICE_NAME_STATS "fw_stats"
 
 static int rules_major;
 static int log_major;
 static int conn_major;
 static int proxy_major;
+static int latency_major;
+static int stats_major;
 static struct class *sysfs_class = NULL;
 static struct device *rules_dev = NULL;
 static struct device *log_dev = NULL;
 static struct device *conn_dev = NULL;
 static struct device *proxy_dev = NULL;
+static struct device *latency_dev = NULL;
+static struct device *stats_dev = NULL;
 
 // Allocating struct to hold forward hook_op
 static struct nf_hook_ops nf_preroute_op;
@@ -54,10 +65,21 @@ static int set_nf_hook(struct nf_hook_ops *my_op, enum nf_inet_hooks hook_num)
  * Rule device registartion procedure :
  */
 
-static struct file_operations rule_ops = {.owner = THIS_MODULE};
+static struct file_operations rule_ops = {.owner = THIS_MODULE,
+                                          .open = open_rules,
+                                          .read = read_rules,
+                                          .write = write_rules,
+                                          .flush = flush_rules,
+                                          .release = release_rules};
 
 static DEVICE_ATTR(rules, S_IWUSR | S_IRUGO, show_rules, store_rules);
 
+static DEVICE_ATTR(tree_stats, S_IRUGO, show_tree_stats, NULL);
+
+static BIN_ATTR(hits, S_IRUGO, read_hits, NULL, 0);
+
+static DEVICE_ATTR(zones, S_IWUSR | S_IRUGO, show_zones, store_zones);
+
 static int register_rules_dev(void)
 {
     // create char device
@@ -80,8 +102,26 @@ static int register_rules_dev(void)
 
         goto failed_proxy_file;
     }
+    if (device_create_file(rules_dev, (const struct device_attribute *)&dev_attr_tree_stats.attr))
+    {
+        goto failed_tree_file;
+    }
+    if (device_create_bin_file(rules_dev, &bin_attr_hits))
+    {
+        goto failed_hits_file;
+    }
+    if (device_create_file(rules_dev, (const struct device_attribute *)&dev_attr_zones.attr))
+    {
+        goto failed_zones_file;
+    }
     return 0;
 
+failed_zones_file:
+    device_remove_bin_file(rules_dev, &bin_attr_hits);
+failed_hits_file:
+    device_remove_file(rules_dev, (const struct device_attribute *)&dev_attr_tree_stats.attr);
+failed_tree_file:
+    device_remove_file(rules_dev, (const struct device_attribute *)&dev_attr_rules.attr);
 failed_proxy_file:
     device_destroy(sysfs_class, MKDEV(rules_major, 0));
 failed_proxy_device:
@@ -92,6 +132,9 @@ failed_proxy_major:
 
 static void unregister_rules_dev(void)
 {
+    device_remove_file(rules_dev, (const struct device_attribute *)&dev_attr_zones.attr);
+    device_remove_bin_file(rules_dev, &bin_attr_hits);
+    device_remove_file(rules_dev, (const struct device_attribute *)&dev_attr_tree_stats.attr);
     device_remove_file(rules_dev, (const struct device_attribute *)&dev_attr_rules.attr);
     device_destroy(sysfs_class, MKDEV(rules_major, 0));
     unregister_chrdev(rules_major, MAJOR_NAME_RULE);
@@ -101,10 +144,20 @@ static void unregister_rules_dev(void)
  * Log device registartion procedure :
  */
 
-static struct file_operations log_ops = {.owner = THIS_MODULE, .open = open_log, .read = read_log};
+static struct file_operations log_ops = {.owner = THIS_MODULE,
+                                         .open = open_log,
+                                         .read = read_log,
+                                         .mmap = mmap_log,
+                                         .release = release_log};
 
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_log);
 
+static DEVICE_ATTR(mode, S_IWUSR | S_IRUGO, show_log_mode, store_log_mode);
+
+static DEVICE_ATTR(rings, S_IRUGO, show_log_rings, NULL);
+
+static DEVICE_ATTR(log_stats, S_IRUGO, show_log_stats, NULL);
+
 static int register_log_dev(void)
 {
     // create char device
@@ -126,9 +179,27 @@ static int register_log_dev(void)
     {
         goto failed_log_file;
     }
+    if (device_create_file(log_dev, (const struct device_attribute *)&dev_attr_mode.attr))
+    {
+        goto failed_mode_file;
+    }
+    if (device_create_file(log_dev, (const struct device_attribute *)&dev_attr_rings.attr))
+    {
+        goto failed_rings_file;
+    }
+    if (device_create_file(log_dev, (const struct device_attribute *)&dev_attr_log_stats.attr))
+    {
+        goto failed_stats_file;
+    }
 
     return 0;
 
+failed_stats_file:
+    device_remove_file(log_dev, (const struct device_attribute *)&dev_attr_rings.attr);
+failed_rings_file:
+    device_remove_file(log_dev, (const struct device_attribute *)&dev_attr_mode.attr);
+failed_mode_file:
+    device_remove_file(log_dev, (const struct device_attribute *)&dev_attr_reset.attr);
 failed_log_file:
     device_destroy(sysfs_class, MKDEV(log_major, 0));
 failed_log_device:
@@ -139,6 +210,9 @@ failed_log_major:
 
 static void unregister_log_dev(void)
 {
+    device_remove_file(log_dev, (const struct device_attribute *)&dev_attr_log_stats.attr);
+    device_remove_file(log_dev, (const struct device_attribute *)&dev_attr_rings.attr);
+    device_remove_file(log_dev, (const struct device_attribute *)&dev_attr_mode.attr);
     device_remove_file(log_dev, (const struct device_attribute *)&dev_attr_reset.attr);
     device_destroy(sysfs_class, MKDEV(log_major, 0));
     unregister_chrdev(log_major, MAJOR_NAME_LOG);
@@ -159,6 +233,8 @@ ssize_t conns(struct device *dev, struct device_attribute *attr, char *buf)
 
 static DEVICE_ATTR(conns, S_IRUGO, conns, NULL);
 
+static DEVICE_ATTR(ctable_stats, S_IRUGO, show_ctable_stats, NULL);
+
 static int register_conn_dev(void)
 {
     // create char device
@@ -179,9 +255,15 @@ static int register_conn_dev(void)
     {
         goto failed_conn_file;
     }
+    if (device_create_file(conn_dev, (const struct device_attribute *)&dev_attr_ctable_stats.attr))
+    {
+        goto failed_stats_file;
+    }
 
     return 0;
 
+failed_stats_file:
+    device_remove_file(conn_dev, (const struct device_attribute *)&dev_attr_conns.attr);
 failed_conn_file:
     device_destroy(sysfs_class, MKDEV(conn_major, 0));
 failed_conn_device:
@@ -192,6 +274,7 @@ failed_conn_major:
 
 static void unregister_conn_dev(void)
 {
+    device_remove_file(conn_dev, (const struct device_attribute *)&dev_attr_ctable_stats.attr);
     device_remove_file(conn_dev, (const struct device_attribute *)&dev_attr_conns.attr);
     device_destroy(sysfs_class, MKDEV(conn_major, 0));
     unregister_chrdev(conn_major, MAJOR_NAME_CONN);
@@ -201,7 +284,7 @@ static void unregister_conn_dev(void)
  * Proxy device registartion procedure :
  */
 
-static struct file_operations proxy_ops = {.owner = THIS_MODULE};
+static struct file_operations proxy_ops = {.owner = THIS_MODULE, .unlocked_ioctl = proxy_ioctl};
 
 static DEVICE_ATTR(set_port, S_IWUSR, NULL, set_proxy_port);
 
@@ -252,6 +335,105 @@ static void unregister_proxy_dev(void)
     unregister_chrdev(proxy_major, MAJOR_NAME_PROXY);
 }
 
+/*
+ * Latency device registartion procedure :
+ */
+
+static struct file_operations latency_ops = {.owner = THIS_MODULE};
+
+static DEVICE_ATTR(enabled, S_IWUSR | S_IRUGO, show_latency_enabled, store_latency_enabled);
+
+static DEVICE_ATTR(hists, S_IRUGO, show_latency_hists, NULL);
+
+static DEVICE_ATTR(reset_hists, S_IWUSR, NULL, reset_latency);
+
+static int register_latency_dev(void)
+{
+    // create char device
+    latency_major = register_chrdev(0, MAJOR_NAME_LATENCY, &latency_ops);
+    if (latency_major < 0)
+    {
+        goto failed_latency_major;
+    }
+
+    // create sysfs device
+    latency_dev = device_create(sysfs_class, NULL, MKDEV(latency_major, 0), NULL, DEVICE_NAME_LATENCY);
+    if (IS_ERR(latency_dev))
+    {
+        goto failed_latency_device;
+    }
+
+    // create sysfs file attributes
+    if (device_create_file(latency_dev, (const struct device_attribute *)&dev_attr_enabled.attr))
+    {
+        goto failed_enabled_file;
+    }
+    if (device_create_file(latency_dev, (const struct device_attribute *)&dev_attr_hists.attr))
+    {
+        goto failed_hists_file;
+    }
+    if (device_create_file(latency_dev, (const struct device_attribute *)&dev_attr_reset_hists.attr))
+    {
+        goto failed_reset_file;
+    }
+    return 0;
+
+failed_reset_file:
+    device_remove_file(latency_dev, (const struct device_attribute *)&dev_attr_hists.attr);
+failed_hists_file:
+    device_remove_file(latency_dev, (const struct device_attribute *)&dev_attr_enabled.attr);
+failed_enabled_file:
+    device_destroy(sysfs_class, MKDEV(latency_major, 0));
+failed_latency_device:
+    unregister_chrdev(latency_major, MAJOR_NAME_LATENCY);
+failed_latency_major:
+    return -1;
+}
+
+static void unregister_latency_dev(void)
+{
+    device_remove_file(latency_dev, (const struct device_attribute *)&dev_attr_reset_hists.attr);
+    device_remove_file(latency_dev, (const struct device_attribute *)&dev_attr_hists.attr);
+    device_remove_file(latency_dev, (const struct device_attribute *)&dev_attr_enabled.attr);
+    device_destroy(sysfs_class, MKDEV(latency_major, 0));
+    unregister_chrdev(latency_major, MAJOR_NAME_LATENCY);
+}
+
+/*
+ * Stats device registartion procedure :
+ */
+
+static struct file_operations stats_ops = {.owner = THIS_MODULE, .read = read_stats};
+
+static int register_stats_dev(void)
+{
+    // create char device
+    stats_major = register_chrdev(0, MAJOR_NAME_STATS, &stats_ops);
+    if (stats_major < 0)
+    {
+        goto failed_stats_major;
+    }
+
+    // create sysfs device (and its /dev node)
+    stats_dev = device_create(sysfs_class, NULL, MKDEV(stats_major, 0), NULL, DEVICE_NAME_STATS);
+    if (IS_ERR(stats_dev))
+    {
+        goto failed_stats_device;
+    }
+    return 0;
+
+failed_stats_device:
+    unregister_chrdev(stats_major, MAJOR_NAME_STATS);
+failed_stats_major:
+    return -1;
+}
+
+static void unregister_stats_dev(void)
+{
+    device_destroy(sysfs_class, MKDEV(stats_major, 0));
+    unregister_chrdev(stats_major, MAJOR_NAME_STATS);
+}
+
 /**
  * Initialize module:
  * 1. Register char devices using sysfs API.
@@ -259,6 +441,34 @@ static void unregister_proxy_dev(void)
  */
 static int __init hw5secws_init(void)
 {
+    // Allocate the proxy indexes (before any connection can be added)
+    if (init_proxy() != 0)
+    {
+        INFO("Failed to allocate the proxy indexes")
+        goto failed_proxy;
+    }
+
+    // Allocate the connection table
+    if (init_connections() != 0)
+    {
+        INFO("Failed to allocate the connection table")
+        goto failed_ctable;
+    }
+
+    // Allocate the log index
+    if (init_log() != 0)
+    {
+        INFO("Failed to allocate the log index")
+        goto failed_log;
+    }
+
+    // Map the interfaces to zones, and follow their changes
+    if (init_zones() != 0)
+    {
+        INFO("Failed to initialize the zones")
+        goto failed_zones;
+    }
+
     // Create sysfs class
     sysfs_class = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(sysfs_class))
@@ -295,6 +505,20 @@ static int __init hw5secws_init(void)
         goto failed_proxy_reg;
     }
 
+    // Register latency device
+    if (register_latency_dev() != 0)
+    {
+        INFO("Failed to register latency devices")
+        goto failed_latency_reg;
+    }
+
+    // Register stats device
+    if (register_stats_dev() != 0)
+    {
+        INFO("Failed to register stats devices")
+        goto failed_stats_reg;
+    }
+
     // Register hook at Net Filter forward point
     if (set_nf_hook(&nf_preroute_op, NF_INET_PRE_ROUTING) != 0)
     {
@@ -317,6 +541,10 @@ static int __init hw5secws_init(void)
 failed_hook2:
     nf_unregister_net_hook(&init_net, &nf_preroute_op);
 failed_hook1:
+    unregister_stats_dev();
+failed_stats_reg:
+    unregister_latency_dev();
+failed_latency_reg:
     unregister_proxy_dev();
 failed_proxy_reg:
     unregister_conn_dev();
@@ -327,26 +555,39 @@ failed_log_reg:
 failed_rule_reg:
     class_destroy(sysfs_class);
 failed_class:
+    free_zones();
+failed_zones:
+    free_log();
+failed_log:
+    free_connections();
+failed_ctable:
+    free_proxy();
+failed_proxy:
     return -1;
 }
 
 static void __exit hw5secws_exit(void)
 {
-    // Release resources at exiting - free acquired memory
-    free_log();
-    free_connections();
-
     // Release resources at exiting - unregister the hooks
     nf_unregister_net_hook(&init_net, &nf_localout_op);
     nf_unregister_net_hook(&init_net, &nf_preroute_op);
 
-    // Release resources at exiting - unregister char devices
+    // Release resources at exiting - unregister char devices (so no user can reach the memory below either)
+    unregister_stats_dev();
+    unregister_latency_dev();
     unregister_proxy_dev();
     unregister_conn_dev();
     unregister_log_dev();
     unregister_rules_dev();
     class_destroy(sysfs_class);
 
+    // Release resources at exiting - free acquired memory (no packet can reach them by now)
+    free_zones();
+    free_log();
+    free_connections();
+    free_proxy();
+    free_rules();
+
     DINFO("Exiting")
 }
 
@@ -0,0 +1,92 @@
+#include "latency.h"
+
+#include <linux/percpu.h>
+
+DEFINE_STATIC_KEY_FALSE(latency_enabled);
+
+// Each CPU counts its own packets, so counting takes no lock and no shared cache line
+static DEFINE_PER_CPU(latency_hists_t, latency_hists);
+
+void count_latency(stage_t stage, __u64 ns)
+{
+    unsigned int bucket = min(fls64(ns), LATENCY_BUCKETS - 1);
+
+    this_cpu_inc(latency_hists.buckets[stage][bucket]);
+}
+
+// Implementing latency device operations
+
+ssize_t show_latency_enabled(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    __u8 enabled = static_key_enabled(&latency_enabled);
+
+    VAR2BUF(enabled);
+    return sizeof(enabled);
+}
+
+/**
+ * Switch the timing on (1) or off (0). The histograms are kept, reset them to start over.
+ */
+ssize_t store_latency_enabled(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    __u8 enabled;
+
+    if (count < sizeof(enabled))
+    {
+        return -EINVAL;
+    }
+
+    BUF2VAR(enabled);
+    if (enabled == 1)
+    {
+        static_branch_enable(&latency_enabled);
+    }
+    else if (enabled == 0)
+    {
+        static_branch_disable(&latency_enabled);
+    }
+    else
+    {
+        return -EINVAL;
+    }
+    return count;
+}
+
+/**
+ * Pass the histograms (latency_hists_t), summed over all the CPUs
+ */
+ssize_t show_latency_hists(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    latency_hists_t *sum = (latency_hists_t *)buf; // a whole page, too large for the stack
+    const latency_hists_t *hists;
+    unsigned int stage, bucket;
+    int cpu;
+
+    memset(sum, 0, sizeof(latency_hists_t));
+    for_each_possible_cpu(cpu)
+    {
+        hists = per_cpu_ptr(&latency_hists, cpu);
+        for (stage = 0; stage < STAGES_AMOUNT; stage++)
+        {
+            for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+            {
+                sum->buckets[stage][bucket] += READ_ONCE(hists->buckets[stage][bucket]);
+            }
+        }
+    }
+    return sizeof(latency_hists_t);
+}
+
+/**
+ * Zero the histograms (packets counted meanwhile may be lost)
+ */
+ssize_t reset_latency(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        memset(per_cpu_ptr(&latency_hists, cpu), 0, sizeof(latency_hists_t));
+    }
+    return count;
+}
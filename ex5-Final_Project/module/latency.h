@@ -0,0 +1,69 @@
+/*
+In this module we measure the latency of the packet inspection stages.
+*/
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include "fw.h"
+
+#include <linux/jump_label.h>
+#include <linux/sched/clock.h>
+
+// The stages of fw_inspect() we time
+typedef enum
+{
+    STAGE_PARSE_PACKET,
+    STAGE_GET_LOG_ROW,
+    STAGE_PROXY_ROUTE,
+    STAGE_FIND_CONNECTION,
+    STAGE_STATELESS_FILTER,
+    STAGE_ENFORCE_STATE,
+    STAGE_LOG_ACTION,
+    STAGES_AMOUNT,
+} stage_t;
+
+// A latency of n ns is counted in bucket fls64(n): bucket 0 is 0 ns, and bucket b is [2^(b-1), 2^b) ns.
+// The last bucket counts the longer ones as well.
+#define LATENCY_BUCKETS (32)
+
+// The latency histograms of the stages (fixed layout, shared with the user)
+typedef struct
+{
+    __u64 buckets[STAGES_AMOUNT][LATENCY_BUCKETS];
+} latency_hists_t;
+
+// The timing is off by default, and then a stage costs a patched-out branch
+DECLARE_STATIC_KEY_FALSE(latency_enabled);
+
+void count_latency(stage_t stage, __u64 ns);
+
+/**
+ * Returns the start time of a stage (0 while the timing is off)
+ */
+static inline __u64 stage_start(void)
+{
+    if (static_branch_unlikely(&latency_enabled))
+    {
+        return local_clock();
+    }
+    return 0;
+}
+
+/**
+ * Count the latency of a stage that began at start (stages begun while the timing was off are ignored)
+ */
+static inline void stage_end(stage_t stage, __u64 start)
+{
+    if (static_branch_unlikely(&latency_enabled) && start != 0)
+    {
+        count_latency(stage, local_clock() - start);
+    }
+}
+
+// Latency device operations
+ssize_t show_latency_enabled(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t store_latency_enabled(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t show_latency_hists(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t reset_latency(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+
+#endif
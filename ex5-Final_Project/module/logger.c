@@ -3,8 +3,19 @@ In this module the packet logging is done.
 */
 #include "logger.h"
 #include "fw.h"
+#include "latency.h"
+#include "stats.h"
 
-// #define MAX_POOL 20
+#include <linux/jhash.h>
+#include <linux/mempool.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+// The log entries are allocated from their own slab cache, with a reserve for when the system is short on memory
+#define LOG_POOL_RESERVE (256)
 
 typedef struct
 {
@@ -12,41 +23,50 @@ typedef struct
 
     // This is used to link players together in the players list
     struct list_head list_node;
+
+    // Links the entries with the same hash, for finding the entry of a packet
+    __u32 hash;
+    struct hlist_node hash_node;
 } log_entry_t;
 
 static LIST_HEAD(log); // The head of log linked list
 __u32 rows_amount = 0; // The amount of log rows/ entries
 
-// Implement a pool of free memory instead allocate each time
-// static log_entry_t *log_pool;
-// static __u8 pool_amount = 0;
+// The list, its index and counters are shared by all the CPUs. The packet path takes the lock, hence _bh.
+static DEFINE_SPINLOCK(log_lock);
+static __u32 log_generation = 0; // changes when the log is reset, so the readers know their position is gone
 
-/**
- * Obtain an allocated log_entry_t from the pool
- */
-// static log_entry_t *allocate_entry(void)
-// {
-//     if (pool_amount == 0)
-//     {
-//         log_pool = (log_entry_t *)kmalloc(MAX_POOL * sizeof(log_entry_t), GFP_KERNEL);
-//         pool_amount = MAX_POOL;
-//     }
-//     pool_amount--;
-//     return log_pool + pool_amount; // Same as &log_pool[pool_amount]
-// }
+// The log index holds 2^bits buckets. It grows when the average chain exceeds LOG_HASH_GROW_LOAD.
+// Growing is left to the resize worker, which moves LOG_RESIZE_BATCH buckets at a time under log_lock.
+#define LOG_HASH_MIN_BITS (10)
+#define LOG_HASH_MAX_BITS (19)
+#define LOG_HASH_GROW_LOAD (2)
+#define LOG_RESIZE_BATCH (256)
+#define LOG_RESIZE_RETRY (HZ) // after a failed allocation
 
-/**
- * Empties the log_pool
- */
-// static void empty_pool(void)
-// {
-//     log_entry_t *pool_member;
-//     for (pool_member = log_pool; pool_member < log_pool + pool_amount; pool_member++)
-//     {
-//         kfree(pool_member);
-//     }
-//     pool_amount = 0;
-// }
+// Indexes the log entries by their 5-tuple, the list keeps them in the order they were created
+static struct
+{
+    struct hlist_head *buckets;
+    __u8 bits;
+    __u32 seed;
+
+    // While the index grows, the entries not moved yet are still in the old buckets (NULL otherwise)
+    struct hlist_head *old_buckets;
+    __u8 old_bits;
+} log_index;
+
+static void log_resize_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(log_resize_work, log_resize_worker);
+
+static struct kmem_cache *log_cache = NULL;
+static mempool_t *log_pool = NULL;
+static __u32 alloc_failures = 0; // log rows lost because no entry could be allocated (under log_lock)
+
+// In ring mode, log_action() doesn't aggregate: each CPU appends a record to its own ring
+static log_mode_t log_mode = LOG_MODE_LIST;
+static void *log_rings = NULL; // nr_cpu_ids rings, allocated with vmalloc_user() to be mapped by the consumer
+static size_t ring_bytes;
 
 /**
  * Checks if two log_row are match
@@ -59,37 +79,266 @@ __u8 log_match(log_row_t *lr1, log_row_t *lr2)
 }
 
 /**
- * log a filtering action on a packet
+ * Hash of a log row's 5-tuple
  */
-void log_action(log_row_t *log_row, __u8 action, reason_t reason)
+static inline __u32 log_hash(const log_row_t *log_row)
+{
+    return jhash_3words(log_row->src_ip, log_row->dst_ip,
+                        ((__u32)log_row->src_port << 16) | log_row->dst_port, log_index.seed ^ log_row->protocol);
+}
+
+static inline struct hlist_head *log_bucket(__u32 hash)
+{
+    return log_index.buckets + (hash & ((1U << log_index.bits) - 1));
+}
+
+/**
+ * Returns the log entry of a log row, or NULL if there is none (call under log_lock)
+ */
+static log_entry_t *find_log_entry(log_row_t *log_row, __u32 hash)
+{
+    log_entry_t *entry;
+
+    hlist_for_each_entry(entry, log_bucket(hash), hash_node)
+    {
+        if (entry->hash == hash && log_match(log_row, &entry->log_row))
+        {
+            return entry;
+        }
+    }
+
+    // In the middle of a resize, the entry may not have moved yet
+    if (log_index.old_buckets != NULL)
+    {
+        hlist_for_each_entry(entry, log_index.old_buckets + (hash & ((1U << log_index.old_bits) - 1)), hash_node)
+        {
+            if (entry->hash == hash && log_match(log_row, &entry->log_row))
+            {
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+static inline log_ring_header_t *ring_header(int cpu)
+{
+    return (log_ring_header_t *)((char *)log_rings + cpu * ring_bytes);
+}
+
+static inline log_record_t *ring_record(int cpu, __u32 index)
+{
+    return (log_record_t *)((char *)ring_header(cpu) + LOG_RING_HEADER_SIZE) + (index & (LOG_RING_RECORDS - 1));
+}
+
+/**
+ * Allocate the log index, the log entries pool and the log rings
+ */
+int init_log(void)
+{
+    log_index.bits = LOG_HASH_MIN_BITS;
+    log_index.buckets = kvzalloc(sizeof(struct hlist_head) << log_index.bits, GFP_KERNEL);
+    log_index.old_buckets = NULL;
+    if (log_index.buckets == NULL)
+    {
+        goto failed_index;
+    }
+    get_random_bytes(&log_index.seed, sizeof(log_index.seed));
+
+    log_cache = kmem_cache_create("fw_log_entry", sizeof(log_entry_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (log_cache == NULL)
+    {
+        goto failed_cache;
+    }
+    log_pool = mempool_create_slab_pool(LOG_POOL_RESERVE, log_cache);
+    if (log_pool == NULL)
+    {
+        goto failed_pool;
+    }
+
+    ring_bytes = PAGE_ALIGN(LOG_RING_HEADER_SIZE + LOG_RING_RECORDS * sizeof(log_record_t));
+    log_rings = vmalloc_user(nr_cpu_ids * ring_bytes);
+    if (log_rings == NULL)
+    {
+        goto failed_rings;
+    }
+    return 0;
+
+failed_rings:
+    mempool_destroy(log_pool);
+    log_pool = NULL;
+failed_pool:
+    kmem_cache_destroy(log_cache);
+    log_cache = NULL;
+failed_cache:
+    kvfree(log_index.buckets);
+    log_index.buckets = NULL;
+failed_index:
+    return -ENOMEM;
+}
+
+/**
+ * Append a record to the ring of this CPU, or count a drop if the consumer has fallen behind.
+ * Each ring has a single producer (its CPU), so no lock is needed.
+ */
+static void ring_log(const log_row_t *log_row)
+{
+    log_ring_header_t *header;
+    log_record_t *record;
+    __u32 head, tail;
+    int cpu;
+
+    // The LOCAL_OUT hook may run in process context, keep the softirq hooks of this CPU out of the ring
+    local_bh_disable();
+    cpu = smp_processor_id();
+    header = ring_header(cpu);
+
+    head = header->head;
+    tail = smp_load_acquire(&header->tail); // the consumer is done with the records before tail
+    if (head - tail >= LOG_RING_RECORDS)
+    {
+        header->drops++;
+        local_bh_enable();
+        return;
+    }
+
+    record = ring_record(cpu, head);
+    record->timestamp = log_row->timestamp;
+    record->src_ip = log_row->src_ip;
+    record->dst_ip = log_row->dst_ip;
+    record->reason = log_row->reason;
+    record->src_port = log_row->src_port;
+    record->dst_port = log_row->dst_port;
+    record->protocol = log_row->protocol;
+    record->action = log_row->action;
+
+    smp_store_release(&header->head, head + 1); // publish the record
+    local_bh_enable();
+}
+
+/**
+ * Grow the log index to twice its buckets. The allocation may sleep, so it is done out of the lock.
+ * The entries then move to the new buckets a batch at a time, so the packet path never waits for all of them.
+ */
+static void log_resize_worker(struct work_struct *work)
+{
+    struct hlist_head *buckets, *old;
+    struct hlist_node *temp;
+    log_entry_t *entry;
+    __u32 bkt, batch_end, old_size;
+    __u8 bits = log_index.bits; // changed by this worker only
+
+    if (bits >= LOG_HASH_MAX_BITS)
+    {
+        return;
+    }
+
+    buckets = kvzalloc(sizeof(struct hlist_head) << (bits + 1), GFP_KERNEL);
+    if (buckets == NULL)
+    {
+        // Meanwhile the chains are longer
+        schedule_delayed_work(&log_resize_work, LOG_RESIZE_RETRY);
+        return;
+    }
+
+    // New entries go to the new buckets from now on
+    spin_lock_bh(&log_lock);
+    old = log_index.buckets;
+    log_index.old_buckets = old;
+    log_index.old_bits = bits;
+    log_index.buckets = buckets;
+    log_index.bits = bits + 1;
+    spin_unlock_bh(&log_lock);
+
+    old_size = 1U << bits;
+    for (bkt = 0; bkt < old_size;)
+    {
+        batch_end = min(bkt + LOG_RESIZE_BATCH, old_size);
+
+        spin_lock_bh(&log_lock);
+        for (; bkt < batch_end; bkt++)
+        {
+            hlist_for_each_entry_safe(entry, temp, old + bkt, hash_node)
+            {
+                hlist_del(&entry->hash_node);
+                hlist_add_head(&entry->hash_node, log_bucket(entry->hash));
+            }
+        }
+        spin_unlock_bh(&log_lock);
+
+        cond_resched();
+    }
+
+    spin_lock_bh(&log_lock);
+    log_index.old_buckets = NULL;
+    spin_unlock_bh(&log_lock);
+    kvfree(old);
+}
+
+/**
+ * Record the action in the log (the aggregated list, or the ring of this CPU)
+ */
+static void record_action(log_row_t *log_row, __u8 action, reason_t reason)
 {
-    struct list_head *pos;
     log_entry_t *entry = NULL;
+    __u32 hash;
 
     // Recording the action
     log_row->action = action;
     log_row->reason = reason;
 
-    // Searching for a similar log entry
-    list_for_each(pos, &log) // In here pos will be the list_head item in the corresponding log_entry_t struct
+    if (READ_ONCE(log_mode) == LOG_MODE_RING)
     {
-        // Extract get a reference to the log_entry_t for this iteration
-        entry = list_entry(pos, log_entry_t, list_node);
+        ring_log(log_row);
+        return;
+    }
 
-        if (log_match(log_row, &entry->log_row))
-        {
-            entry->log_row.timestamp = log_row->timestamp;
-            entry->log_row.count++;
-            return;
-        }
+    // Searching for a similar log entry
+    hash = log_hash(log_row);
+    spin_lock_bh(&log_lock);
+    entry = find_log_entry(log_row, hash);
+    if (entry != NULL)
+    {
+        entry->log_row.timestamp = log_row->timestamp;
+        entry->log_row.count++;
+        spin_unlock_bh(&log_lock);
+        return;
     }
 
-    // No entry match. Adding a new log entry
-    entry = (log_entry_t *)kmalloc(sizeof(log_entry_t), GFP_KERNEL);
-//     entry = allocate_entry();
+    // No entry match. Adding a new log entry (we are on the packet path, so we can't sleep)
+    entry = (log_entry_t *)mempool_alloc(log_pool, GFP_ATOMIC);
+    if (entry == NULL)
+    {
+        // Both the slab and the reserve are exhausted - the packet goes on, unlogged
+        alloc_failures++;
+        spin_unlock_bh(&log_lock);
+        return;
+    }
     entry->log_row = *log_row;
+    entry->hash = hash;
     list_add_tail(&entry->list_node, &log);
+    hlist_add_head(&entry->hash_node, log_bucket(hash));
     rows_amount++;
+
+    // Wake the resize worker up (we can't allocate the buckets, nor move all the entries, on the packet path)
+    if (rows_amount > (LOG_HASH_GROW_LOAD << log_index.bits) && log_index.bits < LOG_HASH_MAX_BITS &&
+        log_index.old_buckets == NULL)
+    {
+        schedule_delayed_work(&log_resize_work, 0);
+    }
+    spin_unlock_bh(&log_lock);
+}
+
+/**
+ * log a filtering action on a packet
+ */
+void log_action(log_row_t *log_row, __u8 action, reason_t reason)
+{
+    __u64 start = stage_start();
+
+    COUNT_VERDICT(action, reason);
+    record_action(log_row, action, reason);
+    stage_end(STAGE_LOG_ACTION, start);
 }
 
 /*
@@ -100,18 +349,45 @@ void log_cleanup(void)
     log_entry_t *the_entry;
     log_entry_t *temp_entry;
 
+    __u32 bkt;
+
+    spin_lock_bh(&log_lock);
+    log_generation++;
     list_for_each_entry_safe(the_entry, temp_entry, &log, list_node)
     {
         list_del(&the_entry->list_node);
-        kfree(the_entry);
+        mempool_free(the_entry, log_pool);
     }
     rows_amount = 0;
+
+    for (bkt = 0; bkt < (1U << log_index.bits); bkt++)
+    {
+        INIT_HLIST_HEAD(log_index.buckets + bkt);
+    }
+    if (log_index.old_buckets != NULL)
+    {
+        for (bkt = 0; bkt < (1U << log_index.old_bits); bkt++)
+        {
+            INIT_HLIST_HEAD(log_index.old_buckets + bkt);
+        }
+    }
+    spin_unlock_bh(&log_lock);
 }
 
 void free_log(void)
 {
+    // Stop the resize worker first (it finishes a resize in progress)
+    cancel_delayed_work_sync(&log_resize_work);
+
     log_cleanup();
-//     empty_pool();
+    mempool_destroy(log_pool);
+    log_pool = NULL;
+    kmem_cache_destroy(log_cache);
+    log_cache = NULL;
+    kvfree(log_index.buckets);
+    log_index.buckets = NULL;
+    vfree(log_rings);
+    log_rings = NULL;
 }
 
 // Implementing log device operations
@@ -121,8 +397,13 @@ const __u8 LOG_ROW_BUF_SIZE = sizeof(unsigned long) + 2 * sizeof(__u8) + 2 * siz
 
 const __u8 LAMOUNT_SIZE = sizeof(rows_amount);
 
-log_entry_t *read_entry;
-static __u8 is_ammount_passed;
+// The position of a reader of the log device (each open file has its own)
+typedef struct
+{
+    log_entry_t *entry; // the last entry passed (initially the list head)
+    __u32 generation;   // the log generation the reader started in
+    __u8 is_ammount_passed;
+} log_reader_t;
 
 void log2buf(const log_row_t *log, char *buf)
 {
@@ -137,43 +418,67 @@ void log2buf(const log_row_t *log, char *buf)
     VAR2BUF(log->count);
 }
 
-int open_log(struct inode *_inode, struct file *_file)
+int open_log(struct inode *_inode, struct file *filp)
 {
-    read_entry = list_first_entry(&log, log_entry_t, list_node);
-    is_ammount_passed = 0;
+    log_reader_t *reader = kmalloc(sizeof(log_reader_t), GFP_KERNEL);
+    if (reader == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    // Start before the first entry, the rows are read from entry->next on
+    reader->entry = list_entry(&log, log_entry_t, list_node);
+    reader->is_ammount_passed = 0;
+    filp->private_data = reader;
     return 0;
 }
 
+/**
+ * Pass the amount of rows, followed by the rows.
+ * Every row is copied under the lock, and passed to the user after it (copy_to_user may sleep).
+ * If the log is reset meanwhile, the reader's position is gone, and the read ends.
+ */
 ssize_t read_log(struct file *filp, char *buf, size_t length, loff_t *offp)
 {
+    log_reader_t *reader = (log_reader_t *)filp->private_data;
     char my_buf[LOG_ROW_BUF_SIZE];
+    __u32 amount;
     int count = 0;
 
-    if (!is_ammount_passed)
+    if (!reader->is_ammount_passed)
     {
         if (length < LAMOUNT_SIZE)
         {
             return 0;
         }
 
-        if (copy_to_user(buf, &rows_amount, LAMOUNT_SIZE))
+        spin_lock_bh(&log_lock);
+        amount = rows_amount;
+        reader->generation = log_generation;
+        spin_unlock_bh(&log_lock);
+
+        if (copy_to_user(buf, &amount, LAMOUNT_SIZE))
         {
             return -EFAULT;
         }
 
         count += LAMOUNT_SIZE;
         length -= LAMOUNT_SIZE;
-        is_ammount_passed = 1;
+        reader->is_ammount_passed = 1;
     }
 
-    list_for_each_entry_continue(read_entry, &log, list_node)
+    while (length >= LOG_ROW_BUF_SIZE)
     {
-        if (length < LOG_ROW_BUF_SIZE)
+        spin_lock_bh(&log_lock);
+        if (reader->generation != log_generation || list_is_last(&reader->entry->list_node, &log))
         {
+            spin_unlock_bh(&log_lock);
             break;
         }
+        reader->entry = list_next_entry(reader->entry, list_node);
+        log2buf(&reader->entry->log_row, my_buf);
+        spin_unlock_bh(&log_lock);
 
-        log2buf(&read_entry->log_row, my_buf);
         if (copy_to_user(buf + count, my_buf, LOG_ROW_BUF_SIZE))
         {
             return -EFAULT;
@@ -185,8 +490,94 @@ ssize_t read_log(struct file *filp, char *buf, size_t length, loff_t *offp)
     return count;
 }
 
+int release_log(struct inode *_inode, struct file *filp)
+{
+    kfree(filp->private_data);
+    return 0;
+}
+
 ssize_t reset_log(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
     log_cleanup();
     return count;
 }
+
+/**
+ * Map the log rings (all of them, as described by log_rings_info_t) to the consumer
+ */
+int mmap_log(struct file *filp, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != nr_cpu_ids * ring_bytes)
+    {
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, log_rings, 0);
+}
+
+ssize_t show_log_mode(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    __u8 mode = READ_ONCE(log_mode);
+
+    VAR2BUF(mode);
+    return sizeof(mode);
+}
+
+ssize_t store_log_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    __u8 mode;
+
+    if (count < sizeof(mode))
+    {
+        return -EINVAL;
+    }
+
+    BUF2VAR(mode);
+    if (mode != LOG_MODE_LIST && mode != LOG_MODE_RING)
+    {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(log_mode, mode);
+    return count;
+}
+
+/**
+ * Pass the mapping of the log rings (log_rings_info_t), followed by the drop counter of each ring (__u64).
+ * The drop counters are in the ring headers as well.
+ */
+ssize_t show_log_rings(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    log_rings_info_t info;
+    __u64 drops;
+    __u32 ring;
+
+    info.rings = nr_cpu_ids;
+    info.ring_bytes = ring_bytes;
+    info.records = LOG_RING_RECORDS;
+    info.header_size = LOG_RING_HEADER_SIZE;
+    VAR2BUF(info);
+
+    for (ring = 0; ring < info.rings && sizeof(info) + (ring + 1) * sizeof(drops) <= PAGE_SIZE; ring++)
+    {
+        drops = READ_ONCE(ring_header(ring)->drops);
+        VAR2BUF(drops);
+    }
+
+    return sizeof(info) + ring * sizeof(drops);
+}
+
+/**
+ * Pass the log statistics (log_stats_t) to the user
+ */
+ssize_t show_log_stats(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    log_stats_t stats;
+
+    spin_lock_bh(&log_lock);
+    stats.rows = rows_amount;
+    stats.alloc_failures = alloc_failures;
+    spin_unlock_bh(&log_lock);
+
+    VAR2BUF(stats);
+    return sizeof(stats);
+}
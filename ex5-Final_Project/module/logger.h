@@ -3,16 +3,77 @@
 
 #include "fw.h"
 
+// Log modes: the aggregated list (read through the log device), or per-CPU rings (mapped by the consumer)
+typedef enum
+{
+    LOG_MODE_LIST = 0,
+    LOG_MODE_RING = 1,
+} log_mode_t;
+
+// Each CPU has a ring of LOG_RING_RECORDS records (a power of 2), which follow a header of LOG_RING_HEADER_SIZE
+#define LOG_RING_RECORDS (8192)
+#define LOG_RING_HEADER_SIZE (4096)
+
+// A record in a log ring (fixed layout, shared with the user)
+typedef struct
+{
+    __u64 timestamp;
+    __be32 src_ip;
+    __be32 dst_ip;
+    __s32 reason; // rule#index, or values from: reason_t
+    __be16 src_port;
+    __be16 dst_port;
+    __u8 protocol;
+    __u8 action;
+    __u8 reserved[6];
+} log_record_t;
+
+// The header of a log ring. The kernel produces records at head, and the consumer moves tail after it.
+typedef struct
+{
+    __u32 head;  // records produced (written by the kernel only)
+    __u32 tail;  // records consumed (written by the consumer only)
+    __u64 drops; // records lost because the ring was full
+} log_ring_header_t;
+
+// Log statistics
+typedef struct
+{
+    __u32 rows;
+    __u32 alloc_failures; // rows lost because no entry could be allocated
+} log_stats_t;
+
+// Describes the mapping of the log rings
+typedef struct
+{
+    __u32 rings;      // one per CPU
+    __u32 ring_bytes; // ring i starts at offset i * ring_bytes
+    __u32 records;
+    __u32 header_size;
+} log_rings_info_t;
+
+// Allocate the log index
+int init_log(void);
+
 // log a filtering action on a packet
 void log_action(log_row_t *log, __u8 action, reason_t reason);
 
 // Free all resources acquired by the logger
 void free_log(void);
 
+// The size of a row passed by the log device (its fields in the order of log_row_t), after the amount of rows
+extern const __u8 LOG_ROW_BUF_SIZE;
+
 // Define log device operations
-int open_log(struct inode *_inode, struct file *_file);
+int open_log(struct inode *_inode, struct file *filp);
 ssize_t read_log(struct file *filp, char *buf, size_t length, loff_t *offp);
+int release_log(struct inode *_inode, struct file *filp);
+int mmap_log(struct file *filp, struct vm_area_struct *vma);
 
 ssize_t reset_log(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t show_log_mode(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t store_log_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t show_log_rings(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t show_log_stats(struct device *dev, struct device_attribute *attr, char *buf);
 
 #endif
\ No newline at end of file
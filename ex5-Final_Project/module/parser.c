@@ -2,6 +2,7 @@
 In this module the socket buffer (packet) is being parsed.
 */
 #include "parser.h"
+#include "zone.h"
 
 // Allocating struct to hold the inspected packet
 static const packet_t empty_packet;
@@ -20,22 +21,6 @@ inline __u8 involves_fw(__be32 src_ip, __be32 dst_ip)
     return (dst_ip == FW_INT_ADRR) || (dst_ip == FW_EXT_ADRR);
 }
 
-direction_t get_direction(const struct nf_hook_state *state)
-{
-    char *net_in = state->in->name;
-    char *net_out = state->out->name;
-    
-    if ((net_out != NULL && strcmp(net_out, EXT_NET_DEVICE_NAME) == 0) || (net_in != NULL && strcmp(net_in, INT_NET_DEVICE_NAME) == 0))
-    {
-        return DIRECTION_OUT; // Coming from inside to outside = direction out
-    }
-    if ((net_out != NULL && strcmp(net_out, INT_NET_DEVICE_NAME) == 0) || (net_in != NULL && strcmp(net_in, EXT_NET_DEVICE_NAME) == 0))
-    {
-        return DIRECTION_IN; // Coming from outside to inside = direction in
-    }
-    return DIRECTION_NONE;
-}
-
 /**
  * Parses socket buffer (packet), and fills the required fields in packet_t structure.
  * In addition, it transfers the data (from netwwork order) to host order
@@ -148,15 +133,4 @@ char *direction_str(direction_t direction)
         return "any";
     }
     return "";
-}
-
-/*
- * For debug purposes
- */
-void print_packet(packet_t *packet)
-{
-    INFO("Packet:\nhooknum = %d, type = %d, direction = %s, src_ip = %d.%d.%d.%d, src_port = % d, dst_ip = "
-         "%d.%d.%d.%d, dst_port = % d, protocol = %d",
-         packet->hooknum, packet->type, direction_str(packet->direction), IP_PARTS(packet->src_ip), packet->src_port,
-         IP_PARTS(packet->dst_ip), packet->dst_port, packet->protocol)
 }
\ No newline at end of file
@@ -6,9 +6,6 @@ In this module we parse a socket buffer (packet).
 
 #include "fw.h"
 
-#define INT_NET_DEVICE_NAME "enp0s8"
-#define EXT_NET_DEVICE_NAME "enp0s9"
-
 #define FW_INT_ADRR 167837955 // 10.1.1.3
 #define FW_EXT_ADRR 167838211 // 10.1.2.3
 
@@ -21,6 +18,7 @@ typedef enum
     PACKET_TYPE_FW,
     PACKET_TYPE_LOOPBACK,
     PACKET_TYPE_OTHER_PROTOCOL,
+    PACKET_TYPES_AMOUNT,
 } packet_type_t;
 
 // Holds packet's fields.
@@ -45,6 +43,5 @@ int is_xmas_packet(const struct sk_buff *skb);
 int is_syn_packet(const struct sk_buff *skb);
 
 char *direction_str(direction_t direction);
-void print_packet(packet_t *packet);
 
 #endif
@@ -1,23 +1,92 @@
 #include "proxy.h"
+#include "events.h"
 #include "fw.h"
 #include "parser.h"
+#include "stats.h"
 #include "tracker.h"
 
-extern struct list_head ctable;
-extern __u32 connections_amount;
+#include <linux/jhash.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+
+// The proxy connections are indexed by their client (internal id), and by the proxy port the user proxy
+// connects from. Both indexes are read under RCU like the connection table, and written under proxy_index.lock
+// (which is taken under the connection lock).
+// A proxied connection holds a local port of the user proxy, so there are at most 2^16 of them at a time:
+// with as many buckets, the chains stay short however many connections are proxied.
+#define PROXY_HASH_BITS (16)
+
+static struct
+{
+    struct hlist_head *clients;
+    struct hlist_head *ports;
+    __u32 seed;
+    spinlock_t lock;
+} proxy_index;
+
+static inline struct hlist_head *client_bucket(const id_t *client_id)
+{
+    return proxy_index.clients + (jhash_2words(client_id->ip, client_id->port, proxy_index.seed) &
+                                  ((1 << PROXY_HASH_BITS) - 1));
+}
+
+static inline struct hlist_head *port_bucket(__be16 proxy_port)
+{
+    return proxy_index.ports + (jhash_1word(proxy_port, proxy_index.seed) & ((1 << PROXY_HASH_BITS) - 1));
+}
+
+/**
+ * Allocate the proxy indexes (empty buckets are all zeros)
+ */
+int init_proxy(void)
+{
+    proxy_index.clients = kvzalloc(sizeof(struct hlist_head) << PROXY_HASH_BITS, GFP_KERNEL);
+    if (proxy_index.clients == NULL)
+    {
+        goto failed_clients;
+    }
+    proxy_index.ports = kvzalloc(sizeof(struct hlist_head) << PROXY_HASH_BITS, GFP_KERNEL);
+    if (proxy_index.ports == NULL)
+    {
+        goto failed_ports;
+    }
+
+    get_random_bytes(&proxy_index.seed, sizeof(proxy_index.seed));
+    spin_lock_init(&proxy_index.lock);
+    return 0;
 
-connection_t *proxy_ports[1 << 16]; // 2^16 possible ports
+failed_ports:
+    kvfree(proxy_index.clients);
+    proxy_index.clients = NULL;
+failed_clients:
+    return -ENOMEM;
+}
 
 /**
- * Finds proxy by client id (ip + port)
+ * Free the proxy indexes (after the connections, which are linked in them)
+ */
+void free_proxy(void)
+{
+    kvfree(proxy_index.ports);
+    proxy_index.ports = NULL;
+    kvfree(proxy_index.clients);
+    proxy_index.clients = NULL;
+}
+
+/**
+ * Finds proxy by client id (ip + port) (call under rcu_read_lock)
  */
 connection_t *find_proxy_by_client(id_t client_id)
 {
     connection_t *conn;
 
-    list_for_each_entry(conn, &ctable, list_node)
+    hlist_for_each_entry_rcu(conn, client_bucket(&client_id), client_node)
     {
-        if (is_proxy_connection(conn) && is_id_match(client_id, conn->internal_id))
+        if (conn->internal_id.ip == client_id.ip && conn->internal_id.port == client_id.port)
         {
             return conn;
         }
@@ -26,43 +95,74 @@ connection_t *find_proxy_by_client(id_t client_id)
 }
 
 /**
- * Finds proxy by user proxy port
+ * Finds proxy by user proxy port (call under rcu_read_lock)
  */
 connection_t *find_proxy_by_port(__be16 proxy_port)
 {
-    return proxy_ports[proxy_port];
+    connection_t *conn;
+
+    hlist_for_each_entry_rcu(conn, port_bucket(proxy_port), port_node)
+    {
+        if (conn->proxy_port == proxy_port)
+        {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Forget a connection that is about to be removed, so it can't be found by its client or proxy port
+ */
+void forget_proxy(connection_t *conn)
+{
+    if (hlist_unhashed(&conn->client_node))
+    {
+        return; // Never was a proxy connection
+    }
+
+    spin_lock(&proxy_index.lock);
+    hlist_del_init_rcu(&conn->client_node);
+    if (!hlist_unhashed(&conn->port_node))
+    {
+        hlist_del_init_rcu(&conn->port_node);
+    }
+    spin_unlock(&proxy_index.lock);
+}
+
+/**
+ * Make the IP and TCP headers of a packet writable (they may be shared with a clone, or out of the linear part).
+ * Returns 0 on failure. The header pointers of the packet are invalid afterwards, get them again.
+ */
+static int headers_writable(struct sk_buff *skb)
+{
+    return skb_ensure_writable(skb, ip_hdrlen(skb) + sizeof(struct tcphdr)) == 0;
+}
+
+/**
+ * Rewrite an address of a routed packet, and update the checksums incrementally (the payload isn't touched).
+ * The TCP checksum covers the addresses through the pseudo header. With CHECKSUM_PARTIAL only the pseudo header
+ * sum that the device completes is updated.
+ */
+static void replace_addr(struct sk_buff *skb, __be32 *addr, __be32 new_addr)
+{
+    csum_replace4(&ip_hdr(skb)->check, *addr, new_addr);
+    inet_proto_csum_replace4(&tcp_hdr(skb)->check, skb, *addr, new_addr, true);
+    *addr = new_addr;
 }
 
 /**
- * Fix packet checksum
+ * Rewrite a port of a routed packet, and update the TCP checksum incrementally
  */
-static void fix_checksum(struct sk_buff *skb)
+static void replace_port(struct sk_buff *skb, __be16 *port, __be16 new_port)
 {
-    struct iphdr *ip_header = ip_hdr(skb);
-    struct tcphdr *tcp_header = tcp_hdr(skb);
-
-    // Fix TCP header checksum
-    int tcplen = (ntohs(ip_header->tot_len) - ((ip_header->ihl) << 2));
-    tcp_header->check = 0;
-    tcp_header->check =
-        tcp_v4_check(tcplen, ip_header->saddr, ip_header->daddr, csum_partial((char *)tcp_header, tcplen, 0));
-
-    // Fix IP header checksum
-    ip_header->check = 0;
-    ip_header->check = ip_fast_csum((u8 *)ip_header, ip_header->ihl);
-    skb->ip_summed = CHECKSUM_NONE;
-
-    // Fix packet linearization
-    // skb->csum_valid = 0;
-    // if (skb_linearize(skb) < 0)
-    // {
-    //     /* Handle error
-    // }
+    inet_proto_csum_replace2(&tcp_hdr(skb)->check, skb, *port, new_port, false);
+    *port = new_port;
 }
 
 /**
  * Setup proxy connection (if it's of internal client -> external client form)
- * Returns 1 for proxy connection, otherwise 0.
+ * Returns 1 for proxy connection, otherwise 0 (or -1 if the packet couldn't be routed for the proxy).
  */
 int proxy_setup(packet_t *packet, connection_t *conn)
 {
@@ -82,7 +182,18 @@ int proxy_setup(packet_t *packet, connection_t *conn)
 
         if (is_proxy)
         {
-            proxy_route(packet);
+            // The connection may be set up already (by a retransmitted SYN)
+            if (hlist_unhashed(&conn->client_node))
+            {
+                spin_lock(&proxy_index.lock);
+                hlist_add_head_rcu(&conn->client_node, client_bucket(&conn->internal_id));
+                spin_unlock(&proxy_index.lock);
+            }
+
+            if (proxy_route(packet) < 0)
+            {
+                return -1;
+            }
         }
     }
     return is_proxy;
@@ -90,13 +201,11 @@ int proxy_setup(packet_t *packet, connection_t *conn)
 
 /**
  * Routing proxy connections.
- * Returns 1 if the packet is rounted for proxy, otherwise 0
+ * Returns 1 if the packet is rounted for proxy, otherwise 0 (or -1 if it should have been, but couldn't be written)
  */
 int proxy_route(packet_t *packet)
 {
     struct sk_buff *skb = packet->skb;
-    struct iphdr *iph = ip_hdr(skb);
-    struct tcphdr *tcph = tcp_hdr(skb);
 
     if (packet->hooknum == NF_INET_PRE_ROUTING)
     {
@@ -114,16 +223,21 @@ int proxy_route(packet_t *packet)
             {
                 __be16 redirect_port;
 
-                DINFO("c2p packet")
+                // A routed packet keeps the proxy connection alive
+                refresh_connection(proxy);
+
+                if (!headers_writable(skb))
+                {
+                    return -1;
+                }
 
                 // Change the routing
-                iph->daddr = htonl(FW_INT_ADRR);
                 redirect_port = (proxy->type == PROXY_HTTP) ? HTTP_PROXY_PORT : FTP_PROXY_PORT;
-                tcph->dest = htons(redirect_port);
-
-                // Fix the checksum
-                fix_checksum(packet->skb);
+                replace_addr(skb, &ip_hdr(skb)->daddr, htonl(FW_INT_ADRR));
+                replace_port(skb, &tcp_hdr(skb)->dest, htons(redirect_port));
 
+                trace_fw_proxy_redirect(packet, ROUTE_C2P);
+                COUNT_STAT(redirects[ROUTE_C2P]);
                 return 1;
             }
         }
@@ -140,14 +254,19 @@ int proxy_route(packet_t *packet)
                 // Check if the result is consistent (server id matches)
                 if (is_id_match(ext_id, proxy->external_id))
                 {
-                    DINFO("s2p packet")
+                    // A routed packet keeps the proxy connection alive
+                    refresh_connection(proxy);
 
-                    // Change the routing
-                    iph->daddr = htonl(FW_EXT_ADRR);
+                    if (!headers_writable(skb))
+                    {
+                        return -1;
+                    }
 
-                    // Fix the checksum
-                    fix_checksum(packet->skb);
+                    // Change the routing
+                    replace_addr(skb, &ip_hdr(skb)->daddr, htonl(FW_EXT_ADRR));
 
+                    trace_fw_proxy_redirect(packet, ROUTE_S2P);
+                    COUNT_STAT(redirects[ROUTE_S2P]);
                     return 1;
                 }
             }
@@ -168,14 +287,19 @@ int proxy_route(packet_t *packet)
                 // Check if the result is consistent (server id matches)
                 if (is_id_match(ext_id, proxy->external_id))
                 {
-                    DINFO("p2s packet")
+                    // A routed packet keeps the proxy connection alive
+                    refresh_connection(proxy);
 
-                    // Fake source
-                    iph->saddr = htonl(proxy->internal_id.ip);
+                    if (!headers_writable(skb))
+                    {
+                        return -1;
+                    }
 
-                    // Fix the checksum
-                    fix_checksum(packet->skb);
+                    // Fake source
+                    replace_addr(skb, &ip_hdr(skb)->saddr, htonl(proxy->internal_id.ip));
 
+                    trace_fw_proxy_redirect(packet, ROUTE_P2S);
+                    COUNT_STAT(redirects[ROUTE_P2S]);
                     return 1;
                 }
             }
@@ -192,15 +316,20 @@ int proxy_route(packet_t *packet)
 
             if (proxy != NULL)
             {
-                DINFO("p2c packet")
+                // A routed packet keeps the proxy connection alive
+                refresh_connection(proxy);
 
-                // Fake source
-                iph->saddr = htonl(proxy->external_id.ip);
-                tcph->source = htons(proxy->external_id.port);
+                if (!headers_writable(skb))
+                {
+                    return -1;
+                }
 
-                // Fix the checksum
-                fix_checksum(packet->skb);
+                // Fake source
+                replace_addr(skb, &ip_hdr(skb)->saddr, htonl(proxy->external_id.ip));
+                replace_port(skb, &tcp_hdr(skb)->source, htons(proxy->external_id.port));
 
+                trace_fw_proxy_redirect(packet, ROUTE_P2C);
+                COUNT_STAT(redirects[ROUTE_P2C]);
                 return 1;
             }
         }
@@ -220,20 +349,121 @@ int escape_ftp_data(packet_t *packet, connection_t *conn)
 }
 
 // ========================== Proxy device operations ===========================
+
+/**
+ * Find the original server of a proxied client (so the proxy doesn't have to search the connection table)
+ */
+static long get_proxy_dest(proxy_dest_t __user *user_dest)
+{
+    proxy_dest_t dest;
+    id_t client_id;
+    connection_t *proxy;
+
+    if (copy_from_user(&dest, user_dest, sizeof(dest)))
+    {
+        return -EFAULT;
+    }
+
+    client_id.ip = ntohl(dest.client_ip);
+    client_id.port = dest.client_port;
+
+    rcu_read_lock();
+    proxy = find_proxy_by_client(client_id);
+    if (proxy == NULL)
+    {
+        rcu_read_unlock();
+        return -ENOENT;
+    }
+    dest.server_ip = htonl(proxy->external_id.ip);
+    dest.server_port = proxy->external_id.port;
+    rcu_read_unlock();
+
+    if (copy_to_user(user_dest, &dest, sizeof(dest)))
+    {
+        return -EFAULT;
+    }
+    return 0;
+}
+
 const __u16 PROXY_SET_SIZE = sizeof(__be32) + 2 * sizeof(__be16);
 const __u16 FTP_ADD_SIZE = 2 * sizeof(__be32) + sizeof(__be16);
 
+/**
+ * Register the proxy port the user proxy connects to the server from, for the connection of the given client.
+ * Many proxy workers register ports concurrently: a port belongs to the last connection that registered it (the
+ * socket of an older one is gone), so the older one is unlinked from the port index.
+ * Returns 0, or -ENOENT if the client has no proxy connection.
+ */
+static int register_proxy_port(id_t client_id, __be16 proxy_port)
+{
+    connection_t *proxy, *other;
+    struct hlist_node *tmp;
+    int ret = -ENOENT;
+
+    rcu_read_lock();
+
+    proxy = find_proxy_by_client(client_id);
+    if (proxy == NULL)
+    {
+        rcu_read_unlock();
+        DINFO("register_proxy_port: can't find proxy")
+        return ret;
+    }
+
+    lock_connection(proxy);
+    if (is_connection_alive(proxy))
+    {
+        spin_lock(&proxy_index.lock);
+        if (!hlist_unhashed(&proxy->port_node))
+        {
+            hlist_del_init_rcu(&proxy->port_node);
+        }
+        hlist_for_each_entry_safe(other, tmp, port_bucket(proxy_port), port_node)
+        {
+            if (other->proxy_port == proxy_port)
+            {
+                hlist_del_init_rcu(&other->port_node);
+            }
+        }
+        proxy->proxy_port = proxy_port;
+        hlist_add_head_rcu(&proxy->port_node, port_bucket(proxy_port));
+        spin_unlock(&proxy_index.lock);
+        ret = 0;
+    }
+    unlock_connection(proxy);
+
+    rcu_read_unlock();
+
+    return ret;
+}
+
+static long set_proxy_port_ioctl(const proxy_port_t __user *user_port)
+{
+    proxy_port_t port;
+    id_t client_id;
+
+    if (copy_from_user(&port, user_port, sizeof(port)))
+    {
+        return -EFAULT;
+    }
+
+    client_id.ip = ntohl(port.client_ip);
+    client_id.port = port.client_port;
+
+    return register_proxy_port(client_id, port.proxy_port);
+}
+
 ssize_t set_proxy_port(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
     id_t client_id;
     __be32 client_ip;
     __be16 client_port;
     __be16 proxy_port;
-    connection_t *proxy;
+    int ret;
 
     if (count < PROXY_SET_SIZE)
     {
-        return 0;
+        return -EINVAL;
     }
 
     // Should get (client_ip, client_port, proxy_port)
@@ -246,22 +476,29 @@ ssize_t set_proxy_port(struct device *dev, struct device_attribute *attr, const
 
     DINFO("set_proxy_port: client_ip=%d.%d.%d.%d, client_port=%d, proxy_port=%d", IP_PARTS(client_id.ip), client_id.port, proxy_port)
 
-    proxy = find_proxy_by_client(client_id);
-    if (proxy == NULL)
+    ret = register_proxy_port(client_id, proxy_port);
+    return ret < 0 ? ret : PROXY_SET_SIZE;
+}
+
+long proxy_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd)
     {
-        DINFO("set_proxy_port: can't find proxy")
+    case PROXY_IOC_GET_DEST:
+        return get_proxy_dest((proxy_dest_t __user *)arg);
+    case PROXY_IOC_SET_PORT:
+        return set_proxy_port_ioctl((const proxy_port_t __user *)arg);
+    default:
+        return -ENOTTY;
     }
-
-    proxy->proxy_port = proxy_port;
-    proxy_ports[proxy_port] = proxy;
-
-    return PROXY_SET_SIZE;
 }
 
 ssize_t add_ftp_data(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
     __be32 ftp_ip, server_ip;
     __be16 ftp_port;
+    id_t int_id, ext_id;
+    tcp_state_t state = {PRESYN, DIRECTION_IN}; // Now the client becomes the server
     connection_t *conn;
 
     if (count < FTP_ADD_SIZE)
@@ -274,25 +511,23 @@ ssize_t add_ftp_data(struct device *dev, struct device_attribute *attr, const ch
     BUF2VAR(server_ip);
     BUF2VAR(ftp_port);
 
-    // Add an FTP data connection
-    conn = add_blank_connection();
-
     // Set identifiers
-    conn->internal_id.ip = ntohl(ftp_ip);
-    conn->internal_id.port = ftp_port;
-    conn->external_id.ip = ntohl(server_ip);
-    conn->external_id.port = 0; // Wildcard - match to any port
+    int_id.ip = ntohl(ftp_ip);
+    int_id.port = ftp_port;
+    ext_id.ip = ntohl(server_ip);
+    ext_id.port = 0; // Wildcard - match to any port
+
+    // Add an FTP data connection
+    conn = add_blank_connection(&int_id, &ext_id, &state, FTP_DATA);
+    if (conn == NULL)
+    {
+        return -ENOMEM;
+    }
     
     DINFO("Add_ftp_data: client_ip=%d.%d.%d.%d,  client_port=%d, server_ip=%d.%d.%d.%d, server_port=%d",
         IP_PARTS(conn->internal_id.ip), conn->internal_id.port, IP_PARTS(conn->external_id.ip), conn->external_id.port);
 
-    // Initialize connection state
-    conn->state.status = PRESYN;
-    conn->state.expected_direction = DIRECTION_IN; // Now the client becomes the server
-
-    // Non-proxy connection
-    conn->type = FTP_DATA;
-    conn->proxy_port = 1;
+    unlock_connection(conn);
 
     return FTP_ADD_SIZE;
 }
\ No newline at end of file
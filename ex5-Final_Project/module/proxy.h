@@ -1,26 +1,73 @@
 /*
 In this module we manage the proxy connections.
 */
+#ifndef _PROXY_H_
+#define _PROXY_H_
 
 #include "fw.h"
 #include "tracker.h"
 
+#include <linux/ioctl.h>
+
 #define HTTP_PORT 80
 #define FTP_PORT 21
 #define HTTP_PROXY_PORT 800
 #define FTP_PROXY_PORT 210
 
 // Proxy kernel operations
-void setup_proxy(packet_t *packet);
-connection_t *find_proxy_by_port(__be16 proxy_port);
+int init_proxy(void);
+void free_proxy(void);
+connection_t *find_proxy_by_client(id_t client_id); // call under rcu_read_lock
+connection_t *find_proxy_by_port(__be16 proxy_port); // call under rcu_read_lock
+void forget_proxy(connection_t *conn);               // call under the connection lock
 
-// Proxy inspecting operations
+// Proxy inspecting operations (call under rcu_read_lock, and under the lock of the given connection)
 int proxy_setup(packet_t *packet, connection_t *conn);
-int proxy_route(packet_t *packet);
 int escape_ftp_data(packet_t *packet, connection_t *conn);
 
+// Redirects a packet of a proxied connection (call under rcu_read_lock). fw_inspect() calls it before any
+// connection is looked up, so it relies on no connection lock: it reads the ids, type and ports of the proxy,
+// and refreshes its timeout (with WRITE_ONCE).
+int proxy_route(packet_t *packet);
+
+// The ways proxy_route() redirects a packet (client, proxy and server)
+typedef enum
+{
+    ROUTE_C2P,
+    ROUTE_S2P,
+    ROUTE_P2S,
+    ROUTE_P2C,
+    ROUTES_AMOUNT,
+} proxy_route_t;
+
+// The original destination of a proxied client (fixed layout, shared with the proxies).
+// IPs are in network order, ports in host order (like the set_port attribute).
+typedef struct
+{
+    __u32 client_ip;
+    __u32 server_ip;
+    __u16 client_port;
+    __u16 server_port;
+} proxy_dest_t;
+
+// The proxy port of a proxied client (same byte orders)
+typedef struct
+{
+    __u32 client_ip;
+    __u16 client_port;
+    __u16 proxy_port;
+} proxy_port_t;
+
+// Proxy device ioctls
+#define PROXY_IOC_MAGIC 'f'
+#define PROXY_IOC_GET_DEST _IOWR(PROXY_IOC_MAGIC, 1, proxy_dest_t) // fills the server of the given client
+#define PROXY_IOC_SET_PORT _IOW(PROXY_IOC_MAGIC, 2, proxy_port_t)  // like the set_port attribute
+
 // Proxy devices operations
+long proxy_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 ssize_t set_proxy_port(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 
-ssize_t add_ftp_data(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
\ No newline at end of file
+ssize_t add_ftp_data(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+
+#endif
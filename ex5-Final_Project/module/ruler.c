@@ -2,44 +2,143 @@
 In this module is responsible for rules logic & maintaining.
 */
 #include "ruler.h"
+#include "classifier.h"
 #include "fw.h"
 
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
 const __u8 RULE_SIZE =
     20 + sizeof(direction_t) + sizeof(ack_t) + 2 * sizeof(__be32) + 2 * sizeof(__be16) + 4 * sizeof(__u8);
 
-// Aloccating array to hold the rules.
-static struct
+// The active rule table (NULL until the first rules are loaded). A reload publishes a new table with RCU,
+// so the packet path never waits, and never sees a partially loaded table.
+static rule_table_t __rcu *rule_table = NULL;
+
+// Serializes publishing rule tables, and reading them by the user
+static DEFINE_MUTEX(rules_mutex);
+
+// An upload in progress: the amount of rules first, then the rules one after another.
+// The data may be split into arbitrary chunks, so a record can be cut between two writes.
+typedef struct
+{
+    rule_table_t *table; // the shadow table, published only after all of it was received and validated
+    __u32 amount;
+    __u32 received;
+    __u8 is_amount_received;
+    int err; // the upload failed: -EINVAL for data that isn't a valid rule table, or -ENOMEM
+    __u8 is_done;
+    char record[sizeof(rule_t)]; // a partially received record (RULE_SIZE <= sizeof(rule_t))
+    __u8 record_len;
+} upload_t;
+
+/**
+ * Returns the active rule table, or NULL if no rules were loaded yet.
+ * The caller must be in an RCU read-side critical section (as the netfilter hooks are).
+ */
+const rule_table_t *get_rule_table(void)
 {
-    rule_t rules[MAX_RULES];
-    __u8 amount;
-    active_t active;
-} rule_table = {.active = INACTIVE};
+    return rcu_dereference(rule_table);
+}
 
 /**
- * Returns a pointer to the head of the rule table.
+ * Returns the active rule table, for one who holds rules_mutex
  */
-rule_t *get_rules(void)
+static rule_table_t *locked_rule_table(void)
 {
-    return rule_table.rules;
+    return rcu_dereference_protected(rule_table, lockdep_is_held(&rules_mutex));
+}
+
+static void free_table(rule_table_t *table)
+{
+    int cpu;
+
+    if (table == NULL)
+    {
+        return;
+    }
+    if (table->hits != NULL)
+    {
+        for_each_possible_cpu(cpu)
+        {
+            vfree(*per_cpu_ptr(table->hits, cpu));
+        }
+        free_percpu(table->hits);
+    }
+    free_dtree(table->tree);
+    vfree(table->rules);
+    kfree(table);
+}
+
+static rule_table_t *alloc_table(__u32 amount)
+{
+    rule_table_t *table;
+    rule_hits_t *hits;
+    int cpu;
+
+    table = (rule_table_t *)kzalloc(sizeof(rule_table_t), GFP_KERNEL);
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    table->rules = vmalloc(max_t(size_t, amount, 1) * sizeof(rule_t));
+    table->hits = alloc_percpu(rule_hits_t *);
+    if (table->rules == NULL || table->hits == NULL)
+    {
+        free_table(table);
+        return NULL;
+    }
+
+    // The counters may be too large for the per-CPU allocator, so each CPU gets its own array
+    for_each_possible_cpu(cpu)
+    {
+        hits = vzalloc_node((amount + 1) * sizeof(rule_hits_t), cpu_to_node(cpu));
+        *per_cpu_ptr(table->hits, cpu) = hits;
+        if (hits == NULL)
+        {
+            free_table(table);
+            return NULL;
+        }
+    }
+    return table;
 }
 
 /**
- * Returns the current amount of rules in the rule table.
+ * Count a packet that was decided by the rule (index < amount) or by the default drop (index = amount).
+ * Lock free: each CPU updates only its own counters.
  */
-__u8 get_rules_amount(void)
+void count_rule_hit(const rule_table_t *table, __u32 index, unsigned int bytes)
 {
-    return rule_table.amount;
+    rule_hits_t *hits;
+
+    // The LOCAL_OUT hook may run in process context, keep the softirq hooks of this CPU out of the update
+    local_bh_disable();
+    hits = *this_cpu_ptr(table->hits) + index;
+    hits->packets++;
+    hits->bytes += bytes;
+    local_bh_enable();
 }
 
 /**
- * Tells whether the rule table is active. (0 = false) , (1 = true)
- * It can be inactive in one of the 2 cases:
- * 1. *After* loading the module and *before* recieving rules from the user for the first time.
- * 2. If the user introduced unvalid rules.
+ * Sum the counters of a rule over all the CPUs
  */
-active_t is_active_table(void)
+static void fold_hits(const rule_table_t *table, __u32 index, rule_hits_t *sum)
 {
-    return rule_table.active;
+    const rule_hits_t *hits;
+    int cpu;
+
+    sum->packets = 0;
+    sum->bytes = 0;
+    for_each_possible_cpu(cpu)
+    {
+        hits = *per_cpu_ptr(table->hits, cpu) + index;
+        sum->packets += READ_ONCE(hits->packets);
+        sum->bytes += READ_ONCE(hits->bytes);
+    }
 }
 
 /*
@@ -78,31 +177,6 @@ void buf2rule(rule_t *rule, const char *buf)
     BUF2VAR(rule->action);
 }
 
-ssize_t show_rules(struct device *dev, struct device_attribute *attr, char *buf)
-{
-    rule_t *rule;
-    
-    if (rule_table.active == INACTIVE)
-    {
-        return 0;
-    }
-    
-    DINFO("Showing %d rules", rule_table.amount)
-
-    // Storing the amount of rules in the buffer first
-    VAR2BUF(rule_table.amount);
-
-    // Stroing each rule in the buffer a serial manner
-    for (rule = rule_table.rules; rule < rule_table.rules + rule_table.amount; rule++)
-    {
-        rule2buf(rule, buf);
-        buf += RULE_SIZE;
-    }
-
-    // Return the total size we have passed
-    return 1 + rule_table.amount * RULE_SIZE;
-}
-
 /**
  * Checks if the rule fields are in the required range
  */
@@ -134,37 +208,417 @@ __u8 is_valid_rule(rule_t *rule)
     return valid_direction && valid_prefix && valid_ports && valid_protocol && valid_ack && valid_action;
 }
 
-ssize_t store_rules(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+static void upload_init(upload_t *upload)
+{
+    memset(upload, 0, sizeof(*upload));
+}
+
+/**
+ * Consume the next chunk of an upload. Returns 0 on success, -EINVAL if the data isn't a valid rule table, or
+ * -ENOMEM if the table can't be allocated.
+ */
+static int upload_write(upload_t *upload, const char *buf, size_t count)
+{
+    size_t record_size, n;
+
+    while (count > 0 && upload->err == 0)
+    {
+        // Complete the current record
+        record_size = upload->is_amount_received ? RULE_SIZE : sizeof(upload->amount);
+        n = min(record_size - upload->record_len, count);
+        memcpy(upload->record + upload->record_len, buf, n);
+        upload->record_len += n;
+        buf += n;
+        count -= n;
+
+        if (upload->record_len < record_size)
+        {
+            break;
+        }
+        upload->record_len = 0;
+
+        if (!upload->is_amount_received)
+        {
+            // Getting the amount of rules first
+            memcpy(&upload->amount, upload->record, sizeof(upload->amount));
+            upload->is_amount_received = 1;
+
+            DINFO("Storing %u rules", upload->amount)
+
+            if (upload->amount > MAX_RULES)
+            {
+                upload->err = -EINVAL;
+                break;
+            }
+            upload->table = alloc_table(upload->amount);
+            if (upload->table == NULL)
+            {
+                upload->err = -ENOMEM;
+            }
+            continue;
+        }
+
+        // Getting each rule in a serial manner
+        if (upload->received == upload->amount)
+        {
+            // More rules than declared
+            upload->err = -EINVAL;
+            break;
+        }
+        buf2rule(upload->table->rules + upload->received, upload->record);
+        if (!is_valid_rule(upload->table->rules + upload->received))
+        {
+            upload->err = -EINVAL;
+            break;
+        }
+        upload->received++;
+    }
+
+    return upload->err;
+}
+
+/**
+ * Finish an upload: publish the uploaded table instead of the active one.
+ * A failed upload is rejected, and the active table stays as it is.
+ * Returns 0 on success, or the error of the upload (-EINVAL for a truncated or invalid table, or -ENOMEM).
+ */
+static int upload_commit(upload_t *upload)
+{
+    rule_table_t *old_table;
+
+    upload->is_done = 1;
+
+    if (upload->err == -ENOMEM)
+    {
+        INFO("Failed to allocate the uploaded rules, keeping the active rule table")
+        return -ENOMEM;
+    }
+    if (upload->err != 0 || !upload->is_amount_received || upload->record_len != 0 ||
+        upload->received != upload->amount)
+    {
+        // The data isn't representing a valid (and whole) rule table
+        INFO("The uploaded rules are invalid, keeping the active rule table")
+        return -EINVAL;
+    }
+
+    // Compile the shadow table for the packet path
+    upload->table->amount = upload->amount;
+    upload->table->tree = build_dtree(upload->table->rules, upload->amount);
+    if (upload->table->tree == NULL)
+    {
+        INFO("Failed to compile the rule table, falling back to a linear scan")
+    }
+
+    mutex_lock(&rules_mutex);
+    old_table = locked_rule_table();
+    rcu_assign_pointer(rule_table, upload->table);
+    mutex_unlock(&rules_mutex);
+
+    upload->table = NULL; // Owned by the rule table from now on
+
+    // Wait for the packets that may still be inspected against the old table
+    synchronize_rcu();
+    free_table(old_table);
+
+    return 0;
+}
+
+static void upload_cleanup(upload_t *upload)
 {
+    free_table(upload->table);
+    upload->table = NULL;
+}
+
+/**
+ * Writes the rule table to buf, if it fits in PAGE_SIZE (otherwise it can be read only through the rules device)
+ */
+ssize_t show_rules(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    const rule_table_t *table;
     rule_t *rule;
+    ssize_t size;
 
-    // Getting the amount of rules first
-    BUF2VAR(rule_table.amount);
+    mutex_lock(&rules_mutex);
 
-    DINFO("Storing %d rules", rule_table.amount)
+    table = locked_rule_table();
+    if (table == NULL)
+    {
+        mutex_unlock(&rules_mutex);
+        return 0;
+    }
 
-    if (rule_table.amount > MAX_RULES || count != rule_table.amount * RULE_SIZE + sizeof(rule_table.amount))
+    size = sizeof(table->amount) + (ssize_t)table->amount * RULE_SIZE;
+    if (size > PAGE_SIZE)
     {
-        // The buffer isn't representing a valid rule table
-        rule_table.active = INACTIVE;
-        return count;
+        mutex_unlock(&rules_mutex);
+        return -EFBIG;
     }
 
-    // Getting each rule in the buffer a serial manner
-    for (rule = rule_table.rules; rule < rule_table.rules + rule_table.amount; rule++)
+    DINFO("Showing %u rules", table->amount)
+
+    // Storing the amount of rules in the buffer first
+    VAR2BUF(table->amount);
+
+    // Stroing each rule in the buffer a serial manner
+    for (rule = table->rules; rule < table->rules + table->amount; rule++)
     {
-        buf2rule(rule, buf);
+        rule2buf(rule, buf);
         buf += RULE_SIZE;
+    }
 
-        if (!is_valid_rule(rule))
+    mutex_unlock(&rules_mutex);
+
+    // Return the total size we have passed
+    return size;
+}
+
+/**
+ * Loads a whole rule table at once (bounded by PAGE_SIZE, larger tables are written to the rules device).
+ * A failed upload is returned to the writer, the active table stays as it is.
+ */
+ssize_t store_rules(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    upload_t upload;
+    int ret;
+
+    upload_init(&upload);
+    upload_write(&upload, buf, count);
+    ret = upload_commit(&upload);
+    upload_cleanup(&upload);
+
+    return (ret < 0) ? ret : count;
+}
+
+// Implementing rules device operations
+
+/**
+ * Opening the device for writing begins an upload of a new rule table
+ */
+int open_rules(struct inode *_inode, struct file *filp)
+{
+    upload_t *upload;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+    {
+        return 0;
+    }
+
+    upload = (upload_t *)kmalloc(sizeof(upload_t), GFP_KERNEL);
+    if (upload == NULL)
+    {
+        return -ENOMEM;
+    }
+    upload_init(upload);
+    filp->private_data = upload;
+    return 0;
+}
+
+/**
+ * Streams the rule table: the amount of rules first, then whole rules (as many as fit in length)
+ */
+ssize_t read_rules(struct file *filp, char *buf, size_t length, loff_t *offp)
+{
+    const rule_table_t *table;
+    char my_buf[sizeof(rule_t)];
+    __u32 index;
+    int count = 0;
+
+    mutex_lock(&rules_mutex);
+
+    table = locked_rule_table();
+    if (table == NULL)
+    {
+        mutex_unlock(&rules_mutex);
+        return 0;
+    }
+
+    if (*offp == 0)
+    {
+        if (length < sizeof(table->amount))
+        {
+            mutex_unlock(&rules_mutex);
+            return 0;
+        }
+
+        if (copy_to_user(buf, &table->amount, sizeof(table->amount)))
         {
-            // The buffer isn't representing a valid rule table
-            rule_table.active = INACTIVE;
-            return count;
+            mutex_unlock(&rules_mutex);
+            return -EFAULT;
         }
+
+        count += sizeof(table->amount);
+        length -= sizeof(table->amount);
     }
 
-    // The rule table is valid, and has been loaded
-    rule_table.active = ACTIVE;
+    index = (*offp + count - sizeof(table->amount)) / RULE_SIZE;
+    for (; index < table->amount && length >= RULE_SIZE; index++)
+    {
+        rule2buf(table->rules + index, my_buf);
+        if (copy_to_user(buf + count, my_buf, RULE_SIZE))
+        {
+            mutex_unlock(&rules_mutex);
+            return -EFAULT;
+        }
+        count += RULE_SIZE;
+        length -= RULE_SIZE;
+    }
+
+    mutex_unlock(&rules_mutex);
+
+    *offp += count;
     return count;
+}
+
+/**
+ * Consumes a chunk of the uploaded rule table
+ */
+ssize_t write_rules(struct file *filp, const char *buf, size_t length, loff_t *offp)
+{
+    upload_t *upload = (upload_t *)filp->private_data;
+    char my_buf[UPLOAD_CHUNK];
+    size_t n, count = 0;
+    int err;
+
+    if (upload == NULL || upload->is_done)
+    {
+        return -EINVAL;
+    }
+
+    while (count < length)
+    {
+        n = min(length - count, sizeof(my_buf));
+        if (copy_from_user(my_buf, buf + count, n))
+        {
+            return -EFAULT;
+        }
+
+        err = upload_write(upload, my_buf, n);
+        if (err != 0)
+        {
+            return err;
+        }
+        count += n;
+    }
+
+    *offp += count;
+    return count;
+}
+
+/**
+ * Closing the device ends the upload. The result is returned by close().
+ */
+int flush_rules(struct file *filp, fl_owner_t id)
+{
+    upload_t *upload = (upload_t *)filp->private_data;
+
+    if (upload == NULL || upload->is_done)
+    {
+        return 0;
+    }
+    return upload_commit(upload);
+}
+
+int release_rules(struct inode *_inode, struct file *filp)
+{
+    upload_t *upload = (upload_t *)filp->private_data;
+
+    if (upload != NULL)
+    {
+        upload_cleanup(upload);
+        kfree(upload);
+    }
+    return 0;
+}
+
+/**
+ * Pass a snapshot of the hit counters (binary): the amount of rules first, then a rule_hits_t per rule,
+ * and a last one for the default drop. The counters are summed over the CPUs as they are read.
+ */
+ssize_t read_hits(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off,
+                  size_t count)
+{
+    const rule_table_t *table;
+    rule_hits_t hits;
+    const char *record;
+    size_t size, record_size, record_off, n, copied = 0;
+    loff_t pos;
+
+    mutex_lock(&rules_mutex);
+
+    table = locked_rule_table();
+    if (table == NULL)
+    {
+        mutex_unlock(&rules_mutex);
+        return 0;
+    }
+
+    size = sizeof(table->amount) + ((size_t)table->amount + 1) * sizeof(rule_hits_t);
+    if (off >= size)
+    {
+        mutex_unlock(&rules_mutex);
+        return 0;
+    }
+    count = min(count, size - (size_t)off);
+
+    // The reader may ask for any part of the snapshot, so records can be cut at both ends
+    while (copied < count)
+    {
+        pos = off + copied;
+        if (pos < sizeof(table->amount))
+        {
+            record = (const char *)&table->amount;
+            record_size = sizeof(table->amount);
+            record_off = pos;
+        }
+        else
+        {
+            pos -= sizeof(table->amount);
+            fold_hits(table, pos / sizeof(rule_hits_t), &hits);
+            record = (const char *)&hits;
+            record_size = sizeof(rule_hits_t);
+            record_off = pos % sizeof(rule_hits_t);
+        }
+
+        n = min(record_size - record_off, count - copied);
+        memcpy(buf + copied, record + record_off, n);
+        copied += n;
+    }
+
+    mutex_unlock(&rules_mutex);
+    return copied;
+}
+
+/**
+ * Pass the decision tree statistics (dtree_stats_t) to the user
+ */
+ssize_t show_tree_stats(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    const rule_table_t *table;
+    dtree_stats_t stats;
+
+    mutex_lock(&rules_mutex);
+
+    // Empty read: no tree, the rules are scanned linearly
+    table = locked_rule_table();
+    if (table == NULL || table->tree == NULL)
+    {
+        mutex_unlock(&rules_mutex);
+        return 0;
+    }
+    stats = table->tree->stats;
+
+    mutex_unlock(&rules_mutex);
+
+    VAR2BUF(stats);
+    return sizeof(stats);
+}
+
+/**
+ * Free all resources acquired by the rule table
+ */
+void free_rules(void)
+{
+    // No packet can reach the table by now
+    free_table(rcu_dereference_protected(rule_table, 1));
+    RCU_INIT_POINTER(rule_table, NULL);
 }
\ No newline at end of file
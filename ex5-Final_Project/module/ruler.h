@@ -1,28 +1,63 @@
 #ifndef _RULER_H_
 #define _RULER_H_
 
+#include "classifier.h"
 #include "fw.h"
 
-#define MAX_RULES (50)
+#define MAX_RULES (1 << 17)
+
+// The rules device copies uploaded data from the user in chunks of this size
+#define UPLOAD_CHUNK (256)
 
 // macros for rule fiels
 #define PREFIX_IP_ANY (0) // A prefix size that used to indicate, the rule allows any IP address
 #define PORT_ANY (0)
 #define PORT_ABOVE_1023 (1024)
 
-typedef enum
+// Hit counters of a rule
+typedef struct
+{
+    __u64 packets;
+    __u64 bytes;
+} rule_hits_t;
+
+// A rule table, it isn't modified once published (a reload publishes a new one)
+typedef struct
 {
-    INACTIVE,
-    ACTIVE
-} active_t;
+    rule_t *rules;
+    __u32 amount;
+    dtree_t *tree;                // the rules compiled into a decision tree (NULL = scan the rules linearly)
+    rule_hits_t *__percpu *hits; // per CPU: a counter per rule, and one more for the default drop
+} rule_table_t;
+
+// The index of the default drop counter
+#define HITS_DEFAULT_DROP(table) ((table)->amount)
 
-// Define getters
-rule_t *get_rules(void);
-__u8 get_rules_amount(void);
-active_t is_active_table(void);
+// The size of an uploaded rule record, and its encoding
+extern const __u8 RULE_SIZE;
+void rule2buf(const rule_t *rule, char *buf);
+
+// Returns the active rule table, or NULL if no rules were loaded yet (call under rcu_read_lock)
+const rule_table_t *get_rule_table(void);
+
+// Count a packet that was decided by the rule (or by HITS_DEFAULT_DROP)
+void count_rule_hit(const rule_table_t *table, __u32 index, unsigned int bytes);
+
+// Free all resources acquired by the rule table
+void free_rules(void);
 
 // Define device rules operations
 ssize_t show_rules(struct device *dev, struct device_attribute *attr, char *buf);
 ssize_t store_rules(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+ssize_t show_tree_stats(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t read_hits(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off,
+                  size_t count);
+
+// Define rules device operations: writing uploads a new rule table (committed on close), reading streams it
+int open_rules(struct inode *_inode, struct file *filp);
+ssize_t read_rules(struct file *filp, char *buf, size_t length, loff_t *offp);
+ssize_t write_rules(struct file *filp, const char *buf, size_t length, loff_t *offp);
+int flush_rules(struct file *filp, fl_owner_t id);
+int release_rules(struct inode *_inode, struct file *filp);
 
 #endif
\ No newline at end of file
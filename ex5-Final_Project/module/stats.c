@@ -0,0 +1,36 @@
+#include "stats.h"
+
+#include <linux/fs.h>
+
+DEFINE_PER_CPU(fw_stats_t, fw_stats);
+
+/**
+ * Sum the counters over all the CPUs (a counter may be a packet behind, but never torn)
+ */
+static void fold_stats(fw_stats_t *sum)
+{
+    const __u64 *counters;
+    __u64 *sum_counters = (__u64 *)sum;
+    unsigned int i;
+    int cpu;
+
+    memset(sum, 0, sizeof(fw_stats_t));
+    for_each_possible_cpu(cpu)
+    {
+        counters = (const __u64 *)per_cpu_ptr(&fw_stats, cpu);
+        for (i = 0; i < sizeof(fw_stats_t) / sizeof(__u64); i++)
+        {
+            sum_counters[i] += READ_ONCE(counters[i]);
+        }
+    }
+}
+
+// Implementing stats device operations
+
+ssize_t read_stats(struct file *filp, char *buf, size_t length, loff_t *offp)
+{
+    fw_stats_t stats;
+
+    fold_stats(&stats);
+    return simple_read_from_buffer(buf, length, offp, &stats, sizeof(stats));
+}
@@ -0,0 +1,48 @@
+/*
+In this module we count the packets and the verdicts of the firewall.
+*/
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "fw.h"
+#include "parser.h"
+#include "proxy.h"
+
+#include <linux/log2.h>
+#include <linux/percpu.h>
+
+// The verdicts are counted by reason: 0 for the rules (any rule index), and i for the reason -2^(i-1) of reason_t
+#define STATS_REASONS (8)
+
+// The firewall counters (fixed layout, shared with the user).
+// The verdicts are the logged ones: [reason][0] counts the drops, and [reason][1] the accepts.
+typedef struct
+{
+    __u64 packets;
+    __u64 bytes;
+    __u64 types[PACKET_TYPES_AMOUNT];
+    __u64 verdicts[STATS_REASONS][2];
+    __u64 conn_inserts;
+    __u64 conn_removals;
+    __u64 conn_misses; // lookups of packets that found no connection
+    __u64 redirects[ROUTES_AMOUNT];
+} fw_stats_t;
+
+// Per CPU, like the latency histograms (see latency.c)
+DECLARE_PER_CPU(fw_stats_t, fw_stats);
+
+#define COUNT_STAT(field) this_cpu_inc(fw_stats.field)
+#define ADD_STAT(field, amount) this_cpu_add(fw_stats.field, amount)
+
+static inline unsigned int reason_index(reason_t reason)
+{
+    return (reason >= 0) ? 0 : ilog2(-reason) + 1;
+}
+
+// Count a logged verdict
+#define COUNT_VERDICT(action, reason) COUNT_STAT(verdicts[reason_index(reason)][(action) == NF_ACCEPT])
+
+// Stats device operations: a read passes the counters (fw_stats_t), summed over all the CPUs
+ssize_t read_stats(struct file *filp, char *buf, size_t length, loff_t *offp);
+
+#endif
@@ -1,10 +1,86 @@
 #include "tracker.h"
 #include "fw.h"
+#include "proxy.h"
+#include "stats.h"
+
+#include <linux/atomic.h>
+#include <linux/jhash.h>
+#include <linux/mempool.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #define ID_PORT_ANY 0
 
-LIST_HEAD(ctable);
-__u32 connections_amount = 0;
+// The table holds 2^bits buckets. It grows when the average chain exceeds CTABLE_GROW_LOAD,
+// and shrinks when it drops under 1 / CTABLE_SHRINK_LOAD. Resizing is left to the garbage collector.
+#define CTABLE_MIN_BITS (10)
+#define CTABLE_MAX_BITS (20)
+#define CTABLE_GROW_LOAD (2)
+#define CTABLE_SHRINK_LOAD (8)
+
+// The connections are locked by stripes: a connection takes lock (hash % CTABLE_LOCKS).
+// The table never has less buckets than locks, so all the connections of a bucket share a lock (in the old buckets
+// and in the new ones alike, while a resize moves them).
+#define CTABLE_LOCKS (1 << CTABLE_MIN_BITS)
+
+// Idle timeouts (seconds), by TCP status. A connection that sees no valid packet for that long is removed.
+static const unsigned int conn_timeouts[] = {
+    [PRESYN] = 60,          // Expecting a SYN (e.g. an FTP data connection)
+    [SYN] = 30,             // Half open - short, so a SYN flood can't fill the table
+    [SYN_ACK] = 30,         //
+    [ESTABLISHED] = 432000, // 5 days
+    [FIN1] = 120,           // Closing
+    [A_ACK] = 120,          //
+    [A_FIN2] = 120,         //
+    [B_FIN2] = 120,         //
+    [B_ACK] = 120,          //
+};
+
+// Proxy connections aren't tracked by status, they expire after being idle for this long (seconds)
+#define CONN_TIMEOUT_PROXY (7200)
+
+// The garbage collector sweeps the whole table every CONN_GC_SLICES runs, a run every CONN_GC_INTERVAL.
+// A run locks one bucket at a time, and yields the CPU every CONN_GC_BATCH buckets.
+#define CONN_GC_INTERVAL (HZ)
+#define CONN_GC_SLICES (8)
+#define CONN_GC_BATCH (256)
+
+// The connections are allocated from their own slab cache, with a reserve for when the system is short on memory
+#define CONN_POOL_RESERVE (256)
+
+// A stripe of the connection table: the lock of its connections, and a count that changes while a resize moves them
+// (so the lookups of the stripe know to retry)
+typedef struct
+{
+    spinlock_t lock;
+    seqcount_t moving;
+} ctable_stripe_t;
+
+// The connection table - a hash table of connections, chained by hash_node
+static struct
+{
+    ctable_buckets_t __rcu *buckets;
+    __u32 seed;
+    atomic_t amount;
+    atomic_t alloc_failures; // connections that couldn't be allocated
+
+    // Owned by the garbage collector
+    __u32 resizes;
+    __u32 expired;
+    __u32 gc_bucket; // the next bucket to be scanned
+
+    ctable_stripe_t stripes[CTABLE_LOCKS];
+
+    struct kmem_cache *cache;
+    mempool_t *pool;
+} ctable;
+
+static void gc_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(gc_work, gc_worker);
 
 direction_t flip_direction(direction_t direction)
 {
@@ -49,77 +125,496 @@ int is_id_match(const id_t id1, const id_t id2)
 }
 
 /**
- * Add a blank connection
+ * Hash of a connection's (internal_id, external_id) pair.
+ * The external port is left out, so wildcard (FTP data) entries share a bucket with their matches.
+ */
+static inline __u32 conn_hash(const id_t *internal_id, const id_t *external_id)
+{
+    return jhash_3words(internal_id->ip, external_id->ip, internal_id->port, ctable.seed);
+}
+
+/**
+ * Returns the current buckets (call under rcu_read_lock)
+ */
+ctable_buckets_t *get_ctable_buckets(void)
+{
+    return rcu_dereference(ctable.buckets);
+}
+
+// The buckets are replaced only by the garbage collector, before it moves any stripe (so a stripe holder sees them)
+static inline ctable_buckets_t *locked_buckets(void)
+{
+    return rcu_dereference_protected(ctable.buckets, 1);
+}
+
+static inline struct hlist_head *hash2bucket(ctable_buckets_t *buckets, __u32 hash)
+{
+    return buckets->heads + (hash & ((1U << buckets->bits) - 1));
+}
+
+// The stripe of a hash (or of a bucket - it's the same stripe)
+static inline ctable_stripe_t *hash2stripe(__u32 hash)
+{
+    return ctable.stripes + (hash & (CTABLE_LOCKS - 1));
+}
+
+static ctable_buckets_t *alloc_buckets(__u8 bits)
+{
+    ctable_buckets_t *buckets = kvzalloc(sizeof(*buckets) + (sizeof(struct hlist_head) << bits), GFP_KERNEL);
+    if (buckets != NULL)
+    {
+        buckets->bits = bits;
+        RCU_INIT_POINTER(buckets->old, NULL);
+    }
+    return buckets;
+}
+
+/**
+ * Allocate the connection table, and the connections pool
+ */
+int init_connections(void)
+{
+    ctable_buckets_t *buckets;
+    int i;
+
+    buckets = alloc_buckets(CTABLE_MIN_BITS);
+    if (buckets == NULL)
+    {
+        goto failed_buckets;
+    }
+
+    ctable.cache = kmem_cache_create("fw_connection", sizeof(connection_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (ctable.cache == NULL)
+    {
+        goto failed_cache;
+    }
+    ctable.pool = mempool_create_slab_pool(CONN_POOL_RESERVE, ctable.cache);
+    if (ctable.pool == NULL)
+    {
+        goto failed_pool;
+    }
+
+    get_random_bytes(&ctable.seed, sizeof(ctable.seed));
+    atomic_set(&ctable.amount, 0);
+    atomic_set(&ctable.alloc_failures, 0);
+    ctable.resizes = 0;
+    ctable.expired = 0;
+    ctable.gc_bucket = 0;
+    for (i = 0; i < CTABLE_LOCKS; i++)
+    {
+        spin_lock_init(&ctable.stripes[i].lock);
+        seqcount_init(&ctable.stripes[i].moving);
+    }
+    RCU_INIT_POINTER(ctable.buckets, buckets);
+
+    schedule_delayed_work(&gc_work, CONN_GC_INTERVAL);
+    return 0;
+
+failed_pool:
+    kmem_cache_destroy(ctable.cache);
+failed_cache:
+    kvfree(buckets);
+failed_buckets:
+    return -ENOMEM;
+}
+
+/**
+ * Lock the stripe of a hash (or of a bucket - it's the same stripe).
+ * The packet path shares the connections, hence the bottom halves are disabled.
+ */
+static void lock_stripe(__u32 hash)
+{
+    local_bh_disable();
+    spin_lock(&hash2stripe(hash)->lock);
+}
+
+static void unlock_stripe(__u32 hash)
+{
+    spin_unlock(&hash2stripe(hash)->lock);
+    local_bh_enable();
+}
+
+void lock_connection(const connection_t *conn)
+{
+    lock_stripe(conn->hash);
+}
+
+void unlock_connection(const connection_t *conn)
+{
+    unlock_stripe(conn->hash);
+}
+
+/**
+ * Tells if the connection is still in the table (call under the connection lock).
+ * A connection found under RCU may have been removed before we got its lock.
+ */
+int is_connection_alive(const connection_t *conn)
+{
+    return !hlist_unhashed(&conn->hash_node);
+}
+
+/**
+ * Move all the connections to a table of 2^bits buckets (called by the garbage collector only).
+ * The new buckets are published first, linked to the old ones: new connections go to the new buckets, and the lookups
+ * look in both. Then the connections move a stripe at a time, under the lock of that stripe only, so the packet path
+ * waits only for its own stripe. A lookup may miss a connection that moved meanwhile, the moving count of the stripe
+ * tells it to look again.
+ */
+static void ctable_resize(__u8 bits)
+{
+    ctable_buckets_t *old = locked_buckets(), *buckets;
+    ctable_stripe_t *stripe;
+    struct hlist_node *temp;
+    connection_t *conn;
+    __u32 i, bkt;
+
+    buckets = alloc_buckets(bits);
+    if (buckets == NULL)
+    {
+        return;
+    }
+    RCU_INIT_POINTER(buckets->old, old);
+    rcu_assign_pointer(ctable.buckets, buckets);
+
+    for (i = 0; i < CTABLE_LOCKS; i++)
+    {
+        stripe = ctable.stripes + i;
+        lock_stripe(i);
+        write_seqcount_begin(&stripe->moving);
+
+        // The buckets of the stripe are every CTABLE_LOCKS-th bucket
+        for (bkt = i; bkt < (1U << old->bits); bkt += CTABLE_LOCKS)
+        {
+            hlist_for_each_entry_safe(conn, temp, old->heads + bkt, hash_node)
+            {
+                hlist_del_rcu(&conn->hash_node);
+                hlist_add_head_rcu(&conn->hash_node, hash2bucket(buckets, conn->hash));
+            }
+        }
+
+        write_seqcount_end(&stripe->moving);
+        unlock_stripe(i);
+        cond_resched();
+    }
+
+    RCU_INIT_POINTER(buckets->old, NULL);
+    ctable.resizes++;
+
+    // Wait for the lookups that may still walk the old buckets
+    synchronize_rcu();
+    kvfree(old);
+}
+
+/**
+ * Restart the idle timeout of a connection, according to its current status
  */
-connection_t *add_blank_connection(void)
+void refresh_connection(connection_t *conn)
 {
+    unsigned int timeout = is_proxy_connection(conn) ? CONN_TIMEOUT_PROXY : conn_timeouts[conn->state.status];
+    WRITE_ONCE(conn->expires, jiffies + timeout * HZ);
+}
 
-    // Allocate connection
-    connection_t *conn = (connection_t *)kmalloc(sizeof(connection_t), GFP_KERNEL);
+/**
+ * Allocate and initialize a connection, which isn't in the table yet
+ */
+static connection_t *alloc_connection(const id_t *internal_id, const id_t *external_id, const tcp_state_t *state,
+                                      connection_type_t type)
+{
+    // We may be on the packet path, so we can't sleep
+    connection_t *conn = (connection_t *)mempool_alloc(ctable.pool, GFP_ATOMIC);
+    if (conn == NULL)
+    {
+        atomic_inc(&ctable.alloc_failures);
+        return NULL;
+    }
 
-    // Add connection to the table
-    list_add_tail(&conn->list_node, &ctable);
-    connections_amount++;
+    conn->internal_id = *internal_id;
+    conn->external_id = *external_id;
+    conn->hash = conn_hash(internal_id, external_id);
+    conn->state = *state;
+    conn->type = type;
+    conn->proxy_port = 1; // Non-proxy connection
+    INIT_HLIST_NODE(&conn->client_node);
+    INIT_HLIST_NODE(&conn->port_node);
+    refresh_connection(conn);
 
     return conn;
 }
 
 /**
- * Add a new connection
+ * Add an initialized connection to the table (call under its lock).
+ * The connection is visible to the lookups from now on.
+ */
+static void insert_connection(connection_t *conn)
+{
+    ctable_buckets_t *buckets = locked_buckets();
+
+    hlist_add_head_rcu(&conn->hash_node, hash2bucket(buckets, conn->hash));
+    COUNT_STAT(conn_inserts);
+
+    // Wake the garbage collector up to grow the table (only the insert that crosses the load does)
+    if (atomic_inc_return(&ctable.amount) == (CTABLE_GROW_LOAD << buckets->bits) + 1 &&
+        buckets->bits < CTABLE_MAX_BITS)
+    {
+        mod_delayed_work(system_wq, &gc_work, 0);
+    }
+}
+
+static connection_t *bucket_lookup(ctable_buckets_t *buckets, __u32 hash, const id_t *int_id, const id_t *ext_id)
+{
+    connection_t *conn;
+
+    hlist_for_each_entry_rcu(conn, hash2bucket(buckets, hash), hash_node)
+    {
+        if (conn->hash == hash && is_id_match(conn->internal_id, *int_id) &&
+            is_id_match(conn->external_id, *ext_id))
+        {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Look a connection up in the buckets, and in the old ones while a resize moves the connections
+ * (call under rcu_read_lock)
+ */
+static connection_t *ctable_lookup(ctable_buckets_t *buckets, __u32 hash, const id_t *int_id, const id_t *ext_id)
+{
+    connection_t *conn = bucket_lookup(buckets, hash, int_id, ext_id);
+    ctable_buckets_t *old;
+
+    if (conn == NULL)
+    {
+        old = rcu_dereference(buckets->old);
+        if (old != NULL)
+        {
+            conn = bucket_lookup(old, hash, int_id, ext_id);
+        }
+    }
+    return conn;
+}
+
+/**
+ * Add a blank connection, identified by (internal_id, external_id)
+ */
+connection_t *add_blank_connection(const id_t *internal_id, const id_t *external_id, const tcp_state_t *state,
+                                   connection_type_t type)
+{
+    connection_t *conn = alloc_connection(internal_id, external_id, state, type);
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+
+    lock_connection(conn);
+    insert_connection(conn);
+    return conn;
+}
+
+/**
+ * Add a new connection.
+ * If another CPU has added it meanwhile (e.g. for a retransmitted SYN), that connection is returned instead.
  */
 connection_t *add_connection(const packet_t *packet)
 {
-    connection_t *conn = add_blank_connection();
+    connection_t *conn, *existing;
+    id_t int_id, ext_id;
+    tcp_state_t state = {PRESYN, DIRECTION_ANY};
 
     // Get ids from the packet
-    get_ids(packet, &conn->internal_id, &conn->external_id);
-
-    // Initialize connection state
-    conn->state.status = PRESYN;
-    conn->state.expected_direction = DIRECTION_ANY;
+    get_ids(packet, &int_id, &ext_id);
+    conn = alloc_connection(&int_id, &ext_id, &state, NONE_PROXY);
+    if (conn == NULL)
+    {
+        return NULL;
+    }
 
-    // Non-proxy connection
-    conn->type = NONE_PROXY;
-    conn->proxy_port = 1;
+    lock_connection(conn);
+    existing = ctable_lookup(locked_buckets(), conn->hash, &int_id, &ext_id);
+    if (existing != NULL)
+    {
+        mempool_free(conn, ctable.pool);
+        return existing;
+    }
 
+    insert_connection(conn);
     return conn;
 }
 
 connection_t *find_connection(packet_t *packet)
 {
     connection_t *conn;
+    ctable_stripe_t *stripe;
     id_t packet_int_id, packet_ext_id;
+    __u32 hash;
+    unsigned int moving;
+
     get_ids(packet, &packet_int_id, &packet_ext_id);
+    hash = conn_hash(&packet_int_id, &packet_ext_id);
+    stripe = hash2stripe(hash);
 
-    list_for_each_entry(conn, &ctable, list_node)
+    do
     {
+        moving = read_seqcount_begin(&stripe->moving);
+        conn = ctable_lookup(get_ctable_buckets(), hash, &packet_int_id, &packet_ext_id);
+        if (conn != NULL)
+        {
+            return conn;
+        }
+    } while (read_seqcount_retry(&stripe->moving, moving));
+
+    return NULL;
+}
+
+/**
+ * Find the connection of a packet, and lock it
+ */
+connection_t *find_locked_connection(packet_t *packet)
+{
+    connection_t *conn;
 
-        if (is_id_match(conn->internal_id, packet_int_id) && is_id_match(conn->external_id, packet_ext_id))
+    while ((conn = find_connection(packet)) != NULL)
+    {
+        lock_connection(conn);
+        if (is_connection_alive(conn))
         {
             return conn;
         }
+
+        // It was removed before we got the lock, look again
+        unlock_connection(conn);
     }
+    COUNT_STAT(conn_misses);
     return NULL;
 }
 
+static void free_connection_rcu(struct rcu_head *head)
+{
+    mempool_free(container_of(head, connection_t, rcu), ctable.pool);
+}
+
+/**
+ * Remove a connection from the table, it's freed once the lookups are done with it
+ */
 void remove_connection(connection_t *connection)
 {
-    list_del(&connection->list_node);
-    connections_amount--;
+    hlist_del_init_rcu(&connection->hash_node);
+    forget_proxy(connection);
+    atomic_dec(&ctable.amount);
+    COUNT_STAT(conn_removals);
+    call_rcu(&connection->rcu, free_connection_rcu);
+}
+
+/**
+ * Remove the expired connections of a bucket (call under its lock).
+ * Returns the amount of connections removed.
+ */
+static __u32 expire_bucket(struct hlist_head *bucket)
+{
+    connection_t *conn;
+    struct hlist_node *temp_node;
+    __u32 removed = 0;
+
+    hlist_for_each_entry_safe(conn, temp_node, bucket, hash_node)
+    {
+        if (time_after(jiffies, READ_ONCE(conn->expires)))
+        {
+            remove_connection(conn);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+/**
+ * The size (in bits) that fits the amount of connections
+ */
+static __u8 ctable_fit_bits(__u8 bits)
+{
+    __u32 amount = atomic_read(&ctable.amount);
+
+    while (amount > (CTABLE_GROW_LOAD << bits) && bits < CTABLE_MAX_BITS)
+    {
+        bits++;
+    }
+    if (amount < (1U << bits) / CTABLE_SHRINK_LOAD && bits > CTABLE_MIN_BITS)
+    {
+        bits--;
+    }
+    return bits;
+}
+
+/**
+ * The garbage collector: scans the next slice of the table for expired connections, then fits the table size
+ */
+static void gc_worker(struct work_struct *work)
+{
+    ctable_buckets_t *buckets = locked_buckets();
+    __u32 size = 1U << buckets->bits;
+    __u32 bkt, slice_end;
+    __u8 bits;
+
+    // The table may have been resized since the last run
+    if (ctable.gc_bucket >= size)
+    {
+        ctable.gc_bucket = 0;
+    }
+
+    slice_end = min(ctable.gc_bucket + size / CONN_GC_SLICES, size);
+    for (bkt = ctable.gc_bucket; bkt < slice_end; bkt++)
+    {
+        lock_stripe(bkt);
+        ctable.expired += expire_bucket(buckets->heads + bkt);
+        unlock_stripe(bkt);
+
+        if ((bkt + 1) % CONN_GC_BATCH == 0)
+        {
+            cond_resched();
+        }
+    }
+    ctable.gc_bucket = slice_end;
+
+    bits = ctable_fit_bits(buckets->bits);
+    if (bits != buckets->bits)
+    {
+        ctable_resize(bits);
+    }
+
+    schedule_delayed_work(&gc_work, CONN_GC_INTERVAL);
 }
 
 void free_connections(void)
 {
+    ctable_buckets_t *buckets;
     connection_t *the_connection;
-    connection_t *temp_connection;
+    struct hlist_node *temp_node;
+    __u32 bkt;
+
+    // Stop the garbage collector first
+    cancel_delayed_work_sync(&gc_work);
 
-    list_for_each_entry_safe(the_connection, temp_connection, &ctable, list_node)
+    buckets = locked_buckets();
+    for (bkt = 0; bkt < (1U << buckets->bits); bkt++)
     {
-        list_del(&the_connection->list_node);
-        kfree(the_connection);
+        hlist_for_each_entry_safe(the_connection, temp_node, buckets->heads + bkt, hash_node)
+        {
+            hlist_del(&the_connection->hash_node);
+            mempool_free(the_connection, ctable.pool);
+        }
     }
+    RCU_INIT_POINTER(ctable.buckets, NULL);
+    kvfree(buckets);
 
-    connections_amount = 0;
+    // Wait for the removed connections to be freed
+    rcu_barrier();
+
+    mempool_destroy(ctable.pool);
+    ctable.pool = NULL;
+    kmem_cache_destroy(ctable.cache);
+    ctable.cache = NULL;
+
+    atomic_set(&ctable.amount, 0);
 }
 
 /**
@@ -284,7 +779,7 @@ public_state_t state2public(tcp_state_t state)
 }
 
 const __u8 CONN_BUF_SIZE = 2 * sizeof(__be32) + 2 * sizeof(__be16) + sizeof(public_state_t);
-const __u8 CAMOUNT_SIZE = sizeof(connections_amount);
+const __u8 CAMOUNT_SIZE = sizeof(__u32);
 
 void conn2buf(const connection_t *conn, char *buf)
 {
@@ -306,17 +801,75 @@ void conn2buf(const connection_t *conn, char *buf)
     VAR2BUF(pub_state);
 }
 
+/**
+ * Copy the connection table to a (sysfs) buffer.
+ * The buffer is a single page, hence we pass only the connections that fit in it.
+ */
 ssize_t ctable2buf(char *buf)
 {
+    ctable_buckets_t *buckets;
     connection_t *conn;
+    char *amount_buf = buf;
+    __u32 amount = 0;
+    __u32 max_amount = (PAGE_SIZE - CAMOUNT_SIZE) / CONN_BUF_SIZE;
+    __u32 bkt;
 
-    VAR2BUF(connections_amount);
+    buf += CAMOUNT_SIZE;
 
-    list_for_each_entry(conn, &ctable, list_node)
+    // A snapshot isn't needed, the connections change all the time anyway
+    rcu_read_lock();
+    for_each_connection(buckets, bkt, conn)
     {
+        if (amount == max_amount)
+        {
+            goto full;
+        }
         conn2buf(conn, buf);
         buf += CONN_BUF_SIZE;
+        amount++;
     }
 
-    return CAMOUNT_SIZE + connections_amount * CONN_BUF_SIZE;
+full:
+    rcu_read_unlock();
+    buf = amount_buf;
+    VAR2BUF(amount);
+
+    return CAMOUNT_SIZE + amount * CONN_BUF_SIZE;
+}
+
+/**
+ * Pass the connection table statistics (ctable_stats_t) to the user
+ */
+ssize_t show_ctable_stats(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    ctable_stats_t stats = {0};
+    ctable_buckets_t *buckets;
+    connection_t *conn;
+    __u32 bkt, chain;
+
+    rcu_read_lock();
+    buckets = get_ctable_buckets();
+
+    stats.buckets = 1U << buckets->bits;
+    stats.connections = atomic_read(&ctable.amount);
+    stats.resizes = READ_ONCE(ctable.resizes);
+    stats.expired = READ_ONCE(ctable.expired);
+    stats.alloc_failures = atomic_read(&ctable.alloc_failures);
+
+    for (bkt = 0; bkt < stats.buckets; bkt++)
+    {
+        chain = 0;
+        hlist_for_each_entry_rcu(conn, buckets->heads + bkt, hash_node)
+        {
+            chain++;
+        }
+
+        stats.max_chain = max(stats.max_chain, chain);
+        stats.chains[min(chain, (__u32)CHAIN_HIST_SIZE - 1)]++;
+    }
+
+    rcu_read_unlock();
+
+    VAR2BUF(stats);
+    return sizeof(stats);
 }
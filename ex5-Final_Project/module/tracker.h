@@ -48,19 +48,80 @@ typedef struct
     connection_type_t type;
     __be16 proxy_port;
 
-    struct list_head list_node;
+    __u32 hash; // Cached bucket hash (see conn_hash), it also picks the lock of the connection
+    struct hlist_node hash_node;
+
+    unsigned long expires; // jiffies, see refresh_connection
+    struct rcu_head rcu;   // a removed connection is freed after a grace period
+
+    // The proxy indexes (see proxy.c), a connection is linked to them once it's a proxy connection
+    struct hlist_node client_node;
+    struct hlist_node port_node;
 } connection_t;
 
+// The buckets of the connection table, replaced as a whole when the table is resized.
+// While a resize moves the connections, the new buckets link to the old ones (which hold the stripes not moved yet).
+typedef struct ctable_buckets
+{
+    __u8 bits;
+    struct ctable_buckets __rcu *old;
+    struct hlist_head heads[];
+} ctable_buckets_t;
+
+// Chain length histogram: lengths 0 .. CHAIN_HIST_SIZE - 2, and the last cell counts anything longer
+#define CHAIN_HIST_SIZE (8)
+
+// Connection table statistics
+typedef struct
+{
+    __u32 buckets;
+    __u32 connections;
+    __u32 resizes;
+    __u32 max_chain;
+    __u32 chains[CHAIN_HIST_SIZE];
+    __u32 expired;        // connections removed by the garbage collector
+    __u32 alloc_failures; // connections that couldn't be allocated
+} ctable_stats_t;
+
 // Auxiliary functions
 direction_t flip_direction(direction_t direction);
 void get_ids(const packet_t *packet, id_t *int_id, id_t *ext_id);
 int is_id_match(const id_t id1, const id_t id2);
 
-// Connection functions
-connection_t *add_blank_connection(void);
-connection_t *add_connection(const packet_t *packet);
-connection_t *find_connection(packet_t *packet);
-void remove_connection(connection_t *connection);
+/*
+ * Locking:
+ * The connections are looked up under rcu_read_lock(), and a removed connection is freed only after a grace period.
+ * A connection is changed (or removed) under its lock, and only while it's still in the table (is_connection_alive).
+ * The locks are striped by the connection hash, so the CPUs contend only on connections that share a stripe.
+ */
+
+// Connection table functions
+int init_connections(void);
+ctable_buckets_t *get_ctable_buckets(void);
+
+/*
+ * Iterate over all the connections in the table (call under rcu_read_lock).
+ * buckets is an auxiliary ctable_buckets_t *, and bkt an auxiliary __u32.
+ * Note: a break statement only leaves the current bucket, and a concurrent resize may hide connections from the walk
+ * (the ones that weren't moved to the new buckets yet).
+ */
+#define for_each_connection(buckets, bkt, conn)                                                                        \
+    for ((buckets) = get_ctable_buckets(), (bkt) = 0; (bkt) < (1U << (buckets)->bits); (bkt)++)                       \
+        hlist_for_each_entry_rcu(conn, (buckets)->heads + (bkt), hash_node)
+
+// Connection locking
+void lock_connection(const connection_t *conn);
+void unlock_connection(const connection_t *conn);
+int is_connection_alive(const connection_t *conn);
+
+// Connection functions. The add functions return the connection locked, or NULL if it can't be allocated.
+void refresh_connection(connection_t *conn);
+connection_t *add_blank_connection(const id_t *internal_id, const id_t *external_id, const tcp_state_t *state,
+                                   connection_type_t type);
+connection_t *add_connection(const packet_t *packet);  // call under rcu_read_lock
+connection_t *find_connection(packet_t *packet);        // call under rcu_read_lock
+connection_t *find_locked_connection(packet_t *packet); // call under rcu_read_lock
+void remove_connection(connection_t *connection);       // call under the connection lock
 void free_connections(void);
 
 // For debug purposes
@@ -87,5 +148,6 @@ typedef enum
 // Define connections device operations
 public_state_t state2public(tcp_state_t state);
 ssize_t ctable2buf(char *buf);
+ssize_t show_ctable_stats(struct device *dev, struct device_attribute *attr, char *buf);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,204 @@
+#include "zone.h"
+
+#include <linux/rtnetlink.h>
+
+// The zone table, by interface names. Changed under RTNL (like the interfaces themselves).
+static zone_entry_t zones[MAX_ZONES];
+static __u32 zones_amount;
+
+// The zones by ifindex, rebuilt whenever the table or the interfaces change, and read by the packets under RCU
+typedef struct
+{
+    struct rcu_head rcu;
+    __u8 zone[ZONE_MAP_SIZE];
+} zone_map_t;
+
+static zone_map_t __rcu *zone_map;
+
+/**
+ * Resolve the zone table to the current interfaces, and publish the new map (call under RTNL)
+ */
+static int refresh_zones(void)
+{
+    zone_map_t *map, *old;
+    struct net_device *dev;
+    __u32 i;
+
+    map = kzalloc(sizeof(zone_map_t), GFP_KERNEL);
+    if (map == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < zones_amount; i++)
+    {
+        zones[i].ifindex = 0;
+        dev = __dev_get_by_name(&init_net, zones[i].name);
+        if (dev == NULL)
+        {
+            continue;
+        }
+        zones[i].ifindex = dev->ifindex;
+        if (dev->ifindex < ZONE_MAP_SIZE)
+        {
+            map->zone[dev->ifindex] = zones[i].zone;
+        }
+        else
+        {
+            INFO("Interface %s has ifindex %d, above %d it can't have a zone", dev->name, dev->ifindex, ZONE_MAP_SIZE - 1)
+        }
+    }
+
+    old = rtnl_dereference(zone_map);
+    rcu_assign_pointer(zone_map, map);
+    if (old != NULL)
+    {
+        kfree_rcu(old, rcu);
+    }
+    return 0;
+}
+
+/**
+ * Keep the map in step with the interfaces: added, removed or renamed ones (called under RTNL)
+ */
+static int zone_netdev_event(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+    struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+
+    if (!net_eq(dev_net(dev), &init_net))
+    {
+        return NOTIFY_DONE;
+    }
+
+    switch (event)
+    {
+    case NETDEV_REGISTER:
+    case NETDEV_UNREGISTER:
+    case NETDEV_CHANGENAME:
+        if (refresh_zones() != 0)
+        {
+            INFO("Failed to refresh the zones of the interfaces")
+        }
+        break;
+    }
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block zone_notifier = {.notifier_call = zone_netdev_event};
+
+static zone_t get_zone(const zone_map_t *map, const struct net_device *dev)
+{
+    if (dev == NULL || dev->ifindex >= ZONE_MAP_SIZE)
+    {
+        return ZONE_NONE;
+    }
+    return map->zone[dev->ifindex];
+}
+
+/**
+ * Returns the direction of the packet by the zones of its interfaces (call under rcu_read_lock)
+ */
+direction_t get_direction(const struct nf_hook_state *state)
+{
+    const zone_map_t *map = rcu_dereference(zone_map);
+    zone_t zone_in = get_zone(map, state->in);
+    zone_t zone_out = get_zone(map, state->out);
+
+    if (zone_out == ZONE_EXTERNAL || zone_in == ZONE_INTERNAL)
+    {
+        return DIRECTION_OUT; // Coming from inside to outside = direction out
+    }
+    if (zone_out == ZONE_INTERNAL || zone_in == ZONE_EXTERNAL)
+    {
+        return DIRECTION_IN; // Coming from outside to inside = direction in
+    }
+    return DIRECTION_NONE;
+}
+
+/**
+ * Initialize the zone table (with the default interfaces), and follow the interfaces
+ */
+int init_zones(void)
+{
+    strscpy(zones[0].name, INT_NET_DEVICE_NAME, IFNAMSIZ);
+    zones[0].zone = ZONE_INTERNAL;
+    strscpy(zones[1].name, EXT_NET_DEVICE_NAME, IFNAMSIZ);
+    zones[1].zone = ZONE_EXTERNAL;
+    zones_amount = 2;
+
+    rtnl_lock();
+    if (refresh_zones() != 0)
+    {
+        rtnl_unlock();
+        return -ENOMEM;
+    }
+    rtnl_unlock();
+
+    // The notifier is replayed with the existing interfaces, so nothing is missed in between
+    if (register_netdevice_notifier(&zone_notifier) != 0)
+    {
+        kfree(rcu_dereference_protected(zone_map, 1));
+        RCU_INIT_POINTER(zone_map, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Free the zone map (no packet can reach it by now)
+ */
+void free_zones(void)
+{
+    unregister_netdevice_notifier(&zone_notifier);
+    kfree(rcu_dereference_protected(zone_map, 1));
+    RCU_INIT_POINTER(zone_map, NULL);
+}
+
+// Implementing zones device operations
+
+ssize_t show_zones(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    __u32 i;
+
+    rtnl_lock();
+    for (i = 0; i < zones_amount; i++)
+    {
+        VAR2BUF(zones[i]);
+    }
+    rtnl_unlock();
+
+    return i * sizeof(zone_entry_t);
+}
+
+/**
+ * Upload a zone table: entries of zone_entry_t, which replace the current table
+ */
+ssize_t store_zones(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    zone_entry_t entries[MAX_ZONES];
+    __u32 amount = count / sizeof(zone_entry_t), i;
+    int ret;
+
+    if (count % sizeof(zone_entry_t) != 0 || amount > MAX_ZONES)
+    {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < amount; i++)
+    {
+        BUF2VAR(entries[i]);
+        entries[i].name[IFNAMSIZ - 1] = '\0';
+        if (entries[i].zone != ZONE_INTERNAL && entries[i].zone != ZONE_EXTERNAL)
+        {
+            return -EINVAL;
+        }
+    }
+
+    rtnl_lock();
+    memcpy(zones, entries, amount * sizeof(zone_entry_t));
+    zones_amount = amount;
+    ret = refresh_zones();
+    rtnl_unlock();
+
+    return ret < 0 ? ret : count;
+}
@@ -0,0 +1,45 @@
+/*
+In this module we map the network interfaces to zones (the internal and external networks).
+*/
+#ifndef _ZONE_H_
+#define _ZONE_H_
+
+#include "fw.h"
+
+#include <linux/netdevice.h>
+
+// The zone table in effect until one is uploaded
+#define INT_NET_DEVICE_NAME "enp0s8"
+#define EXT_NET_DEVICE_NAME "enp0s9"
+
+#define MAX_ZONES (16)
+
+// Interfaces are resolved through an array indexed by ifindex, larger indexes have no zone
+#define ZONE_MAP_SIZE (256)
+
+typedef enum
+{
+    ZONE_NONE,
+    ZONE_INTERNAL,
+    ZONE_EXTERNAL,
+} zone_t;
+
+// An entry of the zone table, as uploaded and shown (fixed layout, shared with the user)
+typedef struct
+{
+    char name[IFNAMSIZ]; // the interface
+    __u32 ifindex;       // 0 while there is no such interface (ignored on upload)
+    __u8 zone;           // values from: zone_t
+} zone_entry_t;
+
+int init_zones(void);
+void free_zones(void);
+
+// The direction of a packet by the zones of its interfaces (call under rcu_read_lock)
+direction_t get_direction(const struct nf_hook_state *state);
+
+// Zones device operations
+ssize_t show_zones(struct device *dev, struct device_attribute *attr, char *buf);
+ssize_t store_zones(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+
+#endif
@@ -0,0 +1,101 @@
+#!/usr/bin/python
+# Benchmark of the blades: MB/s of the pure Python scanning against the native scanner (build it first with make).
+# Usage: python3 bench_scan.py [MB per corpus]
+
+import glob
+import os
+import random
+import re
+import sys
+import time
+
+import dlp
+import ips
+
+try:
+    from _scanner import Scanner
+except ImportError:
+    sys.exit('The native scanner isn\'t built, run make first')
+
+native_commands = ips.commands_scanner  # zookeeper() replaces it for a run
+
+SIZE = int(sys.argv[1]) * 1024 * 1024 if len(sys.argv) > 1 else 16 * 1024 * 1024
+CHUNK = 64 * 1024  # As the proxies receive
+
+
+def corpora():
+    here = os.path.dirname(os.path.abspath(__file__))
+    sources = b''.join(open(path, 'rb').read() for path in glob.glob(os.path.join(here, '..', '*', '*.[ch]')))
+    words = re.findall(rb'[a-z]+', b' '.join(open(path, 'rb').read() for path in glob.glob(os.path.join(here, '*.py'))))
+    random.seed(1)
+    prose = b' '.join(random.choice(words) + random.choice([b'', b'', b'.', b',', b';', b'\n']) for _ in range(SIZE // 5))
+    return [('C code', sources), ('Text', prose), ('Binary', os.urandom(SIZE))]
+
+
+def measure(function, data):
+    """ Returns the MB/s of function over data, fed by chunks """
+
+    view = memoryview(data)
+    start = time.perf_counter()
+    function([view[pos:pos + CHUNK] for pos in range(0, len(view), CHUNK)])
+    return len(data) / (time.perf_counter() - start) / 1024 / 1024
+
+
+def detect(chunks, native):
+    detector = dlp.CCodeDetector()
+    detector.native = native
+    for chunk in chunks:
+        if detector.feed(chunk):
+            break
+    detector.finish()
+
+
+def full_detect(chunks, native):
+    """ Scans the whole corpus (without the early verdict) """
+    detector = dlp.CCodeDetector()
+    detector.native = native
+    for chunk in chunks:
+        detector.feed(chunk)
+        detector.detected = False
+
+
+def keywords_python(chunks):
+    pattern = re.compile(b'|'.join(re.escape(keyword) for keyword in dlp.declarators | dlp.control_keywords))
+    for chunk in chunks:
+        pattern.findall(chunk)
+
+
+def keywords_native(chunks):
+    scanner = Scanner(sorted(dlp.declarators | dlp.control_keywords))
+    for chunk in chunks:
+        scanner.findall(chunk)
+
+
+def zookeeper(chunks, scanner):
+    ips.commands_scanner = scanner
+    try:
+        for chunk in chunks:
+            ips.is_command(chunk)
+    finally:
+        ips.commands_scanner = native_commands
+
+
+def main():
+    benchmarks = [
+        ('DLP detect_c_code', lambda chunks: detect(chunks, False), lambda chunks: detect(chunks, True)),
+        ('DLP full scan', lambda chunks: full_detect(chunks, False), lambda chunks: full_detect(chunks, True)),
+        ('Keyword search', keywords_python, keywords_native),
+        ('IPS commands', lambda chunks: zookeeper(chunks, None),
+         lambda chunks: zookeeper(chunks, native_commands)),
+    ]
+
+    print('{:<20} {:<8} {:>12} {:>12} {:>8}'.format('Benchmark', 'Corpus', 'Python MB/s', 'Native MB/s', 'Speedup'))
+    for corpus, data in corpora():
+        data = (data * (SIZE // len(data) + 1))[:SIZE]
+        for name, python, native in benchmarks:
+            before, after = measure(python, data), measure(native, data)
+            print('{:<20} {:<8} {:>12.1f} {:>12.1f} {:>7.1f}x'.format(name, corpus, before, after, after / before))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,11 +1,22 @@
 # DLP blade for C code detection
 
-declarators = ['char', 'int', 'short', 'float', 'double', 'long', 'auto', 'volatile', 'const', 'unsigned', 'signed',
-               'struct', 'enum', 'union', 'extern', 'register', 'inline', 'static']
+# The blade works on bytes (nothing is decoded), so it's safe for any content
+import re
 
-control_keywords = ['for', 'while', 'do', 'break', 'continue', 'if', 'else', 'switch', 'case', 'goto', 'return']
+declarators = {b'char', b'int', b'short', b'float', b'double', b'long', b'auto', b'volatile', b'const', b'unsigned',
+               b'signed', b'struct', b'enum', b'union', b'extern', b'register', b'inline', b'static'}
 
-comments = ['//', '/*', '/**']
+control_keywords = {b'for', b'while', b'do', b'break', b'continue', b'if', b'else', b'switch', b'case', b'goto', b'return'}
+
+comments = {b'//', b'/*', b'/**'}
+
+# C lines are split by: ; { }
+separators = re.compile(rb'[;{}]')
+
+try:
+    from _scanner import Scanner  # The native scanner (see scanner.c and the Makefile)
+except ImportError:
+    Scanner = None
 
 # Threshold variables
 c_block_size_thresh = 3     # Detect c-blocks of size >= 10
@@ -15,77 +26,175 @@ c_lines_amount_thresh = 100 # Expects at least 200 c-lines in c code
 c_lines_frac_thresh = 0.25  # Expects at least 30% of c-lines from all the lines
 
 def get_text(path):
-    with open(path, 'r') as file:
+    with open(path, 'rb') as file:
         return file.read()
 
-def detect_c_code(text):
-    # Split the text by: ; { } in order to get c lines
-    plain_text = text.replace('\n', '')
-    lines = plain_text.replace('{',';').replace('}',';').split(';')
-    lines = [line.strip() for line in lines]
-
-    variables = []
-
-    # Find lines that likely to be c lines
-    locations = []
-    for i, line in enumerate(lines):
-        words = line.split()
-        if not words or len(words) == 0:
-            continue
-        starter = words[0]
 
-        # Checks if the line is either conrol, declartion, or assignment
+class CCodeDetector(object):
+    """ Detects C code in a stream, in a single pass: it's fed with chunks, and keeps only the line being read
+    (bounded) and the counters. Once the thresholds are crossed the verdict is final, and the rest isn't scanned. """
+
+    max_line = 256        # Only the start of a line is classified
+    max_variables = 1024  # The declared variables that are remembered
+    rebuild_ratio = 32    # Bytes fed line by line per pattern byte before the native scanner is rebuilt (see update_scanner)
+    native = Scanner is not None
+    keywords_scanner = Scanner(sorted(declarators | control_keywords | comments)) if native else None
+
+    def __init__(self):
+        self.pending = b''      # The start of the line that isn't complete yet
+        self.variables = set()
+        self.lines = 0          # All the lines (empty ones too)
+        self.c_lines = 0        # Lines that are likely to be c lines
+        self.streak = 0         # Consecutive c lines
+        self.blocks = 0         # Streaks of at least c_block_size_thresh c lines
+        self.detected = False
+        self.scanner = self.keywords_scanner
+        self.scanned_variables = 0  # The variables the scanner knows
+        self.stale_bytes = 0        # Fed line by line since the scanner stopped knowing all the variables
+
+    def feed(self, data):
+        """ Scans a chunk (any bytes-like object), returns True once C code was detected """
+
+        if self.detected:
+            return True
+        if self.native and self.update_scanner():
+            return self.feed_scanned_lines(data)
+        self.stale_bytes += len(data)
+        return self.feed_lines(data)
+
+    def update_scanner(self):
+        """ Lets the native scanner know the declared variables, returns False if it doesn't know them yet (the data is
+        fed line by line meanwhile). A rebuild makes the whole automaton again, so it waits until rebuild_ratio bytes per
+        pattern byte were fed line by line: the rebuilds stay a small part of that work, even when every chunk declares
+        a variable. """
+
+        if self.scanned_variables != len(self.variables):
+            patterns = declarators | control_keywords | comments | self.variables
+            if self.stale_bytes < self.rebuild_ratio * sum(len(pattern) for pattern in patterns):
+                return False
+            try:
+                self.scanner = Scanner(sorted(patterns))
+            except ValueError:
+                self.native = False  # Too many patterns
+                return False
+            self.scanned_variables = len(self.variables)
+            self.stale_bytes = 0
+        return True
+
+    def feed_lines(self, data):
+        lines = separators.split(data)
+        last = lines.pop()
+        if lines:
+            lines[0] = self.pending + lines[0][:self.max_line]
+            for line in lines:
+                self.add_line(line[:self.max_line])
+                if self.detected:
+                    return True
+            self.pending = last[:self.max_line]
+        else:
+            self.pending = (self.pending + last)[:self.max_line]
+        return False
 
-        is_control = starter in control_keywords
+    def feed_scanned_lines(self, data):
+        """ Feeds data through the native scanner, which finds the lines that start with a keyword or a variable.
+        The other lines can't be c lines, so they are only counted. """
+
+        count, first_end, last_start, matches = self.scanner.lines(data, b';{}', True)
+        if not count:
+            self.pending = (self.pending + bytes(data[:self.max_line]))[:self.max_line]
+            return False
+
+        # The first line continues the pending one
+        self.add_line((self.pending + bytes(data[:min(first_end, self.max_line)]))[:self.max_line])
+        self.pending = b''
+        number = 1              # The next line to count
+        resume = first_end + 1  # Where it starts
+
+        for line_number, start, end, _ in matches:
+            if self.detected or self.scanned_variables != len(self.variables):
+                break
+            if line_number == 0 or line_number == count:
+                continue
+            if line_number > number:
+                self.skip_lines(line_number - number)
+            self.add_line(bytes(data[start:min(end, start + self.max_line)]))
+            number = line_number + 1
+            resume = end + 1
+
+        if self.detected:
+            return True
+        if self.scanned_variables != len(self.variables):
+            # A variable was declared: the scanner doesn't know it yet, so the rest is fed line by line
+            self.stale_bytes += len(data) - resume
+            return self.feed_lines(data[resume:])
+
+        if count > number:
+            self.skip_lines(count - number)
+        self.pending = bytes(data[last_start:last_start + self.max_line])
+        return False
 
-        is_declaration = starter in declarators
+    def skip_lines(self, amount):
+        """ Counts lines that aren't c lines """
+        self.lines += amount
+        self.streak = 0
+
+    def finish(self):
+        """ Returns the verdict on the whole stream: True for c code, False if not, None if there is no c line """
+
+        if not self.detected:
+            self.add_line(self.pending)
+            self.pending = b''
+        if self.detected:
+            return True
+
+        if not self.c_lines:
+            return None
+        if self.c_lines < c_lines_min_thresh:
+            return False
+        return self.c_lines / self.lines >= c_lines_frac_thresh
+
+    def add_line(self, line):
+        self.lines += 1
+        if self.is_c_line(line.split()):
+            self.c_lines += 1
+            self.streak += 1
+            if self.streak == c_block_size_thresh:
+                self.blocks += 1
+        else:
+            self.streak = 0
 
-        is_comment = starter in comments
+        # The counters only grow, so crossing these thresholds is final (the fraction is known only at the end)
+        self.detected = self.c_lines >= c_lines_min_thresh and \
+                        (self.blocks >= c_blocks_amount_thresh or self.c_lines >= c_lines_amount_thresh)
+
+    def is_c_line(self, words):
+        """ Checks if the line is either control, declaration, comment or assignment """
+
+        if not words:
+            return False
+        starter = words[0]
 
         # If there is declaration than we find the variable (the word follows the declarators) and remember it
-        if is_declaration:
-            # Finds the first word that not in declarators
-            for word in words:
+        if starter in declarators:
+            for word in words[1:]:
                 if word not in declarators:
-                    variables.append(word)
+                    var = word.lstrip(b'*').split(b'=')[0].split(b'[')[0]
+                    if var and len(self.variables) < self.max_variables:
+                        self.variables.add(var)
+                    break
+            return True
 
-        # Check if line is of the form: var = ...
-        var = starter.replace('->', '.').split('.')[0]
-        is_assignment = (var[0] in variables) and len(words) > 2 and (words[1] == '=')
-
-        if is_control or is_declaration or is_comment or is_assignment:
-            locations.append(i)
-
-    # Find c blocks
-    if not locations:
-        return None
-
-    blocks = []
-    block = locations[0]
-    prev = locations[0]
-    size = 1
-    for loc in locations[1:]:
-        if prev + 1 == loc:
-            # The streak continues
-            size += 1
-        else:
-            # end of streak
-            if (size >= c_block_size_thresh):
-                # add the block
-                blocks.append(block)
+        if starter in control_keywords or starter in comments:
+            return True
 
-            block = loc
-            size = 1
+        # Check if line is of the form: var = ...
+        var = starter.replace(b'->', b'.').split(b'.')[0]
+        return var in self.variables and len(words) > 2 and words[1] == b'='
 
-        prev = loc
 
-    # Collect data
-    c_blocks_amount = len(blocks)
-    c_lines_amount = len(locations)
-    c_lines_frac = len(locations) / len(lines)
+def detect_c_code(text):
+    """ Detects C code in a whole text (any bytes-like object), see CCodeDetector """
 
-    # Return answer
-    if (c_lines_amount < c_lines_min_thresh):
-        return False
-    return (c_blocks_amount >= c_blocks_amount_thresh) or (c_lines_amount >= c_lines_amount_thresh)\
-           or (c_lines_frac >= c_lines_frac_thresh)
+    detector = CCodeDetector()
+    detector.feed(text)
+    return detector.finish()
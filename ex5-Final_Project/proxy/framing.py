@@ -0,0 +1,326 @@
+# Protocol framing for the proxies: incremental parsers that cut a byte stream into messages.
+# The parsers are binary safe (only HTTP headers are decoded), and pass memoryview slices to their handler.
+# A slice is valid only during the handler call - copy what should be kept.
+
+from collections import deque
+
+# Events passed to the handlers, with the slice they cover.
+# Concatenating the slices of all the events (in order) gives back the exact stream.
+HEADER = 0   # An HTTP header (start line and fields, up to the empty line)
+BODY = 1     # Payload of an HTTP body
+FRAMING = 2  # Bytes of an HTTP body that aren't payload (chunk sizes, chunk ends, trailers)
+END = 3      # The end of an HTTP message (empty slice)
+LINE = 4     # A line (including its CRLF)
+MESSAGE = 5  # An SMTP mail (the DATA content, including the terminating dot line)
+
+
+class FramingError(ValueError):
+    """ The stream isn't a valid stream of the protocol """
+    pass
+
+
+class Framer(object):
+    """ Base of the framers: keeps the part of the stream that can't be framed yet """
+
+    def __init__(self, handler):
+        self.handler = handler
+        self.buf = bytearray()
+        self.data = None  # The stream being parsed (the buffer, or the fed data itself)
+
+    def feed(self, data):
+        """ Frames data, and keeps what remains for the next feed """
+
+        # Parse the fed data in place, unless there's a remainder to complete
+        if self.buf:
+            self.buf += data
+            self.data = self.buf
+        else:
+            self.data = data
+
+        view = memoryview(self.data)
+        try:
+            pos = self.parse(view)
+            if self.data is not self.buf:
+                self.buf += view[pos:]
+        finally:
+            view.release()
+            parsed, self.data = self.data, None
+
+        if parsed is self.buf:
+            del self.buf[:pos]
+
+    def emit(self, event, view, start, end):
+        piece = view[start:end]
+        try:
+            self.handler(event, piece)
+        finally:
+            piece.release()
+
+    def parse(self, view):
+        """ Emits the events of view, returns the position up to which it was consumed """
+        raise NotImplementedError
+
+
+class LineFramer(Framer):
+    """ Frames CRLF terminated lines """
+
+    max_line = 64 * 1024
+
+    def parse(self, view):
+        return self.parse_lines(view, 0)
+
+    def parse_lines(self, view, pos):
+        """ Emits the complete lines from pos on, returns the position after the last one """
+
+        while True:
+            end = self.data.find(b'\r\n', pos)
+            if end < 0:
+                if len(view) - pos > self.max_line:
+                    raise FramingError('line too long')
+                return pos
+            self.emit(LINE, view, pos, end + 2)
+            if self.is_last_line(view, pos, end):
+                return end + 2
+            pos = end + 2
+
+    def is_last_line(self, view, start, end):
+        """ Tells if the line ends the lines (something else follows it) """
+        return False
+
+
+class SMTPFramer(LineFramer):
+    """ Frames the client side of SMTP: command lines, and the mail that follows an accepted DATA command.
+    The server side is framed by feed_reply(): the mail starts only once the server answers DATA with 354, so the
+    commands of a client whose DATA was refused (e.g. RSET, QUIT) stay commands. """
+
+    max_message = 8 * 1024 * 1024  # A mail is held until it was inspected (0 for no limit)
+    terminator = b'\r\n.\r\n'
+
+    def __init__(self, handler, max_message=None):
+        super(SMTPFramer, self).__init__(handler)
+        if max_message is not None:
+            self.max_message = max_message
+        self.in_data = False
+        self.data_sent = False  # DATA was sent and its reply hasn't come yet, the client data waits for it
+        self.scanned = 0  # The terminator isn't in the mail before this offset (of the mail)
+        self.expected = deque([False])  # The replies the server owes in order, True for DATA (the greeting is first)
+        self.data_replied = False
+        self.reply_framer = LineFramer(self.frame_reply)
+
+    def is_last_line(self, view, start, end):
+        self.data_sent = bytes(view[start:end]).strip().upper() == b'DATA'
+        self.expected.append(self.data_sent)
+        return self.data_sent
+
+    def frame_reply(self, event, piece):
+        # The lines of a multiline reply are "250-...", its last line is "250 ..."
+        if piece[3:4] == b'-' or not self.expected:
+            return
+        if self.expected.popleft():
+            self.data_sent = False
+            self.in_data = piece[:3] == b'354'
+            self.data_replied = True
+
+    def feed_reply(self, data):
+        """ Frames data of the server side. Returns True if DATA was answered, then the client data held since should
+        be framed (by feed(b'')). """
+
+        self.data_replied = False
+        self.reply_framer.feed(data)
+        return self.data_replied
+
+    def parse(self, view):
+        pos = 0
+        while pos < len(view):
+            if self.data_sent:
+                # A client waits for the reply to DATA, so it shouldn't send much meanwhile
+                if len(view) - pos > self.max_line:
+                    raise FramingError('no reply to DATA')
+                return pos
+
+            if not self.in_data:
+                pos = self.parse_lines(view, pos)
+                if not self.data_sent:
+                    return pos
+                continue
+
+            # The mail ends with a line that holds a single dot (an empty mail is just that line)
+            if self.data.startswith(b'.\r\n', pos):
+                end = pos + 3
+            else:
+                found = self.data.find(self.terminator, pos + max(self.scanned - len(self.terminator), 0))
+                if found < 0:
+                    if self.max_message and len(view) - pos > self.max_message:
+                        raise FramingError('mail too long')
+                    self.scanned = len(view) - pos
+                    return pos
+                end = found + len(self.terminator)
+
+            self.emit(MESSAGE, view, pos, end)
+            self.in_data = False
+            self.scanned = 0
+            self.expected.append(False)  # The server answers the mail
+            pos = end
+        return pos
+
+
+class HTTPFramer(Framer):
+    """ Frames HTTP/1.x messages: the header, then the body by Content-Length or by the chunked transfer coding.
+    A response that has neither takes the rest of the stream. """
+
+    max_header = 64 * 1024
+    max_chunk_line = 1024
+    unbounded = 1 << 62  # A body that takes the rest of the stream
+
+    # States
+    IN_HEADER, IN_LENGTH, IN_CHUNK_SIZE, IN_CHUNK, IN_CHUNK_END, IN_TRAILER, IN_REST = range(7)
+
+    def __init__(self, handler, is_response=False, request_methods=None):
+        super(HTTPFramer, self).__init__(handler)
+        self.is_response = is_response
+        self.request_methods = request_methods  # Shared by both framers: the methods of the unanswered requests
+        self.state = self.IN_HEADER
+        self.remaining = 0
+        self.scanned = 0  # The header end isn't in the buffer before this offset
+        self.start_line = ''
+        self.headers = {}  # Of the current message: lower case field name -> value
+        self.is_final = True  # False for an informational (1xx) response, another response follows it
+
+    def parse_header(self, view):
+        lines = bytes(view).decode('latin-1').split('\r\n')
+        self.start_line = lines[0]
+        self.headers = {}
+        for line in lines[1:]:
+            name, sep, value = line.partition(':')
+            if sep:
+                name = name.strip().lower()
+                value = value.strip()
+                # Repeated fields are combined, as the RFC allows
+                self.headers[name] = self.headers[name] + ', ' + value if name in self.headers else value
+
+    def body_state(self):
+        """ The state the body of the current message starts in (None if it has no body) """
+
+        if self.is_response:
+            parts = self.start_line.split(None, 2)
+            try:
+                status = int(parts[1])
+            except (IndexError, ValueError):
+                raise FramingError('bad status line')
+            self.is_final = status >= 200
+            if not self.is_final:
+                return None  # Informational, the final response is still to come
+            method = self.request_methods.popleft() if self.request_methods else ''
+            if method == 'HEAD' or status in (204, 304):
+                return None
+        elif self.request_methods is not None:
+            self.request_methods.append(self.start_line.split(' ', 1)[0])
+
+        if 'chunked' in self.headers.get('transfer-encoding', '').lower():
+            return self.IN_CHUNK_SIZE
+        if 'content-length' in self.headers:
+            try:
+                self.remaining = int(self.headers['content-length'])
+            except ValueError:
+                raise FramingError('bad content length')
+            if self.remaining < 0:
+                raise FramingError('bad content length')
+            return self.IN_LENGTH if self.remaining else None
+        return self.IN_REST if self.is_response else None
+
+    def passthrough(self):
+        """ Returns the amount of the next data that is plain body (0 if none), which may be passed on without being
+        framed (see skip) """
+
+        if self.buf:
+            return 0
+        if self.state == self.IN_LENGTH:
+            return self.remaining
+        if self.state == self.IN_REST:
+            return self.unbounded
+        return 0
+
+    def skip(self, amount):
+        """ Accounts for amount bytes of plain body that were passed on without being framed (no BODY events) """
+
+        if self.state == self.IN_LENGTH:
+            self.remaining -= amount
+            if self.remaining == 0:
+                self.state = self.IN_HEADER
+                self.emit(END, memoryview(b''), 0, 0)
+
+    def find_line(self, view, pos, limit):
+        end = self.data.find(b'\r\n', pos)
+        if end < 0 and len(view) - pos > limit:
+            raise FramingError('line too long')
+        return end
+
+    def parse(self, view):
+        pos = 0
+        while pos < len(view):
+            if self.state == self.IN_HEADER:
+                end = self.data.find(b'\r\n\r\n', pos + max(self.scanned - 3, 0))
+                if end < 0:
+                    if len(view) - pos > self.max_header:
+                        raise FramingError('header too long')
+                    self.scanned = len(view) - pos
+                    return pos
+                end += 4
+                self.scanned = 0
+                self.parse_header(view[pos:end])
+                state = self.body_state()
+                self.emit(HEADER, view, pos, end)
+                pos = end
+                if state is None:
+                    self.emit(END, view, pos, pos)
+                else:
+                    self.state = state
+
+            elif self.state in (self.IN_LENGTH, self.IN_CHUNK):
+                end = min(pos + self.remaining, len(view))
+                self.emit(BODY, view, pos, end)
+                self.remaining -= end - pos
+                pos = end
+                if self.remaining == 0:
+                    if self.state == self.IN_CHUNK:
+                        self.state = self.IN_CHUNK_END
+                    else:
+                        self.state = self.IN_HEADER
+                        self.emit(END, view, pos, pos)
+
+            elif self.state == self.IN_CHUNK_SIZE:
+                end = self.find_line(view, pos, self.max_chunk_line)
+                if end < 0:
+                    return pos
+                try:
+                    self.remaining = int(bytes(view[pos:end]).split(b';', 1)[0], 16)
+                except ValueError:
+                    raise FramingError('bad chunk size')
+                self.emit(FRAMING, view, pos, end + 2)
+                pos = end + 2
+                self.state = self.IN_CHUNK if self.remaining else self.IN_TRAILER
+
+            elif self.state == self.IN_CHUNK_END:
+                if len(view) - pos < 2:
+                    return pos
+                if view[pos:pos + 2] != b'\r\n':
+                    raise FramingError('bad chunk end')
+                self.emit(FRAMING, view, pos, pos + 2)
+                pos += 2
+                self.state = self.IN_CHUNK_SIZE
+
+            elif self.state == self.IN_TRAILER:
+                end = self.find_line(view, pos, self.max_header)
+                if end < 0:
+                    return pos
+                self.emit(FRAMING, view, pos, end + 2)
+                if end == pos:
+                    # The empty line ends the trailer, and the message
+                    self.state = self.IN_HEADER
+                    self.emit(END, view, end + 2, end + 2)
+                pos = end + 2
+
+            else:  # IN_REST
+                self.emit(BODY, view, pos, len(view))
+                pos = len(view)
+        return pos
@@ -1,6 +1,7 @@
 #!/usr/bin/python
 
 from proxy import Proxy
+from framing import LineFramer, FramingError
 import socket
 import sys
 import re
@@ -13,6 +14,11 @@ class FTPProxy(Proxy):
 
     ftp_dev = '/sys/class/fw/proxy/add_ftp'
 
+    def __init__(self, loop, conn, adrr):
+        super(FTPProxy, self).__init__(loop, conn, adrr)
+        self.command_framer = LineFramer(self.frame_command)
+        self.passed = bytearray()  # What the current data passes on
+
     def pass_ftp_data(self, ftp_ip, ftp_port):
         """ Sends to the firewall client (ip, port) of the new ftp data session """
         
@@ -39,49 +45,27 @@ class FTPProxy(Proxy):
             port = 256 * int(p1) + int(p2)
             self.pass_ftp_data(ip, port)
 
-    def client_logic(self):
-        while self.is_alive() and not self.done:
-            request = self.collect_message(self.client_sock)
-            if request:
-                self.server_sock.sendall(request.encode())
-                self.extract_port_command(request)
-            else:
-                self.done = True
+    def frame_command(self, event, piece):
+        # The data connection is registered before the server gets the PORT command
+        try:
+            self.extract_port_command(bytes(piece).decode('latin-1'))
+        except ValueError:
+            pass  # A malformed PORT command, the server will refuse it
+        self.passed += piece
 
-    def server_logic(self):
-        while self.is_alive() and not self.done:
-            response = self.collect_message(self.server_sock)
-            if response:
-                self.client_sock.sendall(response.encode())
-            else:
-                self.done = True
+    def client_data(self, data):
+        self.passed = bytearray()
+        try:
+            self.command_framer.feed(data)
+        except FramingError as e:
+            print('FTP: {}'.format(e))
+            self.reject(b'500 Command line too long\r\n')
+        return self.passed
 
 
 def main():
-    # Creating an HTTP proxy server
-    sock = FTPProxy.setup_proxy(SERVER_PORT)
-    proxies = []
-    
-    print("\nStarting")
-
-    # Handle connections until ctrl^c is called
-    while True:
-        try:
-            conn, addr = sock.accept()
-        except KeyboardInterrupt:
-            for proxy in proxies:
-                proxy.done = True
-            for proxy in proxies:
-                proxy.join()
-            break
-        
-        print("\nConnection accepted")
-        
-        proxy = FTPProxy(conn, addr)
-        proxies.append(proxy)
-        proxy.start()
-
-    print("\nFinished")
+    # Running an FTP proxy server
+    FTPProxy.serve(SERVER_PORT)
 
 
 if __name__ == "__main__":
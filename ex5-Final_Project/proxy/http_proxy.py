@@ -1,77 +1,174 @@
 #!/usr/bin/python
+# Usage: python3 http_proxy.py [max request MB (0 for no limit)]
+
+import sys
 
 from proxy import Proxy
-from dlp import detect_c_code
-import socket
-import re
+from dlp import CCodeDetector
+from framing import HTTPFramer, FramingError, HEADER, BODY, END
+from collections import deque
 
 SERVER_PORT = 800
 
 
 class HTTPProxy(Proxy):
-    """ Represents HTTP proxy connection """
-
-    def enforce_content(self, message):
-        
-        # Extract header
-        separator = '\r\n\r\n'  # indicates end of HTTP header
-        header_loc = message.index(separator)
-        header = message[0:header_loc]
-
-        # Check if should block
-        content_type = re.findall('Content-Type: (\S+)', header)
-        print('Content type: {}'.format(content_type)) # debug
-        
-        return False if content_type and (content_type[0] in ['text/csv', 'application/zip']) else True
-
-    def client_logic(self):
-        while self.is_alive() and not self.done:
-            request = self.collect_message(self.client_sock)
-            if request:
-                if detect_c_code(request):
-                    print("C code was detected")
-                else:
-                    self.server_sock.sendall(request.encode())
-            else:
-                self.done = True
-
-    def server_logic(self):
-        while self.is_alive() and not self.done:
-            response = self.collect_message(self.server_sock)
-            if response:
-                if self.enforce_content(response):
-                    self.client_sock.sendall(response.encode())
-                else:
-                    print("HTTP packet dropped")
+    """ Represents HTTP proxy connection: the requests and responses are inspected one by one, so a persistent
+    connection (and pipelined requests on it) outlives a blocked request or response """
+
+    blocked_types = ['text/csv', 'application/zip']
+    forbidden = b'HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n'  # Answers a single request
+    bad_request = b'HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n'
+    continue_response = b'HTTP/1.1 100 Continue\r\n\r\n'
+    max_request = 8 * 1024 * 1024  # A request is held until its body was inspected (0 for no limit)
+
+    def __init__(self, loop, conn, adrr):
+        super(HTTPProxy, self).__init__(loop, conn, adrr)
+        self.request_methods = deque()
+        self.request_framer = HTTPFramer(self.frame_request, request_methods=self.request_methods)
+        self.response_framer = HTTPFramer(self.frame_response, is_response=True, request_methods=self.request_methods)
+        self.request = bytearray()  # The request being held
+        self.detector = CCodeDetector()  # The DLP blade, fed with the payload of the request as it arrives
+        self.request_rejected = False    # The rest of the current request is dropped
+        self.response_blocked = False    # The rest of the current response is dropped
+        self.continue_pending = False    # The held request waits for a 100 Continue, after the responses before it
+        # The unanswered requests in order: True if passed to the server, False if rejected (and answered with a 403
+        # in its turn, after the responses to the requests before it)
+        self.answers = deque()
+        self.passed = bytearray()   # What the current data passes on
+
+    def enforce_content(self, headers):
+        """ Tells if a response may pass, by its header fields """
+
+        content_type = headers.get('content-type', '').split(';')[0].strip().lower()
+        return content_type not in self.blocked_types
+
+    def continue_request(self, header):
+        """ The server sees a request only once its body was inspected, so it can't answer an Expect: 100-continue in
+        time: the field is removed, and the proxy answers it (returns the header to forward) """
+
+        headers = self.request_framer.headers
+        has_body = 'chunked' in headers.get('transfer-encoding', '').lower() or \
+            headers.get('content-length', '0') != '0'
+        if '100-continue' not in headers.get('expect', '').lower() or not has_body:
+            return header
+
+        if self.answers:
+            self.continue_pending = True
+        else:
+            self.client.send(self.continue_response)
+        lines = bytes(header).split(b'\r\n')
+        return b'\r\n'.join(line for line in lines if not line.lower().startswith(b'expect:'))
+
+    def frame_request(self, event, piece):
+        if self.server.aborted:
+            return  # The connection was rejected, the rest of the requests is dropped
+
+        if self.request_rejected:
+            if event == END:
+                self.request_rejected = False
+                self.forbid_request()
+            return
+
+        if event == END:
+            detected = self.detector.finish()
+            self.detector = CCodeDetector()
+            if not detected:
+                self.passed += self.request
+                self.request.clear()
+                self.answers.append(True)
+                return
+        elif event == BODY:
+            detected = self.detector.feed(piece)
+        elif event == HEADER:
+            piece = self.continue_request(piece)
+            detected = False
+        else:
+            detected = False
+
+        if detected:
+            print("C code was detected")
+            self.request.clear()
+            self.request_methods.pop()  # The request never reaches the server, so no response of it will come
+            if event == END:
+                self.forbid_request()
             else:
-                self.done = True
+                self.request_rejected = True
+                self.detector = CCodeDetector()
+            return
 
+        self.request += piece
+        if self.max_request and len(self.request) > self.max_request:
+            raise FramingError('request too long')
 
-def main():
-    # Creating an HTTP proxy server
-    sock = HTTPProxy.setup_proxy(SERVER_PORT)
-    proxies = []
-    
-    print("\nStarting")
-
-    # Handle connections until ctrl^c is called
-    while True:
+    def forbid_request(self):
+        """ Answers a rejected request with a 403, once the requests before it were answered """
+
+        if self.answers:
+            self.answers.append(False)
+        else:
+            self.client.send(self.forbidden)
+
+    def frame_response(self, event, piece):
+        if event == HEADER:
+            self.response_blocked = not self.enforce_content(self.response_framer.headers)
+            if self.response_blocked:
+                print("HTTP response blocked")
+                self.passed += self.forbidden  # In place of the response
+                return
+
+        # The response streams on once its header was allowed
+        if not self.response_blocked:
+            self.passed += piece
+
+        if event == END and self.response_framer.is_final:
+            self.response_blocked = False
+            if self.answers:
+                self.answers.popleft()
+            while self.answers and not self.answers[0]:
+                self.answers.popleft()
+                self.passed += self.forbidden
+            if self.continue_pending and not self.answers:
+                self.continue_pending = False
+                self.passed += self.continue_response
+
+    def passthrough(self, endpoint):
+        # The body of an allowed response isn't inspected, so it's spliced to the client (requests are inspected)
+        if endpoint is self.server and not self.response_blocked:
+            return self.response_framer.passthrough()
+        return 0
+
+    def passed_through(self, endpoint, amount):
+        # The end of the response may answer rejected requests
+        self.passed = bytearray()
+        self.response_framer.skip(amount)
+        if self.passed:
+            self.client.send(self.passed)
+
+    def client_data(self, data):
+        self.passed = bytearray()
+        try:
+            self.request_framer.feed(data)
+        except FramingError as e:
+            print('HTTP: {}'.format(e))
+            self.reject(self.bad_request)
+        return self.passed
+
+    def server_data(self, data):
+        self.passed = bytearray()
         try:
-            conn, addr = sock.accept()
-        except KeyboardInterrupt:
-            for proxy in proxies:
-                proxy.done = True
-            for proxy in proxies:
-                proxy.join()
-            break
-        
-        print("\nConnection accepted")
-        
-        proxy = HTTPProxy(conn, addr)
-        proxies.append(proxy)
-        proxy.start()
-
-    print("\nFinished")
+            self.response_framer.feed(data)
+        except FramingError as e:
+            print('HTTP: {}'.format(e))
+            self.close()
+            return b''
+        return self.passed
+
+
+def main():
+    # Running an HTTP proxy server
+    if len(sys.argv) > 1:
+        HTTPProxy.max_request = int(sys.argv[1]) * 1024 * 1024
+    HTTPProxy.serve(SERVER_PORT)
 
 
 if __name__ == "__main__":
@@ -1,28 +1,35 @@
 # IPS blade against Apache ZooKeeper Information Disclosure
 
-commands = ['conf', 'cons', 'crst', 'envi', 'ruok', 'srst', 'srvr', 'stat', 'wchs', 'dirs', 'wchp', 'mntr']
+commands = [b'conf', b'cons', b'crst', b'envi', b'ruok', b'srst', b'srvr', b'stat', b'wchs', b'dirs', b'wchp', b'mntr']
 
 whitelist_mode = False
 
+try:
+    from _scanner import Scanner  # The native scanner (see scanner.c and the Makefile)
+    commands_scanner = Scanner(commands)
+except ImportError:
+    commands_scanner = None
+
+
+def is_command(message):
+    """ Checks if the first word of message is a four-letter command """
+
+    if commands_scanner is not None:
+        return bool(commands_scanner.lines(message, b'')[3])
+    words = bytes(message).split(None, 1)
+    return bool(words) and words[0] in commands
+
+
 def block_zookeeper_command(message):
-    splited = text.split()
+    """ Returns True if message (any bytes-like object) may pass """
 
-    if (len(splited) != 1):
+    if len(bytes(message).split()) != 1:
         # Invalid structure. blocks the message
         return False
 
-    command = splited[0]
-
     if whitelist_mode:
         # Whitelist protection
-        if command in commands:
-            return True
-        else:
-            return False
-
+        return is_command(message)
     else:
         # Blacklist protection
-        if command in commands:
-            return False
-        else:
-            return True
+        return not is_command(message)
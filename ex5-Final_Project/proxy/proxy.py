@@ -1,119 +1,387 @@
-import threading
+import errno
+import selectors
+import signal
 import socket
 import struct
-import sys
-import subprocess
+import fcntl
 import os
 
 
-class Proxy(threading.Thread):
-    """Represents a proxy connection"""
+class EventLoop(object):
+    """ A single threaded event loop: calls the handler of each socket that is ready (epoll on Linux) """
+
+    def __init__(self):
+        self.selector = selectors.DefaultSelector()
+
+    def watch(self, sock, events, handler):
+        """ Calls handler(events) whenever sock is ready for events (no events stops watching it) """
+
+        key = self.selector.get_map().get(sock)
+        if key is None:
+            if events:
+                self.selector.register(sock, events, handler)
+        elif not events:
+            self.selector.unregister(sock)
+        elif key.events != events or key.data != handler:
+            self.selector.modify(sock, events, handler)
+
+    def run(self):
+        while True:
+            for key, events in self.selector.select():
+                key.data(events)
+
+
+class Endpoint(object):
+    """ One side of a proxy connection: a non-blocking socket, and the data waiting to be sent on it.
+    Data the proxy passes on as is may be spliced from the peer into a pipe, and from the pipe to the socket, without
+    being copied to user space. The piped data always precedes the data in out. """
+
+    chunk_size = 64 * 1024   # The most we receive at once (and the capacity of a pipe)
+    max_buffer = 256 * 1024  # Backpressure: the peer isn't read while that much data waits to be sent here
+    can_splice = hasattr(os, 'splice')  # Linux, Python 3.10+
+
+    def __init__(self, proxy, sock, connected=True):
+        self.proxy = proxy
+        self.sock = sock
+        self.peer = None
+        self.out = bytearray()
+        self.pipe = None  # (read fd, write fd), created on the first splice to this side
+        self.piped = 0    # The amount of data in the pipe
+        self.connected = connected  # False while a connect is in progress
+        self.read_open = True       # Until the other end closes its side
+        self.write_open = True      # Until we close our side (see end)
+        self.end_pending = False
+        self.aborted = False
+        sock.setblocking(False)
+
+    def events(self):
+        if self.aborted:
+            return 0
+        if not self.connected:
+            return selectors.EVENT_WRITE
+        events = 0
+        if self.read_open and len(self.peer.out) + self.peer.piped < self.max_buffer:
+            events |= selectors.EVENT_READ
+        if self.out or self.piped or self.end_pending:
+            events |= selectors.EVENT_WRITE
+        return events
+
+    def update(self):
+        if not self.aborted:
+            self.proxy.loop.watch(self.sock, self.events(), self.ready)
+
+    def ready(self, events):
+        if self.aborted or self.proxy.closed:
+            return  # An event of the same select round, that came after this side was closed
+        try:
+            if not self.connected:
+                self.finish_connect()
+            else:
+                if events & selectors.EVENT_WRITE:
+                    self.flush()
+                if events & selectors.EVENT_READ:
+                    self.receive()
+        except OSError as e:
+            print('Proxy: {}'.format(e))
+            self.proxy.close()
+            return
+        self.proxy.update()
+
+    def finish_connect(self):
+        error = self.sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR)
+        if error:
+            raise OSError(error, os.strerror(error))
+        self.connected = True
+        self.flush()
+
+    def receive(self):
+        if self.can_splice and not self.peer.out and self.peer.piped < self.chunk_size:
+            amount = self.proxy.passthrough(self)
+            if amount:
+                self.splice(min(amount, self.chunk_size - self.peer.piped))
+                return
+
+        try:
+            data = self.sock.recv(self.chunk_size)
+        except BlockingIOError:
+            return
+        if data:
+            self.proxy.received(self, data)
+        else:
+            self.read_open = False
+            self.peer.end()
+
+    def splice(self, amount):
+        """ Moves up to amount bytes from the socket into the pipe of the peer """
+
+        peer = self.peer
+        if peer.pipe is None:
+            peer.pipe = os.pipe2(os.O_NONBLOCK | os.O_CLOEXEC)
+        try:
+            moved = os.splice(self.sock.fileno(), peer.pipe[1], amount, flags=os.SPLICE_F_MOVE | os.SPLICE_F_NONBLOCK)
+        except BlockingIOError:
+            return
+        if not moved:
+            self.read_open = False
+            peer.end()
+            return
+        peer.piped += moved
+        self.proxy.passed_through(self, moved)
+        if peer.connected:
+            peer.flush()
+
+    def send(self, data):
+        """ Queues data to be sent, and sends what the socket takes right away """
+
+        if self.aborted:
+            return
+        self.out += data
+        if self.connected:
+            self.flush()
+
+    def flush(self):
+        if self.piped:
+            try:
+                self.piped -= os.splice(self.pipe[0], self.sock.fileno(), self.piped,
+                                        flags=os.SPLICE_F_MOVE | os.SPLICE_F_NONBLOCK)
+            except BlockingIOError:
+                return
+            if self.piped:
+                return
+        if self.out:
+            try:
+                sent = self.sock.send(self.out)
+            except BlockingIOError:
+                return
+            del self.out[:sent]
+        if not self.out and self.end_pending:
+            # Everything was sent, pass the end on
+            self.end_pending = False
+            self.write_open = False
+            self.sock.shutdown(socket.SHUT_WR)
+
+    def end(self):
+        """ Closes our side, once the data waiting to be sent is out """
+
+        self.end_pending = True
+        if self.connected:
+            self.flush()
+
+    def is_finished(self):
+        return not self.read_open and not self.write_open
+
+    def abort(self):
+        """ Cuts this side off: its socket is closed, and whatever is sent to it is discarded """
+
+        self.close()
+        self.aborted = True
+        self.read_open = False
+        self.write_open = False
+        self.out.clear()
+        self.piped = 0
+
+    def close(self):
+        if not self.aborted:
+            self.proxy.loop.watch(self.sock, 0, None)
+            self.sock.close()
+            if self.pipe is not None:
+                os.close(self.pipe[0])
+                os.close(self.pipe[1])
+
+
+class Proxy(object):
+    """ Represents a proxy connection: relays the data between the client and the server through the direction
+    callbacks (client_data, server_data), which the protocol proxies override """
 
     internal_network = '10.1.1.3'  # enp0s8 interface
     external_network = '10.1.2.3'  # enp0s9 interface
 
-    proxy_dev = '/sys/class/fw/proxy/set_port'
+    proxy_ioctl_dev = '/dev/proxy'
+    proxy_fd = None  # Shared by the proxy connections of a worker, opened on first use
+
+    # proxy_dest_t and PROXY_IOC_GET_DEST = _IOWR('f', 1, proxy_dest_t) of module/proxy.h
+    dest_format = '=4s4sHH'
+    get_dest_ioctl = (3 << 30) | (struct.calcsize(dest_format) << 16) | (ord('f') << 8) | 1
 
-    user_handler = '../user/main'
-    conn_arg = 'show_conns'
+    # proxy_port_t and PROXY_IOC_SET_PORT = _IOW('f', 2, proxy_port_t)
+    port_format = '=4sHH'
+    set_port_ioctl = (1 << 30) | (struct.calcsize(port_format) << 16) | (ord('f') << 8) | 2
 
-    def __init__(self, conn, adrr):
-        super(Proxy, self).__init__()
-        self.client_sock = conn  # The client_end communicates with the client (and imitates the server functionality)
-        self.server_sock = None  # The server_end communicates with the server (and imitates the client functionality)
+    def __init__(self, loop, conn, adrr):
+        self.loop = loop
+        self.client = Endpoint(self, conn)  # Communicates with the client (and imitates the server functionality)
+        self.server = None  # Communicates with the server (and imitates the client functionality)
         self.src = adrr
         self.dst = None
-        self.done = False
-        self.client_thread = None
-        self.server_thread = None
+        self.closed = False
+
+    @classmethod
+    def get_proxy_fd(cls):
+        if Proxy.proxy_fd is None:
+            Proxy.proxy_fd = os.open(cls.proxy_ioctl_dev, os.O_RDONLY)
+        return Proxy.proxy_fd
 
     def send_port(self, proxy_port):
         """ Sends to the firewall client's proxy port """
         
         print('Proxy: port = {}'.format(proxy_port))
 
-        client_ip = socket.inet_aton(self.src[0])
-        client_port = self.src[1]
-        
-        # endianness byte order considerations
-        pack = struct.pack('<HH', client_port, proxy_port) if sys.byteorder == 'little' else struct.pack('>HH', client_port, proxy_port)
-        buf = client_ip + pack
-
-        with open(self.proxy_dev, 'wb') as file:
-            file.write(buf)
+        # A single ioctl (ports in host byte order), which fails if the firewall doesn't know the client
+        port = struct.pack(self.port_format, socket.inet_aton(self.src[0]), self.src[1], proxy_port)
+        fcntl.ioctl(self.get_proxy_fd(), self.set_port_ioctl, port)
 
     def get_dest(self):
         """ Gets the destination of the connection from the firewall (the actual server details) """
-        
-        dir_path = os.path.dirname(os.path.abspath(__file__))
-        user_path = dir_path + '/' + self.user_handler
-        print('User path: {}'.format(user_path))
-        
-        p = subprocess.run([user_path, self.conn_arg], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
-                           text=True)
-        connections = p.stdout.splitlines()[1:]
+
+        # A single ioctl: the firewall looks the client up, and fills in the server
+        dest = bytearray(struct.pack(self.dest_format, socket.inet_aton(self.src[0]), bytes(4), self.src[1], 0))
+        fcntl.ioctl(self.get_proxy_fd(), self.get_dest_ioctl, dest)
+        _, server_ip, _, server_port = struct.unpack(self.dest_format, dest)
+
+        self.dst = (socket.inet_ntoa(server_ip), server_port)
         print('src: ', self.src)
-        for connection in connections:
-            c_ip, s_ip, c_port, s_port, status = connection.split()
-            if c_ip == self.src[0] and int(c_port) == self.src[1]:
-                self.dst = (s_ip, int(s_port))
         print('dst: ', self.dst)
 
     def start_proxy(self):
         # Creating a TCP client
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server = Endpoint(self, sock, connected=False)
+        self.server.peer = self.client
+        self.client.peer = self.server
         sock.bind((self.external_network, 0))
-        self.server_sock = sock
 
         # Send the dynamically allocated port to the firewall
         srv_addr = sock.getsockname()
         self.send_port(srv_addr[1])
 
-        # Connect to the actual server
+        # Connect to the actual server (the client data is kept meanwhile)
         self.get_dest()
-        sock.connect(self.dst)
-        
-    def collect_message(self, sock):
-        ''' Collects the message from a socket'''
-        
-        message = ''
-        chunk_size = 512
-        
-        while True:
-            chunk = sock.recv(chunk_size)
-            message += chunk.decode()
-            if len(chunk) < chunk_size:
-                break
-            
-        return message
-
-    def client_logic(self):
-        pass
+        error = sock.connect_ex(self.dst)
+        if error not in (0, errno.EINPROGRESS):
+            raise OSError(error, os.strerror(error))
+        self.update()
+
+    def client_data(self, data):
+        """ Called with the data received from the client, returns the data to pass to the server """
+        return data
 
-    def server_logic(self):
+    def server_data(self, data):
+        """ Called with the data received from the server, returns the data to pass to the client """
+        return data
+
+    def passthrough(self, endpoint):
+        """ Returns the amount of the next data of endpoint that the callbacks may skip: it's passed on as is
+        (spliced, without being copied to user space). The protocol proxies override it. """
+        return 0
+
+    def passed_through(self, endpoint, amount):
+        """ Called when amount bytes of endpoint were passed on by passthrough """
         pass
 
-    def run(self):
-        # Starts the proxy connection
-        self.start_proxy()
-        # Creates threads for handling two sides
-        self.client_thread = threading.Thread(target=self.client_logic)
-        self.server_thread = threading.Thread(target=self.server_logic)
-        # Starts the threads
-        self.client_thread.start()
-        self.server_thread.start()
-        # Join the threads when done
-        self.client_thread.join()
-        self.server_thread.join()
-        # Release resources
-        self.client_sock.close()
-        self.server_sock.close()
+    def reject(self, reply):
+        """ Answers the client on behalf of the server, and ends the connection (the server is cut off) """
+
+        self.server.abort()
+        self.client.read_open = False
+        self.client.send(reply)
+        self.client.end()
+
+    def received(self, endpoint, data):
+        if endpoint is self.client:
+            data = self.client_data(data)
+        else:
+            data = self.server_data(data)
+        if data:
+            endpoint.peer.send(data)
+
+    def update(self):
+        """ Watches each side for what it's waiting on, and releases the connection when both sides are done """
+
+        if self.closed:
+            return
+        if self.client.is_finished() and self.server.is_finished():
+            self.close()
+            return
+        self.client.update()
+        self.server.update()
+
+    def close(self):
+        if self.closed:
+            return
+        self.closed = True
+        self.client.close()
+        if self.server is not None:
+            self.server.close()
 
     @classmethod
     def setup_proxy(cls, proxy_port):
         """ Setup a proxy server """
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)  # Creating a TCP socket
         sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)  # Enabling reuse the socket without time limitation
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)  # The workers share the port (the kernel balances)
         sock.bind((cls.internal_network, proxy_port))
-        sock.listen(10)
+        sock.listen(socket.SOMAXCONN)
+        sock.setblocking(False)
         return sock
+
+    @classmethod
+    def serve(cls, proxy_port, workers=None):
+        """ Runs a proxy server until ctrl^c: worker processes (one per CPU by default) listen on the port, and each
+        handles its connections by a single event loop """
+
+        workers = workers or os.cpu_count() or 1
+        children = []
+        for _ in range(workers - 1):
+            pid = os.fork()
+            if pid == 0:
+                status = 1
+                try:
+                    cls.run_worker(proxy_port)
+                    status = 0
+                finally:
+                    os._exit(status)
+            children.append(pid)
+
+        print("\nStarting {} workers".format(workers))
+        try:
+            cls.run_worker(proxy_port)
+        finally:
+            for pid in children:
+                try:
+                    os.kill(pid, signal.SIGINT)
+                except ProcessLookupError:
+                    pass
+                os.waitpid(pid, 0)
+        print("\nFinished")
+
+    @classmethod
+    def run_worker(cls, proxy_port):
+        """ Runs the event loop of a worker, until ctrl^c """
+
+        loop = EventLoop()
+        sock = cls.setup_proxy(proxy_port)
+
+        def accept(events):
+            try:
+                conn, addr = sock.accept()
+            except BlockingIOError:
+                return
+            except OSError as e:
+                print('Proxy: {}'.format(e))  # e.g. out of file descriptors, the client waits in the backlog
+                return
+
+            print("\nConnection accepted")
+
+            proxy = cls(loop, conn, addr)
+            try:
+                proxy.start_proxy()
+            except OSError as e:
+                print('Proxy: {}'.format(e))
+                proxy.close()
+
+        loop.watch(sock, selectors.EVENT_READ, accept)
+
+        try:
+            loop.run()
+        except KeyboardInterrupt:
+            pass
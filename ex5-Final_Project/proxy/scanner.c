@@ -0,0 +1,527 @@
+/*
+Native multi-pattern scanner for the proxy blades (see dlp.py and ips.py).
+The patterns are compiled into an Aho-Corasick automaton (a full transition table), and the bytes that can't start
+a pattern are skipped by a SIMD filter while the automaton is at its root.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#define MAX_STATES (8192) // The states are kept in uint16_t, and each one takes 512 bytes
+#define ROOT (0)
+#define NO_PATTERN (-1)
+
+/*
+ * Byte set filter: finds the next byte of a set.
+ * With SSSE3 it tests 16 bytes at once by their nibbles (the shufti technique): the low nibble table holds a bit
+ * per high nibble class (mod 8), so a candidate is exact up to the high nibbles h and h ^ 8, and is confirmed by the
+ * bitmap.
+ */
+typedef struct
+{
+    uint8_t member[256];
+    uint8_t low[16];
+    uint8_t high[16];
+    int empty;
+} byteset_t;
+
+typedef struct
+{
+    PyObject_HEAD
+    uint16_t (*delta)[256]; // delta[state][byte]: the next state (the failure links are already followed)
+    uint16_t *depth;        // The length of the prefix a state stands for
+    int32_t *output;        // The pattern that ends at a state, or NO_PATTERN
+    uint16_t *next_output;  // The next state on the failure chain that has an output (ROOT if none)
+    Py_ssize_t *lengths;    // Of the patterns
+    Py_ssize_t patterns;
+    int states;
+    byteset_t first; // The first bytes of the patterns
+} Scanner;
+
+static void byteset_init(byteset_t *set, const uint8_t *bytes, Py_ssize_t n)
+{
+    Py_ssize_t i;
+
+    memset(set, 0, sizeof(*set));
+    set->empty = 1;
+    for (i = 0; i < n; i++)
+    {
+        set->member[bytes[i]] = 1;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        if (set->member[i])
+        {
+            set->low[i & 0xf] |= 1 << ((i >> 4) & 0x7);
+            set->empty = 0;
+        }
+    }
+    for (i = 0; i < 16; i++)
+    {
+        set->high[i] = 1 << (i & 0x7);
+    }
+}
+
+/**
+ * Returns the position of the first byte of the set in data[pos, len), or len
+ */
+static Py_ssize_t byteset_find(const byteset_t *set, const uint8_t *data, Py_ssize_t pos, Py_ssize_t len)
+{
+    if (set->empty)
+    {
+        return len;
+    }
+
+#ifdef __SSSE3__
+    {
+        const __m128i low = _mm_loadu_si128((const __m128i *)set->low);
+        const __m128i high = _mm_loadu_si128((const __m128i *)set->high);
+        const __m128i nibble = _mm_set1_epi8(0xf);
+        const __m128i zero = _mm_setzero_si128();
+
+        while (pos + 16 <= len)
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(data + pos));
+            __m128i lo = _mm_shuffle_epi8(low, _mm_and_si128(chunk, nibble));
+            __m128i hi = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble));
+            unsigned int candidates = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), zero)) & 0xffff;
+
+            while (candidates)
+            {
+                int i = __builtin_ctz(candidates);
+                if (set->member[data[pos + i]])
+                {
+                    return pos + i;
+                }
+                candidates &= candidates - 1;
+            }
+            pos += 16;
+        }
+    }
+#endif
+
+    for (; pos < len; pos++)
+    {
+        if (set->member[data[pos]])
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+static int is_space(uint8_t c)
+{
+    // As bytes.split() sees it
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/**
+ * Builds the automaton: the trie of the patterns, then the transitions of the failure links (in BFS order)
+ */
+static int build_automaton(Scanner *self, PyObject *patterns)
+{
+    Py_ssize_t total = 1, i, j;
+    uint16_t *fail = NULL, *queue = NULL;
+    int head = 0, tail = 0, state, c;
+    uint8_t firsts[256];
+    Py_ssize_t firsts_amount = 0;
+
+    for (i = 0; i < self->patterns; i++)
+    {
+        total += PyBytes_GET_SIZE(PyList_GET_ITEM(patterns, i));
+    }
+    if (total > MAX_STATES)
+    {
+        PyErr_SetString(PyExc_ValueError, "too many patterns");
+        return -1;
+    }
+
+    self->delta = PyMem_Calloc(total, sizeof(*self->delta));
+    self->depth = PyMem_Calloc(total, sizeof(*self->depth));
+    self->output = PyMem_Malloc(total * sizeof(*self->output));
+    self->next_output = PyMem_Calloc(total, sizeof(*self->next_output));
+    self->lengths = PyMem_Malloc(self->patterns * sizeof(*self->lengths) + 1);
+    fail = PyMem_Calloc(total, sizeof(*fail));
+    queue = PyMem_Malloc(total * sizeof(*queue));
+    if (!self->delta || !self->depth || !self->output || !self->next_output || !self->lengths || !fail || !queue)
+    {
+        PyMem_Free(fail);
+        PyMem_Free(queue);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < total; i++)
+    {
+        self->output[i] = NO_PATTERN;
+    }
+
+    // The trie (a missing edge is 0, the root can't be a child)
+    self->states = 1;
+    for (i = 0; i < self->patterns; i++)
+    {
+        PyObject *pattern = PyList_GET_ITEM(patterns, i);
+        const uint8_t *bytes = (const uint8_t *)PyBytes_AS_STRING(pattern);
+
+        self->lengths[i] = PyBytes_GET_SIZE(pattern);
+        state = ROOT;
+        for (j = 0; j < self->lengths[i]; j++)
+        {
+            if (!self->delta[state][bytes[j]])
+            {
+                self->depth[self->states] = self->depth[state] + 1;
+                self->delta[state][bytes[j]] = self->states++;
+            }
+            state = self->delta[state][bytes[j]];
+        }
+        if (self->output[state] == NO_PATTERN)
+        {
+            self->output[state] = i; // The first of duplicate patterns
+        }
+    }
+
+    // The failure links: a missing edge continues from the failure state, which was already completed
+    for (c = 0; c < 256; c++)
+    {
+        if (self->delta[ROOT][c])
+        {
+            queue[tail++] = self->delta[ROOT][c];
+            firsts[firsts_amount++] = c;
+        }
+    }
+    while (head < tail)
+    {
+        state = queue[head++];
+        self->next_output[state] = self->output[fail[state]] != NO_PATTERN ? fail[state] : self->next_output[fail[state]];
+        for (c = 0; c < 256; c++)
+        {
+            uint16_t child = self->delta[state][c];
+            if (child && self->depth[child] == self->depth[state] + 1)
+            {
+                fail[child] = self->delta[fail[state]][c];
+                queue[tail++] = child;
+            }
+            else
+            {
+                self->delta[state][c] = self->delta[fail[state]][c];
+            }
+        }
+    }
+
+    byteset_init(&self->first, firsts, firsts_amount);
+
+    PyMem_Free(fail);
+    PyMem_Free(queue);
+    return 0;
+}
+
+static int Scanner_init(Scanner *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"patterns", NULL};
+    PyObject *iterable, *patterns;
+    Py_ssize_t i;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &iterable))
+    {
+        return -1;
+    }
+    if (self->delta)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Scanner is already initialized");
+        return -1;
+    }
+
+    patterns = PySequence_List(iterable);
+    if (!patterns)
+    {
+        return -1;
+    }
+    self->patterns = PyList_GET_SIZE(patterns);
+    for (i = 0; i < self->patterns; i++)
+    {
+        PyObject *pattern = PyList_GET_ITEM(patterns, i);
+        if (!PyBytes_Check(pattern) || !PyBytes_GET_SIZE(pattern))
+        {
+            PyErr_SetString(PyExc_TypeError, "patterns must be non empty bytes");
+            Py_DECREF(patterns);
+            return -1;
+        }
+    }
+
+    ret = build_automaton(self, patterns);
+    Py_DECREF(patterns);
+    return ret;
+}
+
+static void Scanner_dealloc(Scanner *self)
+{
+    PyMem_Free(self->delta);
+    PyMem_Free(self->depth);
+    PyMem_Free(self->output);
+    PyMem_Free(self->next_output);
+    PyMem_Free(self->lengths);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/**
+ * Runs the automaton from pos, until a pattern ends. Returns the position after it (and its state), or -1.
+ */
+static Py_ssize_t run_automaton(const Scanner *self, const uint8_t *data, Py_ssize_t pos, Py_ssize_t len,
+                                uint16_t *state)
+{
+    uint16_t current = *state;
+
+    while (pos < len)
+    {
+        if (current == ROOT)
+        {
+            pos = byteset_find(&self->first, data, pos, len);
+            if (pos == len)
+            {
+                break;
+            }
+        }
+        current = self->delta[current][data[pos++]];
+        if (self->output[current] != NO_PATTERN || self->next_output[current] != ROOT)
+        {
+            *state = current;
+            return pos;
+        }
+    }
+    *state = current;
+    return -1;
+}
+
+static int ready(const Scanner *self)
+{
+    if (!self->delta)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Scanner isn't initialized");
+        return 0;
+    }
+    return 1;
+}
+
+PyDoc_STRVAR(search_doc, "search(data, start=0) -> (start, end, index) of the first pattern that ends in data, or None");
+
+static PyObject *Scanner_search(Scanner *self, PyObject *args)
+{
+    Py_buffer view;
+    Py_ssize_t start = 0, end;
+    uint16_t state = ROOT;
+    int32_t index;
+
+    if (!ready(self) || !PyArg_ParseTuple(args, "y*|n", &view, &start))
+    {
+        return NULL;
+    }
+    start = start < 0 ? 0 : start;
+
+    Py_BEGIN_ALLOW_THREADS
+    end = start < view.len ? run_automaton(self, view.buf, start, view.len, &state) : -1;
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+
+    if (end < 0)
+    {
+        Py_RETURN_NONE;
+    }
+    index = self->output[state] != NO_PATTERN ? self->output[state] : self->output[self->next_output[state]];
+    return Py_BuildValue("nni", end - self->lengths[index], end, index);
+}
+
+PyDoc_STRVAR(findall_doc, "findall(data) -> list of (start, index) of all the patterns in data (overlapping ones too)");
+
+static PyObject *Scanner_findall(Scanner *self, PyObject *args)
+{
+    Py_buffer view;
+    Py_ssize_t pos = 0;
+    uint16_t state = ROOT, match;
+    PyObject *matches, *item;
+
+    if (!ready(self) || !PyArg_ParseTuple(args, "y*", &view))
+    {
+        return NULL;
+    }
+    matches = PyList_New(0);
+    if (!matches)
+    {
+        goto release;
+    }
+
+    while ((pos = run_automaton(self, view.buf, pos, view.len, &state)) >= 0)
+    {
+        for (match = self->output[state] != NO_PATTERN ? state : self->next_output[state]; match != ROOT;
+             match = self->next_output[match])
+        {
+            int32_t index = self->output[match];
+            item = Py_BuildValue("(ni)", pos - self->lengths[index], index);
+            if (!item || PyList_Append(matches, item) < 0)
+            {
+                Py_XDECREF(item);
+                Py_CLEAR(matches);
+                goto release;
+            }
+            Py_DECREF(item);
+        }
+    }
+
+release:
+    PyBuffer_Release(&view);
+    return matches;
+}
+
+/**
+ * Returns the pattern that is the whole first word at pos (after spaces), or the longest one it starts with if
+ * prefix is set. NO_PATTERN if there is none. The word ends at a space, a separator or the end of data.
+ */
+static int32_t first_word_pattern(const Scanner *self, const byteset_t *separators, const uint8_t *data,
+                                  Py_ssize_t pos, Py_ssize_t len, int prefix)
+{
+    uint16_t state = ROOT, next;
+    int32_t found = NO_PATTERN;
+
+    while (pos < len && is_space(data[pos]))
+    {
+        pos++;
+    }
+    for (; pos < len && !is_space(data[pos]) && !separators->member[data[pos]]; pos++)
+    {
+        // Only trie edges (that go one level deeper) continue the word
+        next = self->delta[state][data[pos]];
+        if (self->depth[next] != self->depth[state] + 1)
+        {
+            return prefix ? found : NO_PATTERN;
+        }
+        state = next;
+        if (self->output[state] != NO_PATTERN)
+        {
+            found = self->output[state];
+        }
+    }
+    return prefix ? found : self->output[state];
+}
+
+PyDoc_STRVAR(lines_doc,
+             "lines(data, separators, prefix=False) -> (count, first_end, last_start, matches)\n"
+             "Splits data into lines by the separator bytes, and finds the lines whose first word is a pattern\n"
+             "(or starts with one, if prefix is set).\n"
+             "count is the number of separators, first_end the position of the first one (-1 if none), last_start\n"
+             "the position after the last one (0 if none), and matches a list of (number, start, end, index) of\n"
+             "each such line (the line number, and the span of the line without its separator).");
+
+static PyObject *Scanner_lines(Scanner *self, PyObject *args)
+{
+    Py_buffer view, separators_view;
+    byteset_t separators;
+    const uint8_t *data;
+    Py_ssize_t pos = 0, start, count = 0, first_end = -1, last_start = 0;
+    int32_t index;
+    int prefix = 0;
+    PyObject *matches = NULL, *item, *ret = NULL;
+
+    if (!ready(self) || !PyArg_ParseTuple(args, "y*y*|p", &view, &separators_view, &prefix))
+    {
+        return NULL;
+    }
+    byteset_init(&separators, separators_view.buf, separators_view.len);
+    PyBuffer_Release(&separators_view);
+
+    data = view.buf;
+    matches = PyList_New(0);
+    if (!matches)
+    {
+        goto release;
+    }
+
+    while (pos <= view.len)
+    {
+        start = pos;
+        pos = byteset_find(&separators, data, pos, view.len);
+
+        index = first_word_pattern(self, &separators, data, start, pos, prefix);
+        if (index != NO_PATTERN)
+        {
+            item = Py_BuildValue("(nnni)", count, start, pos, index);
+            if (!item || PyList_Append(matches, item) < 0)
+            {
+                Py_XDECREF(item);
+                goto release;
+            }
+            Py_DECREF(item);
+        }
+
+        if (pos == view.len)
+        {
+            break;
+        }
+        if (first_end < 0)
+        {
+            first_end = pos;
+        }
+        count++;
+        last_start = ++pos;
+    }
+
+    ret = Py_BuildValue("(nnnO)", count, first_end, last_start, matches);
+
+release:
+    Py_XDECREF(matches);
+    PyBuffer_Release(&view);
+    return ret;
+}
+
+static PyMethodDef Scanner_methods[] = {
+    {"search", (PyCFunction)Scanner_search, METH_VARARGS, search_doc},
+    {"findall", (PyCFunction)Scanner_findall, METH_VARARGS, findall_doc},
+    {"lines", (PyCFunction)Scanner_lines, METH_VARARGS, lines_doc},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyTypeObject ScannerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_scanner.Scanner",
+    .tp_doc = "Scanner(patterns): finds any of the patterns (non empty bytes) in bytes-like objects",
+    .tp_basicsize = sizeof(Scanner),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Scanner_init,
+    .tp_dealloc = (destructor)Scanner_dealloc,
+    .tp_methods = Scanner_methods,
+};
+
+static struct PyModuleDef scanner_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_scanner",
+    .m_doc = "Multi-pattern scanner (Aho-Corasick with a SIMD first byte filter) for the proxy blades",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__scanner(void)
+{
+    PyObject *module;
+
+    if (PyType_Ready(&ScannerType) < 0)
+    {
+        return NULL;
+    }
+    module = PyModule_Create(&scanner_module);
+    if (!module)
+    {
+        return NULL;
+    }
+    Py_INCREF(&ScannerType);
+    if (PyModule_AddObject(module, "Scanner", (PyObject *)&ScannerType) < 0)
+    {
+        Py_DECREF(&ScannerType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -1,9 +1,11 @@
 #!/usr/bin/python
+# Usage: python3 smtp_proxy.py [max mail MB (0 for no limit)]
+
+import sys
 
 from proxy import Proxy
 from dlp import detect_c_code
-import socket
-import re
+from framing import SMTPFramer, FramingError, MESSAGE
 
 SERVER_PORT = 250
 
@@ -11,54 +13,52 @@ SERVER_PORT = 250
 class SMTPProxy(Proxy):
     """ Represents SMTP proxy connection """
 
-    def client_logic(self):
-        while self.is_alive() and not self.done:
-            request = self.collect_message(self.client_sock)
-            if request:
-                if detect_c_code(request):
-                    print("C code was detected")
-                else:
-                    self.server_sock.sendall(request.encode())
-            else:
-                self.done = True
+    rejected = b'550 5.7.1 Message rejected\r\n'
+    max_message = SMTPFramer.max_message  # A mail is held until it was inspected
 
-    def server_logic(self):
-        while self.is_alive() and not self.done:
-            response = self.collect_message(self.server_sock)
-            if response:
-                if detect_c_code(response):
-                    print("C code was detected")
-                else:
-                    self.client_sock.sendall(response.encode())
-            else:
-                self.done = True
+    def __init__(self, loop, conn, adrr):
+        super(SMTPProxy, self).__init__(loop, conn, adrr)
+        self.mail_framer = SMTPFramer(self.frame_mail, self.max_message)
+        self.passed = bytearray()  # What the current data passes on
 
+    def frame_mail(self, event, piece):
+        # Commands pass as they are, a mail only if the DLP blade finds no C code in it
+        if event == MESSAGE and detect_c_code(piece):
+            print("C code was detected")
+            self.reject(self.rejected)
+            return
+        self.passed += piece
 
-def main():
-    # Creating an SMTP proxy server
-    sock = SMTPProxy.setup_proxy(SERVER_PORT)
-    proxies = []
-    
-    print("\nStarting")
+    def client_data(self, data):
+        self.passed = bytearray()
+        try:
+            self.mail_framer.feed(data)
+        except FramingError as e:
+            print('SMTP: {}'.format(e))
+            self.reject(self.rejected)
+        return self.passed
 
-    # Handle connections until ctrl^c is called
-    while True:
+    def server_data(self, data):
+        # The replies tell when a mail starts: the client data held until DATA is answered is framed then
+        self.passed = bytearray()
         try:
-            conn, addr = sock.accept()
-        except KeyboardInterrupt:
-            for proxy in proxies:
-                proxy.done = True
-            for proxy in proxies:
-                proxy.join()
-            break
-        
-        print("\nConnection accepted")
-        
-        proxy = SMTProxy(conn, addr)
-        proxies.append(proxy)
-        proxy.start()
+            if self.mail_framer.feed_reply(data):
+                self.mail_framer.feed(b'')
+        except FramingError as e:
+            print('SMTP: {}'.format(e))
+            self.reject(self.rejected)
+        if self.server.aborted:
+            return b''
+        if self.passed:
+            self.server.send(self.passed)
+        return data
 
-    print("\nFinished")
+
+def main():
+    # Running an SMTP proxy server
+    if len(sys.argv) > 1:
+        SMTPProxy.max_message = int(sys.argv[1]) * 1024 * 1024
+    SMTPProxy.serve(SERVER_PORT)
 
 
 if __name__ == "__main__":
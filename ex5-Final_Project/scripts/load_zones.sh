@@ -0,0 +1 @@
+../user/main load_zones ../examples/zones.txt
\ No newline at end of file
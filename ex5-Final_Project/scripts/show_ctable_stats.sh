@@ -0,0 +1 @@
+../user/main show_ctable_stats
\ No newline at end of file
@@ -0,0 +1 @@
+../user/main show_hits
\ No newline at end of file
@@ -0,0 +1 @@
+../user/main show_latency
\ No newline at end of file
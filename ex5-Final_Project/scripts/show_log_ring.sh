@@ -0,0 +1 @@
+../user/main show_log_ring
\ No newline at end of file
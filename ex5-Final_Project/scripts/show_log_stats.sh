@@ -0,0 +1 @@
+../user/main show_log_stats
\ No newline at end of file
@@ -0,0 +1 @@
+../user/main show_tree_stats
\ No newline at end of file
@@ -0,0 +1 @@
+../user/main show_zones
\ No newline at end of file
@@ -0,0 +1,85 @@
+#!/bin/bash
+# Stress the firewall from many CPUs at once: iperf3 clients in an "internal" namespace reach servers in an
+# "external" namespace through the firewall, over veth pairs named like the firewall's interfaces.
+# Each client is pinned to its own CPU, so the packet path (veth delivers on the sending CPU) runs on all of them.
+# Usage: sudo ./stress_veth.sh [seconds] (the module should be loaded, see routine.sh)
+
+DURATION=${1:-10}
+CPUS=$(nproc)
+BASE_PORT=5201
+RULES=$(mktemp)
+
+INT_DEV=enp0s8
+EXT_DEV=enp0s9
+
+if ip link show $INT_DEV > /dev/null 2>&1 || ip link show $EXT_DEV > /dev/null 2>&1
+then
+    echo "$INT_DEV or $EXT_DEV already exist, run on a machine without them"
+    exit 1
+fi
+
+cleanup()
+{
+    ip netns del fw_int 2> /dev/null
+    ip netns del fw_ext 2> /dev/null
+    rm -f $RULES
+}
+trap cleanup EXIT
+
+# Internal side: client 10.1.1.1 <-> firewall 10.1.1.3
+ip netns add fw_int
+ip link add $INT_DEV numtxqueues $CPUS numrxqueues $CPUS type veth peer name int0 \
+    numtxqueues $CPUS numrxqueues $CPUS netns fw_int
+ip addr add 10.1.1.3/24 dev $INT_DEV
+ip link set $INT_DEV up
+ip -n fw_int addr add 10.1.1.1/24 dev int0
+ip -n fw_int link set int0 up
+ip -n fw_int link set lo up
+ip -n fw_int route add default via 10.1.1.3
+
+# External side: server 10.1.2.2 <-> firewall 10.1.2.3
+ip netns add fw_ext
+ip link add $EXT_DEV numtxqueues $CPUS numrxqueues $CPUS type veth peer name ext0 \
+    numtxqueues $CPUS numrxqueues $CPUS netns fw_ext
+ip addr add 10.1.2.3/24 dev $EXT_DEV
+ip link set $EXT_DEV up
+ip -n fw_ext addr add 10.1.2.2/24 dev ext0
+ip -n fw_ext link set ext0 up
+ip -n fw_ext link set lo up
+ip -n fw_ext route add default via 10.1.2.3
+
+echo 1 > /proc/sys/net/ipv4/ip_forward
+
+# Let the clients open connections to the servers (the replies pass by the connection table)
+cat > $RULES << EOF
+stress_out out 10.1.1.1/32 10.1.2.2/32 TCP >1023 any any accept
+stress_in in 10.1.2.2/32 10.1.1.1/32 TCP any >1023 any accept
+EOF
+../user/main load_rules $RULES || exit 1
+
+for CLIENTS in 1 2 4 8 16
+do
+    if [ $CLIENTS -gt $CPUS ]
+    then
+        break
+    fi
+
+    for i in $(seq 0 $((CLIENTS - 1)))
+    do
+        ip netns exec fw_ext iperf3 -s -1 -D -p $((BASE_PORT + i))
+    done
+    sleep 1
+
+    for i in $(seq 0 $((CLIENTS - 1)))
+    do
+        taskset -c $i ip netns exec fw_int iperf3 -c 10.1.2.2 -p $((BASE_PORT + i)) -t $DURATION -f m &
+    done > /tmp/stress_veth.$CLIENTS
+    wait
+
+    # Sum the throughput the servers received
+    awk -v clients=$CLIENTS '/receiver/ { total += $7 } END { printf "%2d clients: %8.0f Mbits/sec\n", clients, total }' \
+        /tmp/stress_veth.$CLIENTS
+    rm -f /tmp/stress_veth.$CLIENTS
+done
+
+../user/main show_ctable_stats
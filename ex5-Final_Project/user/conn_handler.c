@@ -48,3 +48,18 @@ void conn_headline(char *str)
 {
     sprintf(str, conn_format, "in_ip", "out_ip", "in_port", "out_port", "state");
 }
+
+
+void ctable_stats2str(const ctable_stats_t *stats, char *str)
+{
+    str += sprintf(str,
+                   "buckets: %u\nconnections: %u\nresizes: %u\nexpired: %u\nallocation failures: %u\n"
+                   "max chain: %u\nchains:\n",
+                   stats->buckets, stats->connections, stats->resizes, stats->expired, stats->alloc_failures,
+                   stats->max_chain);
+
+    for (int i = 0; i < CHAIN_HIST_SIZE; i++)
+    {
+        str += sprintf(str, "  %s%-2d  %u\n", (i == CHAIN_HIST_SIZE - 1) ? ">=" : "  ", i, stats->chains[i]);
+    }
+}
\ No newline at end of file
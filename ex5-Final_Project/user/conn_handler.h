@@ -21,8 +21,25 @@ typedef struct
     tcp_state_t state;
 } connection_t;
 
+// Chain length histogram: lengths 0 .. CHAIN_HIST_SIZE - 2, and the last cell counts anything longer
+#define CHAIN_HIST_SIZE 8
+
+// Connection table statistics
+typedef struct
+{
+    uint32_t buckets;
+    uint32_t connections;
+    uint32_t resizes;
+    uint32_t max_chain;
+    uint32_t chains[CHAIN_HIST_SIZE];
+    uint32_t expired;
+    uint32_t alloc_failures;
+} ctable_stats_t;
+
 void buf2conn(connection_t *conn, const char *buf);
 void conn2str(const connection_t *conn, char *str);
 void conn_headline(char *str);
 
+void ctable_stats2str(const ctable_stats_t *stats, char *str);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "latency_handler.h"
+
+#define BAR_WIDTH 40
+
+static const char *stage_names[STAGES_AMOUNT] = {
+    "parse_packet", "get_log_row", "proxy_route", "find_connection", "stateless_filter", "enforce_state", "log_action",
+};
+
+/**
+ * Write a duration in a readable unit (3 significant digits, the bucket bounds are powers of 2)
+ */
+static void ns2str(char *str, uint64_t ns)
+{
+    if (ns < 1000)
+    {
+        sprintf(str, "%luns", (unsigned long)ns);
+    }
+    else if (ns < 1000000)
+    {
+        sprintf(str, "%.3gus", ns / 1e3);
+    }
+    else if (ns < 1000000000)
+    {
+        sprintf(str, "%.3gms", ns / 1e6);
+    }
+    else
+    {
+        sprintf(str, "%.3gs", ns / 1e9);
+    }
+}
+
+/**
+ * Render the histogram of a stage: a row per non-empty bucket, with a bar relative to the largest one
+ */
+void latency2str(const latency_hists_t *hists, stage_t stage, char *str)
+{
+    const uint64_t *buckets = hists->buckets[stage];
+    uint64_t total = 0, max = 0;
+    char low[16], high[16];
+    int first = LATENCY_BUCKETS, last = -1;
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+    {
+        total += buckets[b];
+        if (buckets[b] > max)
+        {
+            max = buckets[b];
+        }
+        if (buckets[b] != 0)
+        {
+            first = (b < first) ? b : first;
+            last = b;
+        }
+    }
+
+    str += sprintf(str, "%s: %lu samples\n", stage_names[stage], (unsigned long)total);
+
+    // The empty buckets between the first and the last are shown too, so the shape stays readable
+    for (int b = first; b <= last; b++)
+    {
+        if (b == 0)
+        {
+            str += sprintf(str, "  %16s", "0ns");
+        }
+        else
+        {
+            ns2str(low, 1ULL << (b - 1));
+            if (b == LATENCY_BUCKETS - 1)
+            {
+                strcpy(high, "...");
+            }
+            else
+            {
+                ns2str(high, 1ULL << b);
+            }
+            str += sprintf(str, "  [%6s, %6s)", low, high);
+        }
+
+        str += sprintf(str, " %12lu |", (unsigned long)buckets[b]);
+        for (uint64_t i = 0; i < (buckets[b] * BAR_WIDTH + max - 1) / max; i++)
+        {
+            *str++ = '#';
+        }
+        str += sprintf(str, "\n");
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef _LATENCY_HANDLER_H_
+#define _LATENCY_HANDLER_H_
+
+#include "interface.h"
+
+// The stages of the packet inspection the module times
+typedef enum
+{
+    STAGE_PARSE_PACKET,
+    STAGE_GET_LOG_ROW,
+    STAGE_PROXY_ROUTE,
+    STAGE_FIND_CONNECTION,
+    STAGE_STATELESS_FILTER,
+    STAGE_ENFORCE_STATE,
+    STAGE_LOG_ACTION,
+    STAGES_AMOUNT,
+} stage_t;
+
+// Log2 buckets: bucket 0 is 0 ns, bucket b is [2^(b-1), 2^b) ns, and the last one counts the longer ones as well
+#define LATENCY_BUCKETS 32
+
+// The latency histograms of the stages (summed over the CPUs)
+typedef struct
+{
+    uint64_t buckets[STAGES_AMOUNT][LATENCY_BUCKETS];
+} latency_hists_t;
+
+void latency2str(const latency_hists_t *hists, stage_t stage, char *str);
+
+#endif
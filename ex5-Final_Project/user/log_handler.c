@@ -33,6 +33,7 @@ void reason2str(char *str, const reason_t reason)
         REASON_CASE(REASON_TCP_STREAM_ENFORCE)
         REASON_CASE(REASON_FTP_DATA_SESSION)
         REASON_CASE(REASON_TCP_PROXY)
+        REASON_CASE(REASON_CONN_ALLOC_FAILED)
     default:
         sprintf(str, "%d", reason);
     }
@@ -78,3 +79,21 @@ void log_headline(char *str)
     sprintf(str, log_format, "timestamp", "src_ip", "dst_ip", "src_port", "dst_port", "protocol", "action", "reason",
             "count");
 }
+
+void log_record2log_row(const log_record_t *record, log_row_t *log_row)
+{
+    log_row->timestamp = record->timestamp;
+    log_row->protocol = record->protocol;
+    log_row->action = record->action;
+    log_row->src_ip = record->src_ip;
+    log_row->dst_ip = record->dst_ip;
+    log_row->src_port = record->src_port;
+    log_row->dst_port = record->dst_port;
+    log_row->reason = record->reason;
+    log_row->count = 1;
+}
+
+void log_stats2str(const log_stats_t *stats, char *str)
+{
+    sprintf(str, "rows: %u\nallocation failures: %u\n", stats->rows, stats->alloc_failures);
+}
@@ -11,7 +11,8 @@ typedef enum
     REASON_XMAS_PACKET = -4,
     REASON_TCP_STREAM_ENFORCE = -8,
     REASON_FTP_DATA_SESSION = -16,
-    REASON_TCP_PROXY = -32
+    REASON_TCP_PROXY = -32,
+    REASON_CONN_ALLOC_FAILED = -64 // a connection couldn't be tracked (no memory)
 } reason_t;
 
 // logging
@@ -28,8 +29,57 @@ typedef struct
     unsigned int count;      // counts this line's hits
 } log_row_t;
 
+// Log modes: the aggregated list (read through the log device), or per-CPU rings (mapped by the consumer)
+typedef enum
+{
+    LOG_MODE_LIST = 0,
+    LOG_MODE_RING = 1,
+} log_mode_t;
+
+// A record in a log ring
+typedef struct
+{
+    uint64_t timestamp;
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    int32_t reason;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t protocol;
+    uint8_t action;
+    uint8_t reserved[6];
+} log_record_t;
+
+// The header of a log ring. The kernel produces records at head, and we move tail after it.
+typedef struct
+{
+    uint32_t head;
+    uint32_t tail;
+    uint64_t drops;
+} log_ring_header_t;
+
+// Log statistics
+typedef struct
+{
+    uint32_t rows;
+    uint32_t alloc_failures;
+} log_stats_t;
+
+// Describes the mapping of the log rings
+typedef struct
+{
+    uint32_t rings;
+    uint32_t ring_bytes;
+    uint32_t records;
+    uint32_t header_size;
+} log_rings_info_t;
+
 void buf2log_row(log_row_t *log_row, const char *buf);
 void log_row2str(const log_row_t *log_row, char *str);
 void log_headline(char *str);
+void reason2str(char *str, const reason_t reason);
+
+void log_stats2str(const log_stats_t *stats, char *str);
+void log_record2log_row(const log_record_t *record, log_row_t *log_row);
 
 #endif
\ No newline at end of file
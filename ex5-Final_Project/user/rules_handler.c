@@ -214,4 +214,58 @@ uint8_t str2rule(rule_t *rule, const char *str)
     {
         return 0;
     }
-}
\ No newline at end of file
+}
+
+void zone2str(const zone_entry_t *zone, char *str)
+{
+    char ifindex[20] = "absent";
+
+    if (zone->ifindex != 0)
+    {
+        sprintf(ifindex, "ifindex %u", zone->ifindex);
+    }
+    sprintf(str, "%-16.16s  %-8s  %s\n", zone->name, (zone->zone == ZONE_INTERNAL) ? "internal" : "external", ifindex);
+}
+
+uint8_t str2zone(zone_entry_t *zone, const char *str)
+{
+    char zone_str[10];
+
+    memset(zone, 0, sizeof(zone_entry_t));
+    if (sscanf(str, "%15s %9s\n", zone->name, zone_str) != 2)
+    {
+        return 0;
+    }
+
+    if (strcmp(zone_str, "internal") == 0)
+    {
+        zone->zone = ZONE_INTERNAL;
+    }
+    else if (strcmp(zone_str, "external") == 0)
+    {
+        zone->zone = ZONE_EXTERNAL;
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+void tree_stats2str(const tree_stats_t *stats, char *str)
+{
+    sprintf(str, "rules: %u\ndepth: %u\nnodes: %u\nleaves: %u\nrefs: %u\nmax leaf rules: %u\nmemory: %u bytes\n",
+            stats->rules, stats->depth, stats->nodes, stats->leaves, stats->refs, stats->max_leaf_rules,
+            stats->memory);
+}
+
+void hits_headline(char *str)
+{
+    sprintf(str, "%-20s  %-20s  %-20s\n", "rule", "packets", "bytes");
+}
+
+void hits2str(const char *rule_name, const rule_hits_t *hits, char *str)
+{
+    sprintf(str, "%-20.20s  %-20llu  %-20llu\n", rule_name, (unsigned long long)hits->packets,
+            (unsigned long long)hits->bytes);
+}
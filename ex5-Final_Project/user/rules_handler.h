@@ -3,7 +3,7 @@
 
 #include "interface.h"
 
-#define MAX_RULES 50
+#define MAX_RULES (1 << 17)
 
 typedef enum
 {
@@ -35,10 +35,56 @@ typedef struct
     uint8_t action;          // valid values: NF_ACCEPT, NF_DROP
 } rule_t;
 
+// Decision tree statistics
+typedef struct
+{
+    uint32_t rules;
+    uint32_t depth;
+    uint32_t nodes;
+    uint32_t leaves;
+    uint32_t refs;           // total candidates stored in the leaves
+    uint32_t max_leaf_rules; // worst-case amount of rules checked per packet
+    uint32_t memory;         // bytes
+} tree_stats_t;
+
+// Hit counters of a rule
+typedef struct
+{
+    uint64_t packets;
+    uint64_t bytes;
+} rule_hits_t;
+
 void rule2buf(const rule_t *rule, char *buf);
 void buf2rule(rule_t *rule, const char *buf);
 
+// Zones of the network interfaces (the direction of a packet is by the zones of its interfaces)
+#define MAX_ZONES (16)
+#define ZONE_NAME_SIZE (16) // IFNAMSIZ
+
+typedef enum
+{
+    ZONE_NONE,
+    ZONE_INTERNAL,
+    ZONE_EXTERNAL,
+} zone_t;
+
+// An entry of the zone table
+typedef struct
+{
+    char name[ZONE_NAME_SIZE]; // the interface
+    uint32_t ifindex;          // 0 while there is no such interface (ignored on upload)
+    uint8_t zone;              // values from: zone_t
+} zone_entry_t;
+
 void rule2str(const rule_t *rule, char *str);
 uint8_t str2rule(rule_t *rule, const char *str);
 
+void zone2str(const zone_entry_t *zone, char *str);
+uint8_t str2zone(zone_entry_t *zone, const char *str);
+
+void tree_stats2str(const tree_stats_t *stats, char *str);
+
+void hits_headline(char *str);
+void hits2str(const char *rule_name, const rule_hits_t *hits, char *str);
+
 #endif
\ No newline at end of file
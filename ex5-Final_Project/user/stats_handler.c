@@ -0,0 +1,42 @@
+#include "stats_handler.h"
+#include "log_handler.h"
+
+static const char *type_names[PACKET_TYPES_AMOUNT] = {"icmp", "udp", "tcp", "fw", "loopback", "other"};
+
+static const char *route_names[ROUTES_AMOUNT] = {"client to proxy", "server to proxy", "proxy to server",
+                                                 "proxy to client"};
+
+void stats2str(const fw_stats_t *stats, char *str)
+{
+    char reason[30];
+
+    str += sprintf(str, "packets: %lu\nbytes: %lu\npacket types:\n", (unsigned long)stats->packets,
+                   (unsigned long)stats->bytes);
+    for (int i = 0; i < PACKET_TYPES_AMOUNT; i++)
+    {
+        str += sprintf(str, "  %-10s %lu\n", type_names[i], (unsigned long)stats->types[i]);
+    }
+
+    str += sprintf(str, "%-27s %12s %12s\n", "verdicts:", "accept", "drop");
+    for (int i = 0; i < STATS_REASONS; i++)
+    {
+        if (i == 0)
+        {
+            strcpy(reason, "rules");
+        }
+        else
+        {
+            reason2str(reason, -(1 << (i - 1)));
+        }
+        str += sprintf(str, "  %-25s %12lu %12lu\n", reason, (unsigned long)stats->verdicts[i][1],
+                       (unsigned long)stats->verdicts[i][0]);
+    }
+
+    str += sprintf(str, "connections:\n  inserts    %lu\n  removals   %lu\n  misses     %lu\nproxy redirects:\n",
+                   (unsigned long)stats->conn_inserts, (unsigned long)stats->conn_removals,
+                   (unsigned long)stats->conn_misses);
+    for (int i = 0; i < ROUTES_AMOUNT; i++)
+    {
+        str += sprintf(str, "  %-16s %lu\n", route_names[i], (unsigned long)stats->redirects[i]);
+    }
+}
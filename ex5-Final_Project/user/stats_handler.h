@@ -0,0 +1,28 @@
+#ifndef _STATS_HANDLER_H_
+#define _STATS_HANDLER_H_
+
+#include "interface.h"
+
+#define PACKET_TYPES_AMOUNT 6
+#define ROUTES_AMOUNT 4
+
+// The verdicts are counted by reason: 0 for the rules (any rule index), and i for the reason -2^(i-1) of reason_t
+#define STATS_REASONS 8
+
+// The firewall counters (summed over the CPUs).
+// The verdicts are the logged ones: [reason][0] counts the drops, and [reason][1] the accepts.
+typedef struct
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t types[PACKET_TYPES_AMOUNT];
+    uint64_t verdicts[STATS_REASONS][2];
+    uint64_t conn_inserts;
+    uint64_t conn_removals;
+    uint64_t conn_misses;
+    uint64_t redirects[ROUTES_AMOUNT];
+} fw_stats_t;
+
+void stats2str(const fw_stats_t *stats, char *str);
+
+#endif
@@ -1,17 +1,37 @@
 #include "conn_handler.h"
 #include "interface.h"
+#include "latency_handler.h"
 #include "log_handler.h"
 #include "rules_handler.h"
+#include "stats_handler.h"
 
-#define RULES_PATH "/sys/class/fw/rules/rules"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define RULES_DEV_PATH "/dev/rules"
+#define TREE_STATS_PATH "/sys/class/fw/rules/tree_stats"
+#define HITS_PATH "/sys/class/fw/rules/hits"
+#define ZONES_PATH "/sys/class/fw/rules/zones"
 #define LOG_SYS_PATH "/sys/class/fw/fw_log/reset"
 #define LOG_DEV_PATH "/dev/fw_log"
+#define LOG_MODE_PATH "/sys/class/fw/fw_log/mode"
+#define LOG_RINGS_PATH "/sys/class/fw/fw_log/rings"
+#define LOG_STATS_PATH "/sys/class/fw/fw_log/log_stats"
 #define CONN_SYS_PATH "/sys/class/fw/conns/conns"
+#define CTABLE_STATS_PATH "/sys/class/fw/conns/ctable_stats"
+#define LATENCY_ENABLED_PATH "/sys/class/fw/latency/enabled"
+#define LATENCY_HISTS_PATH "/sys/class/fw/latency/hists"
+#define LATENCY_RESET_PATH "/sys/class/fw/latency/reset_hists"
+#define STATS_DEV_PATH "/dev/fw_stats"
 
 // Just to make sure :)
 #define MAX_RULE_LINE 200
 #define MAX_LOG_LINE 200
 #define MAX_CONN_LINE 100
+#define MAX_STATS_TEXT 1000
+#define MAX_LOG_RINGS 500
+#define MAX_LATENCY_TEXT 4000
 
 const uint8_t RULE_BUF_SIZE =
     20 + sizeof(direction_t) + sizeof(ack_t) + 2 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + 4 * sizeof(uint8_t);
@@ -38,26 +58,30 @@ int main(int argc, char *argv[])
 
             DINFO("Showing rules...")
 
-            fw_file = fopen(RULES_PATH, "rb");
+            fw_file = fopen(RULES_DEV_PATH, "rb");
             if (fw_file == NULL)
             {
-                INFO("Can't open (on read mode) rules device in /sys")
+                INFO("Can't open (on read mode) rules device in /dev")
                 return EXIT_FAILURE;
             }
 
-            uint8_t rules_amount;
-            if (fread(&rules_amount, 1, 1, fw_file) == 0)
+            uint32_t rules_amount;
+            if (fread(&rules_amount, sizeof(uint32_t), 1, fw_file) != 1)
             {
                 INFO("Rule table isn't active")
+                fclose(fw_file);
                 return EXIT_SUCCESS;
             }
 
-            for (uint8_t i = 0; i < rules_amount; i++)
+            // The rules are streamed from the device, one at a time
+            for (uint32_t i = 0; i < rules_amount; i++)
             {
                 // Read buffer from rules device
                 if (fread(rule_buf, RULE_BUF_SIZE, 1, fw_file) != 1)
                 {
                     INFO("An reading error from rules device has occurred")
+                    fclose(fw_file);
+                    return EXIT_FAILURE;
                 }
 
                 // Convert buffer to rule struct
@@ -76,9 +100,10 @@ int main(int argc, char *argv[])
 
         else if (strcmp(command, "load_rules") == 0 && argc == 3)
         {
-            rule_t rules[MAX_RULES];
+            rule_t *rules = NULL;
+            uint32_t rules_capacity = 0;
             char rule_str[MAX_RULE_LINE];
-            uint8_t rules_ind;
+            uint32_t rules_ind;
 
             DINFO("Loading rules...")
 
@@ -98,32 +123,51 @@ int main(int argc, char *argv[])
 
                     break;
                 }
-                DINFO("Rule %d : %s", rules_ind + 1, rule_str)
+                DINFO("Rule %u : %s", rules_ind + 1, rule_str)
+
+                // The amount of rules is written before the rules, so hold them until the end of the file
+                if (rules_ind == rules_capacity)
+                {
+                    rules_capacity = (rules_capacity == 0) ? 64 : 2 * rules_capacity;
+                    rules = realloc(rules, rules_capacity * sizeof(rule_t));
+                    if (rules == NULL)
+                    {
+                        INFO("Can't allocate memory for %u rules", rules_capacity)
+                        fclose(rules_file);
+                        return EXIT_FAILURE;
+                    }
+                }
 
                 // Convert rule human-readable string to a rule struct
                 uint8_t valid_rule = str2rule(rules + rules_ind, rule_str);
                 if (!valid_rule)
                 {
-                    INFO("Rule number %d is unvalid!", rules_ind)
+                    INFO("Rule number %u is unvalid!", rules_ind)
+                    free(rules);
+                    fclose(rules_file);
                     return EXIT_FAILURE;
                 }
             }
+            fclose(rules_file);
 
             // We have finished reading the rules, lets write them to the device
-            fw_file = fopen(RULES_PATH, "wb");
+            fw_file = fopen(RULES_DEV_PATH, "wb");
             if (fw_file == NULL)
             {
-                INFO("Can't open (on write mode) rules device in /sys")
+                INFO("Can't open (on write mode) rules device in /dev")
+                free(rules);
+                return EXIT_FAILURE;
             }
 
             // Writing the amount of rules first
-            if (fwrite(&rules_ind, 1, 1, fw_file) != 1)
+            if (fwrite(&rules_ind, sizeof(uint32_t), 1, fw_file) != 1)
             {
                 INFO("An writing error to rules device has occurred")
             }
 
+            // The stream is written to the device in chunks, which may cut a rule in the middle
             char rule_buf[RULE_BUF_SIZE];
-            for (uint8_t i = 0; i < rules_ind; i++)
+            for (uint32_t i = 0; i < rules_ind; i++)
             {
                 // Convert rule struct to buffer
                 rule2buf(rules + i, rule_buf);
@@ -132,13 +176,90 @@ int main(int argc, char *argv[])
                 if (fwrite(rule_buf, RULE_BUF_SIZE, 1, fw_file) != 1)
                 {
                     INFO("An writing error to rules device has occurred")
+                    break;
                 }
             }
+            free(rules);
+
+            // The device commits the rule table on close, and reports whether it was accepted
+            if (fclose(fw_file) != 0)
+            {
+                INFO("The rules device has rejected the rules, the active rule table was kept")
+                return EXIT_FAILURE;
+            }
 
             INFO("The rules have been loaded successfuly")
             return EXIT_SUCCESS;
         }
 
+        else if (strcmp(command, "show_zones") == 0 && argc == 2)
+        {
+            zone_entry_t zone;
+            char zone_str[MAX_RULE_LINE];
+
+            DINFO("Showing zones...")
+
+            fw_file = fopen(ZONES_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) rules device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            while (fread(&zone, sizeof(zone), 1, fw_file) == 1)
+            {
+                zone2str(&zone, zone_str);
+                printf("%s", zone_str);
+            }
+
+            fclose(fw_file);
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "load_zones") == 0 && argc == 3)
+        {
+            zone_entry_t zones[MAX_ZONES];
+            char zone_str[MAX_RULE_LINE];
+            uint32_t zones_amount;
+
+            DINFO("Loading zones...")
+
+            const char *load_path = argv[2];
+            FILE *zones_file = fopen(load_path, "r");
+            if (zones_file == NULL)
+            {
+                INFO("Can't load zones from: %s", load_path)
+                return EXIT_FAILURE;
+            }
+
+            for (zones_amount = 0; fgets(zone_str, MAX_RULE_LINE, zones_file) != NULL; zones_amount++)
+            {
+                if (zones_amount == MAX_ZONES || !str2zone(zones + zones_amount, zone_str))
+                {
+                    INFO("Zone number %u is unvalid (or there are more than %d zones)", zones_amount + 1, MAX_ZONES)
+                    fclose(zones_file);
+                    return EXIT_FAILURE;
+                }
+            }
+            fclose(zones_file);
+
+            // The table is replaced as a whole, so it's written at once
+            fw_file = fopen(ZONES_PATH, "wb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on write mode) rules device in /sys")
+                return EXIT_FAILURE;
+            }
+            if (fwrite(zones, sizeof(zone_entry_t), zones_amount, fw_file) != zones_amount || fclose(fw_file) != 0)
+            {
+                INFO("The rules device has rejected the zones")
+                return EXIT_FAILURE;
+            }
+
+            INFO("The zones have been loaded successfuly")
+            return EXIT_SUCCESS;
+        }
+
         else if (strcmp(command, "show_log") == 0)
         {
             char log_row_buf[LOG_ROW_BUF_SIZE];
@@ -166,7 +287,7 @@ int main(int argc, char *argv[])
             log_headline(log_row_str);
             printf("%s", log_row_str);
 
-            for (uint8_t i = 0; i < rows_amount; i++)
+            for (uint32_t i = 0; i < rows_amount; i++)
             {
                 // Read buffer from log device
                 if (fread(log_row_buf, LOG_ROW_BUF_SIZE, 1, fw_file) != 1)
@@ -188,6 +309,140 @@ int main(int argc, char *argv[])
             return EXIT_SUCCESS;
         }
 
+        else if (strcmp(command, "set_log_mode") == 0 && argc == 3)
+        {
+            uint8_t mode;
+
+            if (strcmp(argv[2], "list") == 0)
+            {
+                mode = LOG_MODE_LIST;
+            }
+            else if (strcmp(argv[2], "ring") == 0)
+            {
+                mode = LOG_MODE_RING;
+            }
+            else
+            {
+                INFO("The log mode should be list or ring")
+                return EXIT_FAILURE;
+            }
+
+            fw_file = fopen(LOG_MODE_PATH, "wb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on write mode) log device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            if (fwrite(&mode, sizeof(mode), 1, fw_file) != 1 || fclose(fw_file) != 0)
+            {
+                INFO("An writing error to log device has occurred")
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "show_log_ring") == 0)
+        {
+            log_rings_info_t info;
+            uint64_t drops[MAX_LOG_RINGS];
+            log_row_t log_row;
+            char log_row_str[MAX_LOG_LINE];
+
+            DINFO("Consuming the log rings...")
+
+            fw_file = fopen(LOG_RINGS_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) log device in /sys")
+                return EXIT_FAILURE;
+            }
+            if (fread(&info, sizeof(info), 1, fw_file) != 1)
+            {
+                INFO("An reading error from log device has occurred")
+                fclose(fw_file);
+                return EXIT_FAILURE;
+            }
+            size_t drops_amount = fread(drops, sizeof(uint64_t), MAX_LOG_RINGS, fw_file);
+            fclose(fw_file);
+
+            // The records are read in place, only the tails are written back
+            int fd = open(LOG_DEV_PATH, O_RDWR);
+            if (fd < 0)
+            {
+                INFO("Can't open (on read/write mode) log device in /dev")
+                return EXIT_FAILURE;
+            }
+            size_t map_size = (size_t)info.rings * info.ring_bytes;
+            char *rings = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (rings == MAP_FAILED)
+            {
+                INFO("Can't map the log rings")
+                return EXIT_FAILURE;
+            }
+
+            log_headline(log_row_str);
+            printf("%s", log_row_str);
+
+            for (uint32_t ring = 0; ring < info.rings; ring++)
+            {
+                log_ring_header_t *header = (log_ring_header_t *)(rings + (size_t)ring * info.ring_bytes);
+                log_record_t *records = (log_record_t *)((char *)header + info.header_size);
+
+                // The kernel publishes head after writing the records before it
+                uint32_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+                uint32_t tail = header->tail;
+
+                for (; tail != head; tail++)
+                {
+                    log_record2log_row(records + (tail & (info.records - 1)), &log_row);
+                    log_row2str(&log_row, log_row_str);
+                    printf("%s", log_row_str);
+                }
+
+                // Hand the consumed records back to the kernel
+                __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+            }
+
+            printf("\ndrops per CPU:\n");
+            for (size_t ring = 0; ring < drops_amount; ring++)
+            {
+                printf("  cpu %-4zu  %llu\n", ring, (unsigned long long)drops[ring]);
+            }
+
+            munmap(rings, map_size);
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "show_log_stats") == 0)
+        {
+            log_stats_t stats;
+            char stats_str[MAX_STATS_TEXT];
+
+            DINFO("showing log statistics");
+
+            fw_file = fopen(LOG_STATS_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) log device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            if (fread(&stats, sizeof(stats), 1, fw_file) != 1)
+            {
+                INFO("An reading error from log device has occurred")
+                fclose(fw_file);
+                return EXIT_FAILURE;
+            }
+
+            log_stats2str(&stats, stats_str);
+            printf("%s", stats_str);
+
+            fclose(fw_file);
+            return EXIT_SUCCESS;
+        }
+
         else if (strcmp(command, "clear_log") == 0)
         {
             DINFO("Clearing log...")
@@ -238,7 +493,7 @@ int main(int argc, char *argv[])
             conn_headline(conn_str);
             printf("%s", conn_str);
 
-            for (uint8_t i = 0; i < connections_amount; i++)
+            for (uint32_t i = 0; i < connections_amount; i++)
             {
                 // Read buffer from log device
                 if (fread(conn_buf, CONN_BUF_SIZE, 1, fw_file) != 1)
@@ -260,6 +515,264 @@ int main(int argc, char *argv[])
             return EXIT_SUCCESS;
         }
 
+        else if (strcmp(command, "show_ctable_stats") == 0)
+        {
+            ctable_stats_t stats;
+            char stats_str[MAX_STATS_TEXT];
+
+            DINFO("showing connection table statistics");
+
+            fw_file = fopen(CTABLE_STATS_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) conns device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            if (fread(&stats, sizeof(stats), 1, fw_file) != 1)
+            {
+                INFO("An reading error from conns device has occurred")
+                return EXIT_FAILURE;
+            }
+
+            ctable_stats2str(&stats, stats_str);
+            printf("%s", stats_str);
+
+            fclose(fw_file);
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "show_tree_stats") == 0)
+        {
+            tree_stats_t stats;
+            char stats_str[MAX_STATS_TEXT];
+
+            DINFO("showing rule tree statistics");
+
+            fw_file = fopen(TREE_STATS_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) rules device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            // An empty read means the rules are scanned linearly
+            if (fread(&stats, sizeof(stats), 1, fw_file) != 1)
+            {
+                printf("no decision tree (linear scan)\n");
+                fclose(fw_file);
+                return EXIT_SUCCESS;
+            }
+
+            tree_stats2str(&stats, stats_str);
+            printf("%s", stats_str);
+
+            fclose(fw_file);
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "show_hits") == 0)
+        {
+            char rule_buf[RULE_BUF_SIZE];
+            rule_t rule;
+            rule_hits_t hits;
+            char hits_str[MAX_RULE_LINE];
+
+            DINFO("Showing rule hits...")
+
+            FILE *hits_file = fopen(HITS_PATH, "rb");
+            if (hits_file == NULL)
+            {
+                INFO("Can't open (on read mode) rules device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            // The rule names are streamed from the rules device alongside the counters
+            fw_file = fopen(RULES_DEV_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) rules device in /dev")
+                fclose(hits_file);
+                return EXIT_FAILURE;
+            }
+
+            uint32_t hits_amount, rules_amount;
+            if (fread(&hits_amount, sizeof(uint32_t), 1, hits_file) != 1 ||
+                fread(&rules_amount, sizeof(uint32_t), 1, fw_file) != 1)
+            {
+                INFO("Rule table isn't active")
+                fclose(fw_file);
+                fclose(hits_file);
+                return EXIT_SUCCESS;
+            }
+
+            if (hits_amount != rules_amount)
+            {
+                INFO("The rule table has been reloaded, try again")
+                fclose(fw_file);
+                fclose(hits_file);
+                return EXIT_FAILURE;
+            }
+
+            hits_headline(hits_str);
+            printf("%s", hits_str);
+
+            // A counter per rule, and a last one for the default drop
+            for (uint32_t i = 0; i <= rules_amount; i++)
+            {
+                if (fread(&hits, sizeof(hits), 1, hits_file) != 1 ||
+                    (i < rules_amount && fread(rule_buf, RULE_BUF_SIZE, 1, fw_file) != 1))
+                {
+                    INFO("An reading error from rules device has occurred")
+                    fclose(fw_file);
+                    fclose(hits_file);
+                    return EXIT_FAILURE;
+                }
+
+                if (i < rules_amount)
+                {
+                    buf2rule(&rule, rule_buf);
+                    hits2str(rule.rule_name, &hits, hits_str);
+                }
+                else
+                {
+                    hits2str("<default drop>", &hits, hits_str);
+                }
+                printf("%s", hits_str);
+            }
+
+            fclose(fw_file);
+            fclose(hits_file);
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "set_latency") == 0 && argc == 3)
+        {
+            uint8_t enabled;
+
+            if (strcmp(argv[2], "on") == 0)
+            {
+                enabled = 1;
+            }
+            else if (strcmp(argv[2], "off") == 0)
+            {
+                enabled = 0;
+            }
+            else
+            {
+                INFO("The latency timing should be on or off")
+                return EXIT_FAILURE;
+            }
+
+            fw_file = fopen(LATENCY_ENABLED_PATH, "wb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on write mode) latency device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            if (fwrite(&enabled, sizeof(enabled), 1, fw_file) != 1 || fclose(fw_file) != 0)
+            {
+                INFO("An writing error to latency device has occurred")
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "show_latency") == 0)
+        {
+            latency_hists_t hists;
+            uint8_t enabled;
+            char hists_str[MAX_LATENCY_TEXT];
+
+            DINFO("Showing latency histograms...")
+
+            fw_file = fopen(LATENCY_ENABLED_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) latency device in /sys")
+                return EXIT_FAILURE;
+            }
+            if (fread(&enabled, sizeof(enabled), 1, fw_file) != 1)
+            {
+                INFO("An reading error from latency device has occurred")
+                fclose(fw_file);
+                return EXIT_FAILURE;
+            }
+            fclose(fw_file);
+
+            fw_file = fopen(LATENCY_HISTS_PATH, "rb");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on read mode) latency device in /sys")
+                return EXIT_FAILURE;
+            }
+            if (fread(&hists, sizeof(hists), 1, fw_file) != 1)
+            {
+                INFO("An reading error from latency device has occurred")
+                fclose(fw_file);
+                return EXIT_FAILURE;
+            }
+            fclose(fw_file);
+
+            printf("latency timing: %s\n", enabled ? "on" : "off");
+            for (int stage = 0; stage < STAGES_AMOUNT; stage++)
+            {
+                latency2str(&hists, stage, hists_str);
+                printf("%s", hists_str);
+            }
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "reset_latency") == 0)
+        {
+            DINFO("Resetting latency histograms...")
+
+            fw_file = fopen(LATENCY_RESET_PATH, "w");
+            if (fw_file == NULL)
+            {
+                INFO("Can't open (on write mode) latency device in /sys")
+                return EXIT_FAILURE;
+            }
+
+            if (fputc('$', fw_file) == EOF || fclose(fw_file) != 0)
+            {
+                INFO("An writing error to latency device has occurred")
+                return EXIT_FAILURE;
+            }
+
+            INFO("The latency histograms have been reset successfuly")
+            return EXIT_SUCCESS;
+        }
+
+        else if (strcmp(command, "show_stats") == 0)
+        {
+            fw_stats_t stats;
+            char stats_str[MAX_STATS_TEXT * 2];
+
+            DINFO("Showing firewall statistics...")
+
+            int fd = open(STATS_DEV_PATH, O_RDONLY);
+            if (fd < 0)
+            {
+                INFO("Can't open (on read mode) stats device in /dev")
+                return EXIT_FAILURE;
+            }
+
+            // The counters are summed by the module, and passed in a single read
+            if (read(fd, &stats, sizeof(stats)) != sizeof(stats))
+            {
+                INFO("An reading error from stats device has occurred")
+                close(fd);
+                return EXIT_FAILURE;
+            }
+            close(fd);
+
+            stats2str(&stats, stats_str);
+            printf("%s", stats_str);
+            return EXIT_SUCCESS;
+        }
+
         else
         {
             INFO("Unrecognized command\n")